@@ -1,43 +1,445 @@
+#define _GNU_SOURCE
+
 #include "fat32.h"
 #include "fat_utf16_utf8.h"
 #include "lfn.h"
+#include "fat_dirindex.h"
+#include "fat_overlay.h"
+#include "fat_catalog.h"
+#include "fat_sched.h"
+#include "fat_trace.h"
 #include "vfs.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-void fat32_init(const char* filename, fat_t* fat) {
-    FILE* file = fopen(filename, "r+b");
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+
+// FSInfo sector layout (offsets in bytes).
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_STRUCT_OFFSET 484
+#define FSINFO_FREE_COUNT_OFFSET 488
+// Our generation counter lives in the reserved bytes after the next free hint, behind
+// a tag so zeros or other tools' data there are not taken for one.
+#define FSINFO_GENERATION_OFFSET 496
+#define FSINFO_GENERATION_TAG 0x4E454746
+
+static void fat32_load_geometry(fat_t* fat, FILE* file) {
     fat->image = file;
+    pthread_mutex_init(&fat->fat_lock, NULL);
 
     FATInfo_t* info = calloc(1, sizeof(FATInfo_t));
-    fread(info, sizeof(FATInfo_t), 1, file);
+    fat32_read_at(fat, 0, info, sizeof(FATInfo_t));
     fat->fat = info;
 
     fat->cluster_size = info->bytes_per_sector * info->sectors_per_cluster;
+    fat->cluster_shift = fat->cluster_size ? __builtin_ctz(fat->cluster_size) : 0;
+    fat->cluster_mask = fat->cluster_size - 1;
     fat->fat_offset = info->reserved_sectors * info->bytes_per_sector;
     fat->fat_size = info->fat_size_in_sectors * info->bytes_per_sector;
     fat->reserved_fat_offset = (info->reserved_sectors + info->fat_size_in_sectors) * info->bytes_per_sector;
 
-    uint32_t two_fats = info->fat_size_in_sectors * 2;
-    uint32_t tot_cluster = (info->reserved_sectors + two_fats) + ((info->root_directory_offset_in_clusters - 2) * info->sectors_per_cluster);
+    // Cluster 2 starts right after the `copies` FATs. With large clusters and a small reserved
+    // area that is less than two clusters into the image, so cluster_base wraps below zero.
+    uint64_t data_offset =
+        ((uint64_t)info->reserved_sectors + (uint64_t)info->copies * info->fat_size_in_sectors) * info->bytes_per_sector;
+
+    fat->cluster_base = data_offset - 2 * (uint64_t)fat->cluster_size;
+    fat->root_directory_offset = fat32_cluster_offset(fat, info->root_directory_offset_in_clusters);
+
+    uint32_t total_sectors = info->small_sectors_number ? info->small_sectors_number : info->sectors_in_partition;
+    uint32_t data_sectors = total_sectors - (info->reserved_sectors + info->copies * info->fat_size_in_sectors);
+
+    fat->cluster_count = data_sectors / info->sectors_per_cluster + 2;
+    if (fat->cluster_count > fat->fat_size / sizeof(uint32_t)) {
+        fat->cluster_count = fat->fat_size / sizeof(uint32_t);
+    }
+
+    fat->next_free = 2;
+    fat->free_clusters = FAT32_FREE_UNKNOWN;
+    fat->compact_threshold = FAT32_COMPACT_THRESHOLD;
+}
+
+static size_t fat32_fsinfo_offset(fat_t* fat) {
+    uint16_t sector = fat->fat->fsinfo_sector;
+
+    if (sector == 0 || sector == 0xFFFF || sector >= fat->fat->reserved_sectors) {
+        return 0;
+    }
+
+    return (size_t)sector * fat->fat->bytes_per_sector;
+}
+
+// Free count and allocation hint from the FSInfo sector. Both are only hints, values
+// out of range are ignored and the count is then rebuilt on first use.
+static void fat32_load_fsinfo(fat_t* fat) {
+    size_t offset = fat32_fsinfo_offset(fat);
+    uint32_t lead = 0;
+    uint32_t fields[3] = {0};  // Signature, free count, next free
+
+    if (offset == 0) {
+        return;
+    }
+
+    fat32_read_at(fat, offset, &lead, sizeof(lead));
+    fat32_read_at(fat, offset + FSINFO_STRUCT_OFFSET, fields, sizeof(fields));
+
+    if (lead != FSINFO_LEAD_SIGNATURE || fields[0] != FSINFO_STRUCT_SIGNATURE) {
+        return;
+    }
+
+    if (fields[1] <= fat->cluster_count - 2) {
+        fat->free_clusters = fields[1];
+    }
+
+    if (fields[2] >= 2 && fields[2] < fat->cluster_count) {
+        fat->next_free = fields[2];
+    }
+
+    uint32_t generation[2] = {0};  // Tag, counter
+    fat32_read_at(fat, offset + FSINFO_GENERATION_OFFSET, generation, sizeof(generation));
+
+    if (generation[0] == FSINFO_GENERATION_TAG) {
+        fat->generation = generation[1];
+    }
+}
+
+static size_t fat32_pwrite(fat_t* fat, size_t offset, const void* buffer, size_t size);
+
+static void fat32_sync_fsinfo(fat_t* fat) {
+    size_t offset = fat32_fsinfo_offset(fat);
+
+    if (fat->read_only || offset == 0) {
+        return;
+    }
+
+    if (__atomic_exchange_n(&fat->modified, false, __ATOMIC_ACQ_REL)) {
+        fat->generation++;
+        fat->fsinfo_dirty = true;
+    }
+
+    if (!fat->fsinfo_dirty) {
+        return;
+    }
+
+    pthread_mutex_lock(&fat->fat_lock);
+    uint32_t fields[4] = {fat->free_clusters, fat->next_free, FSINFO_GENERATION_TAG, fat->generation};
+    fat->fsinfo_dirty = false;
+    pthread_mutex_unlock(&fat->fat_lock);
+
+    // Not a change of the volume's contents, so it does not count as a write itself.
+    fat32_pwrite(fat, offset + FSINFO_FREE_COUNT_OFFSET, fields, sizeof(fields));
+}
+
+// Number of free clusters. Counted once by scanning the FAT if FSInfo had no usable value.
+uint32_t fat32_free_clusters(fat_t* fat) {
+    if (fat->free_clusters == FAT32_FREE_UNKNOWN) {
+        uint32_t free_clusters = 0;
+
+        for (uint32_t cluster = 2; cluster < fat->cluster_count; cluster++) {
+            if (fat32_get_fat_entry(fat, cluster) == 0) {
+                free_clusters++;
+            }
+        }
+
+        pthread_mutex_lock(&fat->fat_lock);
+        fat->free_clusters = free_clusters;
+        fat->fsinfo_dirty = true;
+        pthread_mutex_unlock(&fat->fat_lock);
+    }
+
+    return fat->free_clusters;
+}
+
+void fat32_init(const char* filename, fat_t* fat) {
+    memset(fat, 0, sizeof(fat_t));
+
+    fat32_load_geometry(fat, fopen(filename, "r+b"));
+    fat32_load_fsinfo(fat);
+
+    // FAT is not read here, pages are loaded on first access.
+    fat_cache_init(&fat->fat_cache, FAT_CACHE_PAGE_SECTORS * fat->fat->bytes_per_sector, FAT_CACHE_DEFAULT_PAGES);
+}
+
+// Overlay mount: the base image is never written, every change goes to a sparse
+// delta file at cluster granularity. The boot sector is read before the delta is
+// attached, which is fine since nothing ever rewrites it.
+bool fat32_init_overlay(const char* base_filename, const char* delta_filename, fat_t* fat) {
+    memset(fat, 0, sizeof(fat_t));
+
+    FILE* base = fopen(base_filename, "rb");
+
+    if (base == NULL) {
+        return false;
+    }
+
+    fat32_load_geometry(fat, base);
+
+    // Blocks line up with data clusters, so a cluster write never copies up a neighbour.
+    uint32_t shift = (uint32_t)-fat->cluster_base & fat->cluster_mask;
+    fat->overlay = fat_overlay_open(base_filename, fileno(base), delta_filename, fat->cluster_size, shift,
+                                    fat->fat->volume_serial_number);
+
+    if (fat->overlay == NULL) {
+        pthread_mutex_destroy(&fat->fat_lock);
+        fclose(base);
+        free(fat->fat);
+        return false;
+    }
+
+    fat32_load_fsinfo(fat);
+    fat_cache_init(&fat->fat_cache, FAT_CACHE_PAGE_SECTORS * fat->fat->bytes_per_sector, FAT_CACHE_DEFAULT_PAGES);
+
+    return true;
+}
+
+// Writes the delta back into the base image. The mount keeps working on the now
+// empty delta.
+bool fat32_overlay_commit(fat_t* fat) {
+    if (fat->overlay == NULL) {
+        return false;
+    }
+
+    fat32_flush(fat);
+
+    return fat_overlay_commit(fat->overlay);
+}
+
+// Makes the delta reopenable with everything written so far. Flushes do not do this, the
+// bitmap costs two fdatasyncs; commit and close persist it as well.
+bool fat32_overlay_sync(fat_t* fat) {
+    if (fat->overlay == NULL) {
+        return false;
+    }
+
+    fat32_flush(fat);
+
+    return fat_overlay_sync(fat->overlay);
+}
+
+// Drops every change since the delta was created or last committed. In-memory state
+// derived from the image (FAT pages, directory indexes, FSInfo hints) goes with it.
+void fat32_overlay_discard(fat_t* fat) {
+    if (fat->overlay == NULL) {
+        return;
+    }
+
+    size_t capacity = fat->fat_cache.capacity;
+    fat_page_pool_t* pool = fat->fat_cache.pool;
+
+    fat_dir_index_clear(fat);
+    fat->compact_count = 0;
+
+    fat_cache_destroy(&fat->fat_cache);
+    fat_overlay_clear(fat->overlay);
+
+    fat->next_free = 2;
+    fat->free_clusters = FAT32_FREE_UNKNOWN;
+    fat->fsinfo_dirty = false;
+    fat32_load_fsinfo(fat);
+
+    fat_cache_init(&fat->fat_cache, FAT_CACHE_PAGE_SECTORS * fat->fat->bytes_per_sector, capacity);
+    fat->fat_cache.pool = pool;
+}
+
+// Read-only mount: the FAT is scanned once and kept as a run-length index,
+// so memory follows fragmentation instead of volume size.
+void fat32_init_readonly(const char* filename, fat_t* fat) {
+    memset(fat, 0, sizeof(fat_t));
+
+    fat32_load_geometry(fat, fopen(filename, "rb"));
+    fat32_load_fsinfo(fat);
+
+    fat->read_only = true;
+    fat->fat_runs = calloc(1, sizeof(fat_rle_t));
+    fat_rle_init(fat->fat_runs);
+
+    size_t chunk_size = FAT_CACHE_PAGE_SECTORS * fat->fat->bytes_per_sector;
+    uint32_t* chunk = calloc(1, chunk_size);
+    uint32_t per_chunk = chunk_size / sizeof(uint32_t);
+
+    for (uint32_t base = 0; base < fat->cluster_count; base += per_chunk) {
+        fat32_read_at(fat, fat->fat_offset + (size_t)base * sizeof(uint32_t), chunk, chunk_size);
+
+        for (uint32_t i = 0; i < per_chunk && base + i < fat->cluster_count; i++) {
+            fat_rle_append(fat->fat_runs, base + i, chunk[i] & 0x0FFFFFFF);
+        }
+    }
 
-    fat->cluster_base = ((info->reserved_sectors + two_fats) - 2) * info->sectors_per_cluster * info->bytes_per_sector;
-    fat->root_directory_offset = tot_cluster * info->bytes_per_sector;
+    free(chunk);
+    fat_rle_finish(fat->fat_runs);
 
-    fat->fat_chain = calloc(fat->fat_size, 1);
-    fseek(fat->image, fat->fat_offset, SEEK_SET);
-    fread(fat->fat_chain, fat->fat_size, 1, file);
+    // Exact count from the free extents; the FSInfo hint may be stale and cannot be fixed here.
+    fat->free_clusters = fat_rle_free_clusters(fat->fat_runs);
 }
 
 void fat32_deinit(fat_t* fat) {
+    if (!fat->read_only) {
+        fat32_maintenance(fat);
+    }
+
+    fat_dir_index_clear(fat);
+
+    if (fat->fat_runs) {
+        fat_rle_destroy(fat->fat_runs);
+        free(fat->fat_runs);
+    } else {
+        fat_cache_flush(fat);
+        fat32_sync_fsinfo(fat);
+        fat_cache_destroy(&fat->fat_cache);
+    }
+
+    fat_catalog_detach(fat);
+    fat_sched_detach(fat);
+    fat_trace_stop(fat);
+
+    if (fat->overlay) {
+        fat_overlay_close(fat->overlay);
+    }
+
+    pthread_mutex_destroy(&fat->fat_lock);
+
     fclose(fat->image);
-    free(fat->fat_chain);
     free(fat->fat);
 }
 
+// Positional I/O, so several threads can share one image. Everything below ends up in
+// fat32_device_io, through the scheduler when one is attached.
+size_t fat32_read_at(fat_t* fat, size_t offset, void* buffer, size_t size) {
+    struct iovec vector = {buffer, size};
+
+    return fat32_readv_at(fat, offset, &vector, 1);
+}
+
+static size_t fat32_io(fat_t* fat, bool write, size_t offset, const struct iovec* iov, int count) {
+    return fat->sched ? fat_sched_submit(fat->sched, write, offset, iov, count)
+                      : fat32_device_io(fat, write, offset, iov, count);
+}
+
+static size_t fat32_pwrite(fat_t* fat, size_t offset, const void* buffer, size_t size) {
+    struct iovec vector = {(void*)buffer, size};
+
+    return fat32_io(fat, true, offset, &vector, 1);
+}
+
+size_t fat32_write_at(fat_t* fat, size_t offset, const void* buffer, size_t size) {
+    fat->modified = true;
+
+    return fat32_pwrite(fat, offset, buffer, size);
+}
+
+// Vectored forms of the above: one call for a whole physical run.
+size_t fat32_readv_at(fat_t* fat, size_t offset, const struct iovec* iov, int count) {
+    return fat32_io(fat, false, offset, iov, count);
+}
+
+size_t fat32_writev_at(fat_t* fat, size_t offset, const struct iovec* iov, int count) {
+    fat->modified = true;
+
+    return fat32_io(fat, true, offset, iov, count);
+}
+
+// The one place that touches the image. Overlays split vectored calls up again, their
+// blocks may come from either file.
+size_t fat32_device_io(fat_t* fat, bool write, size_t offset, const struct iovec* iov, int count) {
+    ssize_t result = 0;
+
+    if (fat->overlay) {
+        for (int i = 0; i < count; i++) {
+            size_t done = write ? fat_overlay_write(fat->overlay, offset + result, iov[i].iov_base, iov[i].iov_len)
+                                : fat_overlay_read(fat->overlay, offset + result, iov[i].iov_base, iov[i].iov_len);
+
+            result += done;
+
+            if (done < iov[i].iov_len) {
+                break;
+            }
+        }
+    } else if (count == 1) {
+        result = write ? pwrite(fileno(fat->image), iov[0].iov_base, iov[0].iov_len, offset)
+                       : pread(fileno(fat->image), iov[0].iov_base, iov[0].iov_len, offset);
+    } else {
+        // The kernel takes at most IOV_MAX vectors per call.
+        for (int first = 0; first < count; first += IOV_MAX) {
+            int batch = count - first < IOV_MAX ? count - first : IOV_MAX;
+            size_t wanted = 0;
+
+            for (int i = first; i < first + batch; i++) {
+                wanted += iov[i].iov_len;
+            }
+
+            ssize_t done = write ? pwritev(fileno(fat->image), iov + first, batch, offset + result)
+                                 : preadv(fileno(fat->image), iov + first, batch, offset + result);
+
+            result += done > 0 ? done : 0;
+
+            if (done < 0 || (size_t)done < wanted) {
+                break;
+            }
+        }
+    }
+
+    if (write) {
+        FAT_METRIC_ADD(fat, write_calls, 1);
+        FAT_METRIC_ADD(fat, bytes_written, result > 0 ? result : 0);
+    } else {
+        FAT_METRIC_ADD(fat, read_calls, 1);
+        FAT_METRIC_ADD(fat, bytes_read, result > 0 ? result : 0);
+    }
+
+    return result > 0 ? result : 0;
+}
+
+// Makes a byte range of the image read back as zeros, through the scheduler when one is
+// attached, so zeroing is ordered and budgeted like the writes around it.
+void fat32_zero_range(fat_t* fat, size_t offset, size_t size) {
+    fat->modified = true;
+
+    if (fat->sched) {
+        fat_sched_submit_zero(fat->sched, offset, size);
+    } else {
+        fat32_device_zero(fat, offset, size);
+    }
+}
+
+// fat32_device_io's counterpart for zeroing. On file-backed images this is done with
+// fallocate and costs no data I/O; otherwise zeros are written.
+void fat32_device_zero(fat_t* fat, size_t offset, size_t size) {
+    if (fat->overlay) {
+        fat_overlay_zero(fat->overlay, offset, size);
+        return;
+    }
+
+#ifdef __linux__
+    int fd = fileno(fat->image);
+
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+        return;
+    }
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+        return;
+    }
+#endif
+
+    size_t chunk_size = size < 64 * 1024 ? size : 64 * 1024;
+    char* zero_buffer = calloc(1, chunk_size);
+
+    for (size_t done = 0; done < size; done += chunk_size) {
+        struct iovec vector = {zero_buffer, size - done < chunk_size ? size - done : chunk_size};
+
+        fat32_device_io(fat, true, offset + done, &vector, 1);
+    }
+
+    free(zero_buffer);
+}
+
 void print_directory_entry(DirectoryEntry_t* entry) {
     char filename[13];
     snprintf(filename, sizeof(filename), "%.8s.%.3s", entry->name, entry->ext);
@@ -48,112 +450,89 @@ void print_directory_entry(DirectoryEntry_t* entry) {
     }
 }
 
-direntry_t* read_directory(fat_t* fat, uint32_t start_cluster) {
-    uint32_t cluster_count = read_cluster_chain(fat, start_cluster, true, NULL);
-
-    char* cluster_data = calloc(cluster_count, fat->cluster_size);
-    read_cluster_chain(fat, start_cluster, false, cluster_data);
-
-    int32_t current_offset = cluster_count * fat->cluster_size - 32;   // We must start from the end.
+static void fat32_format_short_name(const DirectoryEntry_t* entry, char* out) {
+    size_t len = 0;
 
-    uint32_t cluster_size = fat->cluster_size;
-    uint32_t offset = start_cluster * cluster_size;
-    fseek(fat->image, offset, SEEK_SET);
-
-    direntry_t* dir = calloc(1, sizeof(direntry_t));
-    direntry_t* dirptr = dir;
-
-    DirectoryEntry_t* prev = (DirectoryEntry_t*)(cluster_data + cluster_count);
-    uint16_t in_name_buffer[256] = {0};
-    size_t in_name_ptr = 0;
-    char out_name_buffer[256] = {0};
+    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) {
+        out[len++] = entry->name[i];
+    }
 
-    do {
-        DirectoryEntry_t* entry = (DirectoryEntry_t*)(cluster_data + current_offset);
+    if (entry->ext[0] != ' ') {
+        out[len++] = '.';
 
-        if (entry->name[0] == 0x00) {
-            goto next;
+        for (int i = 0; i < 3 && entry->ext[i] != ' '; i++) {
+            out[len++] = entry->ext[i];
         }
+    }
 
-        if ((uint8_t)entry->name[0] == 0xE5) {
-            goto next;
-        }
+    out[len] = '\0';
+}
 
-        if (entry->attributes & ATTR_LONG_FILE_NAME) {
-            LFN_t* lfn = (LFN_t*)(cluster_data + current_offset);
+// DOS dates count years from 1980; times have two second resolution, refined by the
+// creation tenths (0-199, units of 10 ms). A zero date means the field is not set.
+void fat32_decode_datetime(uint16_t date, uint16_t time, uint8_t tenths, datetime_t* out) {
+    memset(out, 0, sizeof(datetime_t));
 
-            for(int p1 = 0; p1 < 5; p1++) {
-                if(lfn->first_name_chunk[p1] == 0x0000) {
-                    goto lfn_next;
-                }
+    if (date == 0) {
+        return;
+    }
 
-                in_name_buffer[in_name_ptr++] = lfn->first_name_chunk[p1];
-            }
+    out->year = 1980 + (date >> 9);
+    out->month = (date >> 5) & 0x0F;
+    out->day = date & 0x1F;
+    out->hour = time >> 11;
+    out->minute = (time >> 5) & 0x3F;
+    out->second = (time & 0x1F) * 2 + tenths / 100;
+    out->millis = (tenths % 100) * 10;
+}
 
-            for(int p2 = 0; p2 < 6; p2++) {
-                if(lfn->second_name_chunk[p2] == 0x0000) {
-                    goto lfn_next;
-                }
+void fat32_free_directory(direntry_t* dir) {
+    while (dir) {
+        direntry_t* next = dir->next;
 
-                in_name_buffer[in_name_ptr++] = lfn->second_name_chunk[p2];
-            }
-           
-            for(int p3 = 0; p3 < 2; p3++) {
-                if(lfn->third_name_chunk[p3] == 0x0000) {
-                    goto lfn_next;
-                }
+        free(dir->name);
+        free(dir);
 
-                in_name_buffer[in_name_ptr++] = lfn->third_name_chunk[p3];
-            }
+        dir = next;
+    }
+}
 
-lfn_next:
-            if(lfn->attr_number & 0x40) {
-                utf16_to_utf8(in_name_buffer, in_name_ptr, out_name_buffer);
+typedef struct {
+    direntry_t* head;
+    direntry_t** tail;
+} fat32_listing_t;
 
-                dirptr->name = calloc(256, 1);
-                memcpy(dirptr->name, out_name_buffer, 256);
+static bool fat32_list_visit(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    fat32_listing_t* listing = ctx;
+    const DirectoryEntry_t* entry = &dirent->entry;
+    direntry_t* item = calloc(1, sizeof(direntry_t));
 
-                dirptr->type = (prev->attributes & ATTR_DIRECTORY) ? ENT_DIRECTORY : ENT_FILE;
-                dirptr->size = prev->file_size;
-                dirptr->priv_data = (void*)(size_t)((prev->high_cluster << 16) | prev->low_cluster);
+    item->name = strdup(dirent->name);
+    item->type = (entry->attributes & ATTR_DIRECTORY) ? ENT_DIRECTORY : ENT_FILE;
+    item->size = entry->file_size;
+    item->priv_data = (void*)(size_t)FAT_DIRENT_CLUSTER(entry);
+    fat32_decode_datetime(entry->creation_date, entry->creation_time, entry->creation_time_tenths, &item->created);
+    fat32_decode_datetime(entry->modification_date, entry->modification_time, 0, &item->modified);
 
-                if(current_offset != 0) {
-                    dirptr->next = calloc(1, sizeof(direntry_t));
-                    dirptr = dirptr->next;
-                }
+    *listing->tail = item;
+    listing->tail = &item->next;
 
-                memset(in_name_buffer, 0, 512);
-                memset(out_name_buffer, 0, 256);
-                in_name_ptr = 0;
-            }
+    return true;
+}
 
-            current_offset -= 32;
-            continue;
-        } 
-       
-        if(!(current_offset - 32 >= 0 && ((entry - 1)->attributes & ATTR_LONG_FILE_NAME))) {
-            dirptr->name = calloc(12, 1);
-            memcpy(dirptr->name, entry->name, 8);
-            memcpy(dirptr->name + 8, entry->ext, 3);
-
-            dirptr->type = (entry->attributes & ATTR_DIRECTORY) ? ENT_DIRECTORY : ENT_FILE;
-            dirptr->size = entry->file_size;
-            dirptr->priv_data = (void*)(size_t)((entry->high_cluster << 16) | entry->low_cluster);
-
-            if(current_offset != 0) {
-                dirptr->next = calloc(1, sizeof(direntry_t));
-                dirptr = dirptr->next;
-            }
-        }
-next:
-        current_offset -= 32;
+// Entries in directory order, "." and ".." included; NULL for an empty directory.
+direntry_t* read_directory(fat_t* fat, uint32_t start_cluster) {
+    uint64_t traced = fat_trace_begin(fat);
+    fat32_listing_t listing = {0};
 
-        prev = entry;
-    } while (current_offset >= 0); 
+    listing.tail = &listing.head;
 
-    free(cluster_data);
+    fat32_iterate_directory(fat, start_cluster, 0, fat32_list_visit, &listing);
 
-    return dir;
+    FAT_TRACE_END(fat, traced, FAT_TRACE_READDIR, NULL, NULL, .cluster = start_cluster);
+
+    return listing.head;
 }
 
 size_t read_cluster_chain(fat_t* fat, uint32_t start_cluster, bool probe, void* out) {
@@ -161,663 +540,2241 @@ size_t read_cluster_chain(fat_t* fat, uint32_t start_cluster, bool probe, void*
 
     uint32_t cluster_size = fat->cluster_size;
     uint32_t cluster = start_cluster;
-    while (cluster < 0x0FFFFFF8) {  // Проверка на последний кластер в цепочке
+    // A cyclic chain can not be longer than the volume, stop there.
+    while (cluster >= 2 && cluster < fat->cluster_count && cluster_count < fat->cluster_count) {  // Проверка на последний кластер в цепочке
         if(!probe) {
-            uint32_t offset = fat->cluster_base + (cluster * cluster_size);
-            printf("Offset: %x\n", offset);
-            fseek(fat->image, offset, SEEK_SET);
+            uint64_t offset = fat32_cluster_offset(fat, cluster);
+            FAT_DEBUG("Offset: %llx\n", (unsigned long long)offset);
 
-            fread(((char*)out) + (cluster_count * cluster_size), cluster_size, 1, fat->image);
+            fat32_read_at(fat, offset, ((char*)out) + (cluster_count * cluster_size), cluster_size);
         }
         
-        cluster = fat->fat_chain[cluster];
+        cluster = fat32_get_fat_entry(fat, cluster);
         cluster_count++;
     }
 
     return cluster_count;
 }
 
-size_t read_cluster_chain_advanced(fat_t* fat, uint32_t start_cluster, size_t byte_offset, size_t size, bool probe, void* out) {
-    uint32_t cluster_size = fat->cluster_size;
-    uint32_t cluster = start_cluster;
+// Chain walk behind read_cluster_chain_advanced. Every instance below passes `shift` as a
+// constant, so splitting the offset and sizing runs take no divisions. Clusters that follow
+// each other on disk are read with one call.
+static inline __attribute__((always_inline)) size_t fat32_read_chain_kernel(fat_t* fat, uint32_t cluster, size_t byte_offset, size_t size, bool probe, char* out, const unsigned shift) {
+    const size_t cluster_size = (size_t)1 << shift;
+    size_t skip = byte_offset >> shift;
+    size_t in_cluster = byte_offset & (cluster_size - 1);
     size_t total_bytes_read = 0;
     size_t cluster_count = 0;
-    
-    while (byte_offset >= cluster_size) {
-        cluster = fat->fat_chain[cluster];
-        byte_offset -= cluster_size;
+
+    while (skip-- > 0) {
+        cluster = fat32_get_fat_entry(fat, cluster);
         cluster_count++;
-        
-        if (cluster >= 0x0FFFFFF8) {
-            return total_bytes_read;  // End of chain reached
+
+        if (cluster < 2 || cluster >= fat->cluster_count) {
+            return 0;  // End of chain reached
+        }
+    }
+
+    while (cluster >= 2 && cluster < fat->cluster_count && total_bytes_read < size && cluster_count < fat->cluster_count) {
+        if (probe) {
+            cluster = fat32_get_fat_entry(fat, cluster);
+            cluster_count++;
+            continue;
+        }
+
+        uint32_t first = cluster;
+        uint32_t run = 1;
+        size_t length = cluster_size - in_cluster;
+
+        cluster = fat32_get_fat_entry(fat, cluster);
+        cluster_count++;
+
+        while (length < size - total_bytes_read && cluster == first + run && cluster_count < fat->cluster_count) {
+            cluster = fat32_get_fat_entry(fat, cluster);
+            cluster_count++;
+            run++;
+            length += cluster_size;
+        }
+
+        if (length > size - total_bytes_read) {
+            length = size - total_bytes_read;
         }
+
+        fat32_read_at(fat, fat32_cluster_offset(fat, first) + in_cluster, out + total_bytes_read, length);
+
+        total_bytes_read += length;
+        in_cluster = 0;  // Only the first run starts inside a cluster
+    }
+
+    return total_bytes_read;
+}
+
+static size_t fat32_read_chain_4k(fat_t* fat, uint32_t cluster, size_t byte_offset, size_t size, bool probe, char* out) {
+    return fat32_read_chain_kernel(fat, cluster, byte_offset, size, probe, out, 12);
+}
+
+static size_t fat32_read_chain_32k(fat_t* fat, uint32_t cluster, size_t byte_offset, size_t size, bool probe, char* out) {
+    return fat32_read_chain_kernel(fat, cluster, byte_offset, size, probe, out, 15);
+}
+
+static size_t fat32_read_chain_64k(fat_t* fat, uint32_t cluster, size_t byte_offset, size_t size, bool probe, char* out) {
+    return fat32_read_chain_kernel(fat, cluster, byte_offset, size, probe, out, 16);
+}
+
+size_t read_cluster_chain_advanced(fat_t* fat, uint32_t start_cluster, size_t byte_offset, size_t size, bool probe, void* out) {
+    FAT_OP_BEGIN(started);
+    uint64_t traced = fat_trace_begin(fat);
+    size_t total_bytes_read;
+
+    switch (fat->cluster_shift) {
+    case 12:
+        total_bytes_read = fat32_read_chain_4k(fat, start_cluster, byte_offset, size, probe, out);
+        break;
+    case 15:
+        total_bytes_read = fat32_read_chain_32k(fat, start_cluster, byte_offset, size, probe, out);
+        break;
+    case 16:
+        total_bytes_read = fat32_read_chain_64k(fat, start_cluster, byte_offset, size, probe, out);
+        break;
+    default:
+        total_bytes_read = fat32_read_chain_kernel(fat, start_cluster, byte_offset, size, probe, out, fat->cluster_shift);
+        break;
+    }
+
+    FAT_OP_END(fat, FAT_OP_READ, started);
+    FAT_TRACE_END(fat, traced, FAT_TRACE_READ, NULL, NULL, .cluster = start_cluster, .offset = byte_offset,
+                  .size = size, .result = total_bytes_read);
+
+    return total_bytes_read;
+}
+
+size_t fat32_iterate_directory(fat_t* fat, uint32_t start_cluster, size_t max_clusters, fat32_dirent_fn_t fn, void* ctx) {
+    uint32_t cluster_size = fat->cluster_size;
+    uint32_t slots_per_cluster = cluster_size / sizeof(DirectoryEntry_t);
+    char* cluster_data = calloc(1, cluster_size);
+
+    if (max_clusters == 0 || max_clusters > fat->cluster_count) {
+        max_clusters = fat->cluster_count;
     }
 
-    while (cluster < 0x0FFFFFF8 && total_bytes_read < size) {
-        if (!probe) {
-            uint32_t offset = fat->cluster_base + (cluster * cluster_size) + byte_offset;
-            size_t bytes_to_read = cluster_size - byte_offset;
-            
-            if (bytes_to_read > size - total_bytes_read) {
-                bytes_to_read = size - total_bytes_read;
+    fat32_dirent_t* dirent = calloc(1, sizeof(fat32_dirent_t));
+    uint16_t lfn_name[260] = {0};
+    size_t lfn_length = 0;
+    uint8_t lfn_checksum_value = 0;
+    uint32_t lfn_count = 0;
+    uint8_t lfn_next = 0;  // Sequence number the next LFN entry must carry, 0 once complete
+
+    uint32_t cluster = start_cluster;
+    size_t visited = 0;
+
+    while (cluster >= 2 && cluster < fat->cluster_count && visited < max_clusters) {
+        fat32_read_at(fat, fat32_cluster_offset(fat, cluster), cluster_data, cluster_size);
+        FAT_METRIC_ADD(fat, dir_clusters_parsed, 1);
+
+        for (uint32_t i = 0; i < slots_per_cluster; i++) {
+            DirectoryEntry_t* entry = (DirectoryEntry_t*)(cluster_data + i * sizeof(DirectoryEntry_t));
+
+            if (entry->name[0] == 0x00) {
+                goto end;
+            }
+
+            if ((uint8_t)entry->name[0] == 0xE5) {
+                lfn_count = 0;
+                continue;
             }
 
-            fseek(fat->image, offset, SEEK_SET);
-            fread(((char*)out) + total_bytes_read, bytes_to_read, 1, fat->image);
+            if ((entry->attributes & ATTR_LFN_MASK) == ATTR_LONG_FILE_NAME) {
+                LFN_t* lfn = (LFN_t*)entry;
+                uint8_t seq = lfn->attr_number & 0x1F;
+
+                if (lfn->attr_number & 0x40) {
+                    memset(lfn_name, 0, sizeof(lfn_name));
+                    lfn_length = 0;
+                    lfn_count = 0;
+                    lfn_next = seq;
+                    lfn_checksum_value = lfn->checksum;
+                }
+
+                // Entries run from the highest sequence number down to 1; anything else
+                // drops the long name and the 8.3 name is used.
+                if (seq == 0 || seq > 20 || seq != lfn_next || lfn->checksum != lfn_checksum_value) {
+                    lfn_count = 0;
+                    lfn_next = 0;
+                    continue;
+                }
+
+                uint16_t chars[13];
+                memcpy(chars, lfn->first_name_chunk, sizeof(lfn->first_name_chunk));
+                memcpy(chars + 5, lfn->second_name_chunk, sizeof(lfn->second_name_chunk));
+                memcpy(chars + 11, lfn->third_name_chunk, sizeof(lfn->third_name_chunk));
+
+                bool fits = true;
+
+                for (int c = 0; c < 13; c++) {
+                    if (chars[c] == 0x0000 || chars[c] == 0xFFFF) {
+                        break;
+                    }
+
+                    size_t pos = (seq - 1) * 13 + c;
+
+                    if (pos >= FAT32_LFN_MAX) {
+                        fits = false;
+                        break;
+                    }
+
+                    lfn_name[pos] = chars[c];
+
+                    if (pos + 1 > lfn_length) {
+                        lfn_length = pos + 1;
+                    }
+                }
+
+                if (!fits) {
+                    lfn_count = 0;
+                    lfn_next = 0;
+                    continue;
+                }
+
+                lfn_count++;
+                lfn_next = seq - 1;
+                continue;
+            }
+
+            if (entry->attributes & ATTR_VOLUME_ID) {
+                lfn_count = 0;
+                continue;
+            }
+
+            memset(dirent, 0, sizeof(fat32_dirent_t));
+            dirent->entry = *entry;
+            dirent->cluster = cluster;
+            dirent->offset = i * sizeof(DirectoryEntry_t);
+            dirent->slot = visited * slots_per_cluster + i;
+
+            if (lfn_count && lfn_next == 0 && lfn_checksum_value == lfn_checksum((const char*)entry)) {
+                utf16_to_utf8_bounded(lfn_name, lfn_length, (unsigned char*)dirent->name, sizeof(dirent->name));
+                dirent->lfn_count = lfn_count;
+            } else {
+                fat32_format_short_name(entry, dirent->name);
+            }
+
+            lfn_count = 0;
+
+            if (!fn(fat, dirent, ctx)) {
+                visited++;
+                goto end;
+            }
+        }
+
+        cluster = fat32_get_fat_entry(fat, cluster);
+        visited++;
+    }
+
+end:
+    free(dirent);
+    free(cluster_data);
+
+    return visited;
+}
+
+void fast_traverse(direntry_t* dir) {
+    while (dir) {
+        printf("T: %d; Name: %s; Size: %zu; (-> %p) (priv: %u)\n", dir->type, dir->name, dir->size, dir->next, dir->priv_data);
+        dir = dir->next;
+    }
+}
+
+typedef struct {
+    const char* name;
+    uint32_t cluster;
+} fat32_find_ctx_t;
+
+static bool fat32_find_visit(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    fat32_find_ctx_t* find = ctx;
+
+    FAT_DEBUG("1: '%s'; 2: '%s'\n", dirent->name, find->name);
+
+    if (strcmp(dirent->name, find->name) != 0) {
+        return true;
+    }
+
+    find->cluster = FAT_DIRENT_CLUSTER(&dirent->entry);
+
+    FAT_DEBUG("Found cluster: %u\n", find->cluster);
+
+    return false;
+}
+
+size_t fat32_search_on_cluster(fat_t* fat, size_t cluster, const char* name) {
+    fat32_find_ctx_t find = {name, 0};
+
+    fat32_iterate_directory(fat, cluster, 0, fat32_find_visit, &find);
+
+    return find.cluster;
+}
+
+static size_t fat32_search_path(fat_t* fat, const char* path) {
+    FAT_OP_BEGIN(started);
+    FAT_DEBUG("Searching: %s\n", path);
+
+    size_t cluster = fat->fat->root_directory_offset_in_clusters;
+
+    if (fat_catalog_usable(fat)) {
+        const fat_catalog_node_t* node = fat_catalog_lookup(fat->catalog, path);
+
+        FAT_OP_END(fat, FAT_OP_LOOKUP, started);
+
+        return node ? node->cluster : 0;
+    }
+
+    char temp_name[256] = {0};
+
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+
+        if (*path == '\0') {
+            break; // Reached end of path
+        }
+
+        const char* next_slash = path;
+        while (*next_slash != '/' && *next_slash != '\0') {
+            next_slash++;
+        }
+
+        size_t name_length = next_slash - path;
+        if (name_length >= sizeof(temp_name)) {
+            cluster = 0;
+            break;
+        }
+
+        strncpy(temp_name, path, name_length);
+        temp_name[name_length] = '\0';
+
+        cluster = fat32_search_on_cluster(fat, cluster, temp_name);
+        if (cluster == 0) {
+            break;
+        }
+
+        path = next_slash;
+    }
+
+    FAT_OP_END(fat, FAT_OP_LOOKUP, started);
+
+    return cluster;
+}
+
+size_t fat32_search(fat_t* fat, const char* path) {
+    uint64_t traced = fat_trace_begin(fat);
+    size_t cluster = fat32_search_path(fat, path);
+
+    FAT_TRACE_END(fat, traced, FAT_TRACE_LOOKUP, path, NULL, .result = cluster);
+
+    return cluster;
+}
+
+static size_t fat32_lookup_size(fat_t* fat, const char* filename) {
+    fat32_stat_t stat = {.path = filename};
+
+    fat32_stat_batch(fat, &stat, 1);
+
+    return stat.size;
+}
+
+size_t fat32_get_file_size(fat_t* fat, const char* filename) {
+    uint64_t traced = fat_trace_begin(fat);
+    size_t size = fat32_lookup_size(fat, filename);
+
+    FAT_TRACE_END(fat, traced, FAT_TRACE_STAT, filename, NULL, .result = size);
+
+    return size;
+}
+
+static void fat32_fill_stat(fat32_stat_t* stat, const DirectoryEntry_t* entry) {
+    stat->found = true;
+    stat->type = (entry->attributes & ATTR_DIRECTORY) ? ENT_DIRECTORY : ENT_FILE;
+    stat->attributes = entry->attributes;
+    stat->cluster = FAT_DIRENT_CLUSTER(entry);
+    stat->size = entry->file_size;
+
+    fat32_decode_datetime(entry->creation_date, entry->creation_time, entry->creation_time_tenths, &stat->created);
+    fat32_decode_datetime(entry->modification_date, entry->modification_time, 0, &stat->modified);
+    fat32_decode_datetime(entry->last_access_date, 0, 0, &stat->accessed);
+}
+
+static void fat32_fill_root_stat(fat_t* fat, fat32_stat_t* stat) {
+    stat->found = true;
+    stat->type = ENT_DIRECTORY;
+    stat->attributes = ATTR_DIRECTORY;
+    stat->cluster = fat->fat->root_directory_offset_in_clusters;
+}
+
+typedef struct {
+    fat32_stat_t* stat;
+    const char* parent;  // Not terminated
+    size_t parent_length;
+    const char* name;    // Not terminated, trailing slashes cut off
+    size_t name_length;
+} fat32_stat_request_t;
+
+typedef struct {
+    fat32_stat_request_t* requests;  // One parent, sorted by name
+    size_t count;
+    size_t remaining;
+} fat32_stat_group_t;
+
+static int fat32_compare_parts(const char* a, size_t a_length, const char* b, size_t b_length) {
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+    return result ? result : (a_length > b_length) - (a_length < b_length);
+}
+
+static int fat32_compare_requests(const void* a, const void* b) {
+    const fat32_stat_request_t* x = a;
+    const fat32_stat_request_t* y = b;
+    int result = fat32_compare_parts(x->parent, x->parent_length, y->parent, y->parent_length);
+
+    return result ? result : fat32_compare_parts(x->name, x->name_length, y->name, y->name_length);
+}
+
+static bool fat32_stat_visit(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+
+    fat32_stat_group_t* group = ctx;
+    size_t length = strlen(dirent->name);
+    size_t low = 0;
+    size_t high = group->count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        fat32_stat_request_t* request = &group->requests[middle];
+
+        if (fat32_compare_parts(request->name, request->name_length, dirent->name, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // The same path may have been asked for more than once.
+    for (size_t i = low; i < group->count; i++) {
+        fat32_stat_request_t* request = &group->requests[i];
+
+        if (fat32_compare_parts(request->name, request->name_length, dirent->name, length) != 0) {
+            break;
+        }
+
+        if (!request->stat->found) {
+            fat32_fill_stat(request->stat, &dirent->entry);
+            group->remaining--;
+        }
+    }
+
+    return group->remaining > 0;
+}
+
+// Looks up many paths at once. Paths are grouped by parent directory, each parent is
+// resolved once and scanned once, stopping as soon as all its names are found. Returns
+// the number of paths found; the others have found == false.
+static size_t fat32_stat_paths(fat_t* fat, fat32_stat_t* stats, size_t count) {
+    FAT_OP_BEGIN(started);
+
+    size_t found = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const char* path = stats[i].path;
+
+        memset(&stats[i], 0, sizeof(fat32_stat_t));
+        stats[i].path = path;
+    }
+
+    if (fat_catalog_usable(fat)) {
+        for (size_t i = 0; i < count; i++) {
+            const fat_catalog_node_t* node = fat_catalog_lookup(fat->catalog, stats[i].path);
+
+            if (node) {
+                DirectoryEntry_t entry = {0};
+
+                entry.attributes = node->attributes;
+                entry.high_cluster = (node->cluster >> 16) & 0xFFFF;
+                entry.low_cluster = node->cluster & 0xFFFF;
+                entry.file_size = node->size;
+                entry.creation_time = node->creation_time;
+                entry.creation_date = node->creation_date;
+                entry.modification_time = node->modification_time;
+                entry.modification_date = node->modification_date;
+
+                fat32_fill_stat(&stats[i], &entry);
+                found++;
+            }
+        }
+
+        FAT_OP_END(fat, FAT_OP_LOOKUP, started);
+
+        return found;
+    }
+
+    fat32_stat_request_t* requests = calloc(count, sizeof(fat32_stat_request_t));
+    size_t request_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const char* path = stats[i].path;
+        size_t length = strlen(path);
+
+        while (length > 0 && path[length - 1] == '/') {
+            length--;
+        }
+
+        if (length == 0) {
+            fat32_fill_root_stat(fat, &stats[i]);
+            found++;
+            continue;
+        }
+
+        const char* name = path + length;
+
+        while (name > path && name[-1] != '/') {
+            name--;
+        }
+
+        fat32_stat_request_t* request = &requests[request_count++];
+
+        request->stat = &stats[i];
+        request->parent = path;
+        request->parent_length = name - path;
+        request->name = name;
+        request->name_length = path + length - name;
+
+        // "/a/b" and "a//b" share the parent "/a" with "a/c".
+        while (request->parent_length > 0 && path[request->parent_length - 1] == '/') {
+            request->parent_length--;
+        }
+
+        while (request->parent_length > 0 && *request->parent == '/') {
+            request->parent++;
+            request->parent_length--;
+        }
+    }
+
+    qsort(requests, request_count, sizeof(fat32_stat_request_t), fat32_compare_requests);
+
+    for (size_t first = 0; first < request_count;) {
+        size_t last = first + 1;
+
+        while (last < request_count
+               && fat32_compare_parts(requests[first].parent, requests[first].parent_length, requests[last].parent,
+                                      requests[last].parent_length) == 0) {
+            last++;
+        }
+
+        char* parent = strndup(requests[first].parent, requests[first].parent_length);
+        size_t dir_cluster = fat32_search(fat, parent);
+
+        if (dir_cluster != 0) {
+            fat32_stat_group_t group = {&requests[first], last - first, last - first};
+
+            fat32_iterate_directory(fat, dir_cluster, 0, fat32_stat_visit, &group);
+
+            found += group.count - group.remaining;
+        }
+
+        free(parent);
+        first = last;
+    }
+
+    free(requests);
+
+    FAT_OP_END(fat, FAT_OP_LOOKUP, started);
+
+    return found;
+}
+
+// Traced like that many fat32_get_file_size calls, so replay sees the lookup load.
+size_t fat32_stat_batch(fat_t* fat, fat32_stat_t* stats, size_t count) {
+    uint64_t traced = fat_trace_begin(fat);
+    size_t found = fat32_stat_paths(fat, stats, count);
+
+    if (traced) {
+        fat_trace_record_t* records = calloc(count, sizeof(fat_trace_record_t));
+        const char** names = calloc(count, sizeof(const char*));
+
+        for (size_t i = 0; i < count; i++) {
+            records[i].op = FAT_TRACE_STAT;
+            records[i].result = stats[i].size;
+            names[i] = stats[i].path;
+        }
+
+        fat_trace_leave_many(fat, traced, records, names, count);
+
+        free(records);
+        free(names);
+    }
+
+    return found;
+}
+
+
+size_t fat32_find_free_cluster(fat_t* fat) {
+    for(uint32_t n = 2; n < fat->cluster_count; n++) {
+        uint32_t i = fat->next_free;
+
+        if(++fat->next_free >= fat->cluster_count) {
+            fat->next_free = 2;
+        }
+
+        if(fat32_get_fat_entry(fat, i) == 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+// First cluster of `count` consecutive free clusters at or after `from`, 0 if there is none.
+uint32_t fat32_find_free_run(fat_t* fat, uint32_t from, uint32_t count) {
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+
+    for (uint32_t cluster = from < 2 ? 2 : from; cluster < fat->cluster_count; cluster++) {
+        if (fat32_get_fat_entry(fat, cluster) != 0) {
+            run_length = 0;
+            continue;
+        }
+
+        if (run_length++ == 0) {
+            run_start = cluster;
+        }
+
+        if (run_length == count) {
+            return run_start;
+        }
+    }
+
+    return 0;
+}
+
+// Releases `start` and everything after it in the chain, returns the number of clusters freed.
+size_t fat32_free_chain(fat_t* fat, uint32_t start) {
+    size_t freed = 0;
+    uint32_t cluster = start;
+
+    while (cluster >= 2 && cluster < fat->cluster_count && freed < fat->cluster_count) {
+        uint32_t next = fat32_get_fat_entry(fat, cluster);
+
+        fat32_set_fat_entry(fat, cluster, 0);
+        freed++;
+
+        // Let the next allocation reuse the hole instead of growing the volume tail.
+        if (cluster < fat->next_free) {
+            fat->next_free = cluster;
+        }
+
+        cluster = next;
+    }
+
+    return freed;
+}
+
+// Room for `count` consecutive entries, growing the directory if it has none.
+static fat_dir_index_t* fat32_find_free_entry(fat_t* fat, size_t dir_cluster, uint32_t count, uint32_t* out_slot) {
+    fat_dir_index_t* index = fat_dir_index_get(fat, dir_cluster);
+
+    if (index == NULL || !fat_dir_index_alloc(fat, index, count, out_slot)) {
+        return NULL;
+    }
+
+    return index;
+}
+
+size_t fat32_get_last_cluster_in_chain(fat_t* fat, size_t start_cluster) {
+    if (start_cluster < 2 || start_cluster >= 0x0FFFFFF8) {
+        return 0;  // Invalid start cluster
+    }
+
+    size_t current_cluster = start_cluster;
+    size_t steps = 0;
+
+    while (current_cluster < 0x0FFFFFF8 && steps++ < fat->cluster_count) {
+        size_t next_cluster = fat32_get_fat_entry(fat, current_cluster);
+
+        if (next_cluster >= 0x0FFFFFF8) {
+            break;  // Reached the end of the chain
+        }
+
+        current_cluster = next_cluster;
+    }
+
+    return current_cluster;
+}
+
+// Appends a cluster to the chain. Callers about to overwrite the whole cluster
+// pass zero_fill = false and skip clearing it.
+size_t fat32_allocate_cluster(fat_t* fat, size_t for_cluster, bool zero_fill) {
+    size_t last_cluster = fat32_get_last_cluster_in_chain(fat, for_cluster);
+
+    if (last_cluster == 0) {
+        return 0;
+    }
+
+    size_t new_cluster = fat32_find_free_cluster(fat);
+
+    if (new_cluster == 0) {
+        return 0;
+    }
+
+    fat32_set_fat_entry(fat, last_cluster, new_cluster);
+
+    fat32_set_fat_entry(fat, new_cluster, 0x0FFFFFF8);
+    FAT_METRIC_ADD(fat, clusters_allocated, 1);
+
+    if (zero_fill) {
+        fat32_zero_range(fat, fat32_cluster_offset(fat, new_cluster), fat->cluster_size);
+    }
+
+    return new_cluster;
+}
+
+void fat32_flush(fat_t* f) {
+    FAT_OP_BEGIN(started);
+    uint64_t traced = fat_trace_begin(f);
+
+    fat_cache_flush(f);
+    fat32_sync_fsinfo(f);
+
+    FAT_OP_END(f, FAT_OP_FLUSH, started);
+    FAT_TRACE_END(f, traced, FAT_TRACE_FLUSH, NULL, NULL, .result = 0);
+}
+
+// An 8.3 name not used in the directory yet: the basis itself when the long name fits,
+// then NAME~1 to NAME~4, then hash based tails like RE1A2B~1 as Windows does.
+static bool fat32_unique_short_name(fat_dir_index_t* index, const char* filename, char sfn[11]) {
+    char basis[11];
+    bool lossy = lfn_basis_name(filename, basis);
+
+    memcpy(sfn, basis, 11);
+
+    if (!lossy && !fat_dir_index_has_name(index, sfn)) {
+        return true;
+    }
+
+    for (uint32_t n = 1; n <= 4; n++) {
+        memcpy(sfn, basis, 11);
+        lfn_numeric_tail(sfn, n);
+
+        if (!fat_dir_index_has_name(index, sfn)) {
+            return true;
+        }
+    }
+
+    uint32_t hash = 0x811C9DC5;
+    for (const char* p = filename; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 0x01000193;
+    }
+
+    for (uint32_t attempt = 0; attempt < 64; attempt++) {
+        for (uint32_t n = 1; n <= 9; n++) {
+            memcpy(sfn, basis, 11);
+            lfn_hash_tail(sfn, (uint16_t)(hash ^ (hash >> 16)), n);
+
+            if (!fat_dir_index_has_name(index, sfn)) {
+                return true;
+            }
+        }
+
+        hash = (hash ^ attempt) * 0x01000193;
+    }
+
+    return false;
+}
+
+// Adds `filename` to the directory. A new entry gets a fresh zeroed cluster; with `model`
+// it takes that entry's attributes, timestamps and size instead and owns `chain`, which the
+// caller allocated and filled. Either way the entry is written once and flushed.
+static size_t fat32_create_entry(fat_t* fat, size_t dir_cluster, const char* filename, bool is_file,
+                                 const DirectoryEntry_t* model, uint32_t chain) {
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 255) {
+        return 0;
+    }
+
+    // The long name slots come first, the short entry right after them.
+    size_t lfn_entry_count = (strlen(filename) + 12) / 13;
+    uint32_t slot = 0;
+    fat_dir_index_t* index = fat32_find_free_entry(fat, dir_cluster, lfn_entry_count + 1, &slot);
+
+    FAT_DEBUG("Slot: %u\n", slot);
+
+    if (index == NULL) {
+        return 0;
+    }
+
+    char sfn[11];
+    size_t new_cluster = 0;
+
+    if (fat32_unique_short_name(index, filename, sfn)) {
+        new_cluster = model ? chain : fat32_find_free_cluster(fat);
+    }
+
+    if (new_cluster == 0) {
+        fat_dir_index_release(fat, dir_cluster, slot, lfn_entry_count + 1);
+        return 0;
+    }
+
+    FAT_DEBUG("Cluster: %zu\n", new_cluster);
+
+    if (model == NULL) {
+        fat32_set_fat_entry(fat, new_cluster, 0x0FFFFFF8);
+        FAT_METRIC_ADD(fat, clusters_allocated, 1);
+
+        // Bytes past the end of a file must read as zeros once it grows, and stale
+        // data in a directory cluster would read back as entries.
+        fat32_zero_range(fat, fat32_cluster_offset(fat, new_cluster), fat->cluster_size);
+    }
+
+    FAT_DEBUG("SFN: %.11s\n", sfn);
+
+    DirectoryEntry_t entry = {0};
+    if (model) {
+        entry = *model;
+    }
+    memcpy(entry.name, sfn, 8);
+    memcpy(entry.ext, sfn + 8, 3);
+    if (model == NULL) {
+        entry.attributes = is_file ? 0x20 : 0x10; // 0x20 for files, 0x10 for directories
+        entry.file_size = 0; // Directories have size 0
+    }
+    entry.high_cluster = (new_cluster >> 16) & 0xFFFF;
+    entry.low_cluster = new_cluster & 0xFFFF;
+
+    if(!is_file && model == NULL) {
+        DirectoryEntry_t entry = {0};
+        memset(entry.name, ' ', 8);
+        memset(entry.ext, ' ', 3);
+
+        entry.attributes |= ATTR_DIRECTORY;
+
+        entry.name[0] = '.';
+
+        size_t off = fat32_cluster_offset(fat, new_cluster);
+
+        fat32_write_at(fat, off, &entry, sizeof(DirectoryEntry_t));
+
+        entry.name[1] = '.';
+        fat32_write_at(fat, off + sizeof(DirectoryEntry_t), &entry, sizeof(DirectoryEntry_t));
+    }
+
+    unsigned short utf16_name[256] = {0};
+    utf8_to_utf16(filename, utf16_name);
+
+    for (size_t i = 0; i < lfn_entry_count; i++) {
+        LFN_t lfn_entry = {0};
+        lfn_entry.attribute = ATTR_LONG_FILE_NAME;
+        lfn_entry.checksum = lfn_checksum(sfn);
+
+        FAT_DEBUG("LFN!\n");
+
+        lfn_entry.attr_number = (i == lfn_entry_count - 1) ? 0x40 : 0x00; // Set LAST_LONG_ENTRY flag for the last entry
+        lfn_entry.attr_number |= (uint8_t)(i + 1); // Set the sequence number
+
+        size_t char_index = i * 13;
+        for (int p1 = 0; p1 < 5 && char_index < strlen(filename); p1++) {
+            lfn_entry.first_name_chunk[p1] = utf16_name[char_index++];
+        }
+        for (int p2 = 0; p2 < 6 && char_index < strlen(filename); p2++) {
+            lfn_entry.second_name_chunk[p2] = utf16_name[char_index++];
+        }
+        for (int p3 = 0; p3 < 2 && char_index < strlen(filename); p3++) {
+            lfn_entry.third_name_chunk[p3] = utf16_name[char_index++];
+        }
+
+        // Sequence 1 sits right before the short entry, the last one first.
+        size_t entry_offset = fat_dir_index_offset(fat, index, slot + lfn_entry_count - 1 - i);
+        fat32_write_at(fat, entry_offset, &lfn_entry, sizeof(LFN_t));
+    }
+
+    fat32_write_at(fat, fat_dir_index_offset(fat, index, slot + lfn_entry_count), &entry, sizeof(DirectoryEntry_t));
+    fat_dir_index_add_name(index, sfn);
+
+    fat32_flush(fat);
+
+    return new_cluster;
+}
+
+size_t fat32_create_file(fat_t* fat, size_t dir_cluster, const char* filename, bool is_file) {
+    FAT_OP_BEGIN(started);
+    uint64_t traced = fat_trace_begin(fat);
+
+    size_t cluster = fat32_create_entry(fat, dir_cluster, filename, is_file, NULL, 0);
+
+    FAT_OP_END(fat, FAT_OP_CREATE, started);
+    FAT_TRACE_END(fat, traced, FAT_TRACE_CREATE, filename, NULL, .flags = is_file, .cluster = dir_cluster,
+                  .result = cluster);
+
+    return cluster;
+}
+
+// Write counterpart of fat32_read_chain_kernel, with `shift` constant per instance. Runs of
+// adjacent clusters, including ones just allocated next to the chain, take one write.
+static inline __attribute__((always_inline)) size_t fat32_write_chain_kernel(fat_t* fat, uint32_t cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer, const unsigned shift) {
+    const size_t cluster_size = (size_t)1 << shift;
+    size_t skip = offset >> shift;
+    size_t in_cluster = offset & (cluster_size - 1);
+    size_t bytes_written = 0;
+
+    // Traverse to the correct starting cluster based on the initial offset
+    for (size_t i = 0; i < skip; i++) {
+        uint32_t next = fat32_get_fat_entry(fat, cluster);
+
+        if (next < 2 || next >= fat->cluster_count) {
+            // Chain ends before the offset: extend it. Clusters we skip over must read
+            // as zeros, the one we start writing in only needs it if we don't cover it.
+            bool covered = i + 1 == skip && in_cluster == 0 && size >= cluster_size;
+
+            next = fat32_allocate_cluster(fat, cluster, !covered);
+            if (next == 0) {
+                // No free clusters available, cannot proceed
+                *out_file_size = file_size;
+                return 0;
+            }
+        }
+
+        cluster = next;
+    }
+
+    while (bytes_written < size) {
+        uint32_t first = cluster;
+        uint32_t next = 0;
+        size_t length = cluster_size - in_cluster;
+
+        // Extend the run while the chain continues into the adjacent cluster. New clusters
+        // are zeroed only if the write ends inside them.
+        while (length < size - bytes_written) {
+            next = fat32_get_fat_entry(fat, cluster);
+
+            if (next < 2 || next >= fat->cluster_count) {
+                next = fat32_allocate_cluster(fat, cluster, size - bytes_written - length < cluster_size);
+            }
+
+            if (next != cluster + 1) {
+                break;
+            }
+
+            cluster = next;
+            length += cluster_size;
+        }
+
+        if (length > size - bytes_written) {
+            length = size - bytes_written;
+        }
+
+        fat32_write_at(fat, fat32_cluster_offset(fat, first) + in_cluster, buffer + bytes_written, length);
+
+        bytes_written += length;
+        in_cluster = 0;  // Only the first run starts inside a cluster
+
+        if (bytes_written < size) {
+            if (next == 0) {
+                break;  // No more clusters available
+            }
+
+            cluster = next;
+        }
+    }
+
+    // Update the file size if it has grown
+    *out_file_size = offset + bytes_written > file_size ? offset + bytes_written : file_size;
+
+    fat32_flush(fat);
+
+    return bytes_written;
+}
+
+static size_t fat32_write_chain_4k(fat_t* fat, uint32_t cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer) {
+    return fat32_write_chain_kernel(fat, cluster, file_size, offset, size, out_file_size, buffer, 12);
+}
+
+static size_t fat32_write_chain_32k(fat_t* fat, uint32_t cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer) {
+    return fat32_write_chain_kernel(fat, cluster, file_size, offset, size, out_file_size, buffer, 15);
+}
+
+static size_t fat32_write_chain_64k(fat_t* fat, uint32_t cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer) {
+    return fat32_write_chain_kernel(fat, cluster, file_size, offset, size, out_file_size, buffer, 16);
+}
+
+size_t fat32_write_experimental(fat_t* fat, size_t start_cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer) {
+    FAT_OP_BEGIN(started);
+    size_t written;
+
+    switch (fat->cluster_shift) {
+    case 12:
+        written = fat32_write_chain_4k(fat, start_cluster, file_size, offset, size, out_file_size, buffer);
+        break;
+    case 15:
+        written = fat32_write_chain_32k(fat, start_cluster, file_size, offset, size, out_file_size, buffer);
+        break;
+    case 16:
+        written = fat32_write_chain_64k(fat, start_cluster, file_size, offset, size, out_file_size, buffer);
+        break;
+    default:
+        written = fat32_write_chain_kernel(fat, start_cluster, file_size, offset, size, out_file_size, buffer, fat->cluster_shift);
+        break;
+    }
+
+    FAT_OP_END(fat, FAT_OP_WRITE, started);
+
+    return written;
+}
+
+typedef struct {
+    const char* name;
+    uint32_t cluster;
+    uint32_t offset;
+} fat32_coords_ctx_t;
+
+static bool fat32_match_coords(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    fat32_coords_ctx_t* coords = ctx;
+
+    if (strcmp(dirent->name, coords->name) != 0) {
+        return true;
+    }
+
+    coords->cluster = dirent->cluster;
+    coords->offset = dirent->offset;
+
+    return false;
+}
+
+// Location of the short entry, so LFN runs spanning a cluster boundary resolve correctly.
+void fat32_get_file_info_coords(fat_t* fat, uint32_t dir_cluster, const char* filename, size_t* out_cluster, size_t* out_offset) {
+    fat32_coords_ctx_t coords = {filename, 0, 0};
+
+    fat32_iterate_directory(fat, dir_cluster, 0, fat32_match_coords, &coords);
+
+    *out_cluster = coords.cluster;
+    *out_offset = coords.offset;
+}
+
+DirectoryEntry_t fat32_read_file_info(fat_t* fat, size_t dir_clust, const char* file) {
+    size_t out_clust, out_offset;
+    DirectoryEntry_t de = {0};
+
+    fat32_get_file_info_coords(fat, dir_clust, file, &out_clust, &out_offset);
+
+    if (out_clust == 0) {
+        return de;  // Not found, name[0] == 0
+    }
+
+    size_t offset = fat32_cluster_offset(fat, out_clust) + out_offset;
+    fat32_read_at(fat, offset, &de, sizeof(DirectoryEntry_t));
+
+    return de; 
+}
+
+void fat32_write_file_info(fat_t* fat, size_t dir_clust, const char* file, DirectoryEntry_t ent) {
+    size_t out_clust, out_offset;
+
+    fat32_get_file_info_coords(fat, dir_clust, file, &out_clust, &out_offset);
+
+    if (out_clust == 0) {
+        return;
+    }
+
+    size_t offset = fat32_cluster_offset(fat, out_clust) + out_offset;
+    fat32_write_at(fat, offset, &ent, sizeof(DirectoryEntry_t));
+}
+
+void fat32_write_size(fat_t* fat, size_t fp_cluster, size_t fp_offset, size_t size) {
+    size_t offset = fat32_cluster_offset(fat, fp_cluster) + fp_offset;
+    FAT_DEBUG("=====> %zx\n", offset);
+
+    DirectoryEntry_t entry;
+    fat32_read_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
+
+    entry.file_size = size;
+
+    fat32_write_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
+}
+
+// Inverse of fat32_decode_datetime for a UTC time, two second resolution. Times outside
+// what DOS dates hold (1980 to 2107) are clamped.
+static void fat32_encode_datetime(time_t value, uint16_t* out_date, uint16_t* out_time) {
+    struct tm tm;
+
+    gmtime_r(&value, &tm);
+
+    if (tm.tm_year < 80) {
+        *out_date = (1 << 5) | 1;
+        *out_time = 0;
+    } else if (tm.tm_year > 207) {
+        *out_date = (127 << 9) | (12 << 5) | 31;
+        *out_time = (23 << 11) | (59 << 5) | 29;
+    } else {
+        *out_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+        *out_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    }
+}
+
+// Cluster of the directory holding the last path component, which is returned in out_name.
+static size_t fat32_parent_cluster(fat_t* fat, const char* path, const char** out_name) {
+    const char* file = strrchr(path, '/');
+    file = file ? file + 1 : path;
+
+    char* dirp = calloc((file - path) + 1, 1);
+    memcpy(dirp, path, file - path);
+
+    FAT_DEBUG("Path: %s\n", dirp);
+    FAT_DEBUG("File: %s\n", file);
+
+    size_t dir_cluster = fat32_search(fat, dirp);
+
+    free(dirp);
+
+    *out_name = file;
+
+    return dir_cluster;
+}
+
+void fat32_write(fat_t* fat, const char* path, size_t offset, size_t size, const char* buffer) {
+    uint64_t traced = fat_trace_begin(fat);
+    size_t out_file_size;
+
+    size_t cluster = fat32_search(fat, path);
+
+    size_t filesize = fat32_get_file_size(fat, path);
+
+    size_t written = fat32_write_experimental(fat, cluster, filesize, offset, size, &out_file_size, buffer);
+
+    size_t fcl, fof;
+    const char* file;
+    size_t dir_cluster = fat32_parent_cluster(fat, path, &file);
+
+    fat32_get_file_info_coords(fat, dir_cluster, file, &fcl, &fof);
+    fat32_write_size(fat, fcl, fof, out_file_size);
+
+    FAT_TRACE_END(fat, traced, FAT_TRACE_WRITE, path, NULL, .offset = offset, .size = size, .result = written);
+}
+
+// Links `count` clusters after `last` (0 starts a new chain) and returns the first one;
+// the new end of the chain goes to `out_last` if given. A single contiguous run is
+// preferred; without one the clusters come from the next-fit allocator.
+static uint32_t fat32_reserve_clusters(fat_t* fat, uint32_t last, uint32_t count, bool zero_fill, uint32_t* out_last) {
+    uint32_t end;
+    uint32_t first = fat32_find_free_run(fat, last + 1, count);
+
+    if (first == 0) {
+        first = fat32_find_free_run(fat, 2, count);
+    }
+
+    if (first != 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            fat32_set_fat_entry(fat, first + i, i + 1 == count ? 0x0FFFFFF8 : first + i + 1);
+        }
+
+        if (zero_fill) {
+            fat32_zero_range(fat, fat32_cluster_offset(fat, first), (size_t)count * fat->cluster_size);
+        }
+
+        end = first + count - 1;
+    } else {
+        uint32_t prev = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t cluster = fat32_find_free_cluster(fat);
+
+            if (cluster == 0) {
+                fat32_free_chain(fat, first);  // Volume full, give back what we took
+                return 0;
+            }
+
+            fat32_set_fat_entry(fat, cluster, 0x0FFFFFF8);
+
+            if (zero_fill) {
+                fat32_zero_range(fat, fat32_cluster_offset(fat, cluster), fat->cluster_size);
+            }
+
+            if (prev) {
+                fat32_set_fat_entry(fat, prev, cluster);
+            } else {
+                first = cluster;
+            }
+
+            prev = cluster;
+        }
+
+        end = prev;
+    }
+
+    FAT_METRIC_ADD(fat, clusters_allocated, count);
+
+    if (last >= 2) {
+        fat32_set_fat_entry(fat, last, first);
+    }
+
+    if (out_last) {
+        *out_last = end;
+    }
+
+    return first;
+}
+
+static uint32_t fat32_clusters_for(fat_t* fat, size_t length) {
+    uint32_t clusters = (length + fat->cluster_mask) >> fat->cluster_shift;
+
+    return clusters ? clusters : 1;  // Files always own their first cluster
+}
+
+typedef struct {
+    const struct iovec* iov;
+    int count;
+    int index;    // Current vector
+    size_t skip;  // Bytes of it already used
+} fat32_iov_cursor_t;
+
+// Moves up to `length` bytes between one physical run at `offset` and the caller's
+// vectors, in as few calls as FAT32_IOV_BATCH vectors per call allow.
+static size_t fat32_transfer_run(fat_t* fat, size_t offset, size_t length, fat32_iov_cursor_t* cursor, bool write) {
+    struct iovec parts[FAT32_IOV_BATCH];
+    size_t moved = 0;
+
+    while (moved < length && cursor->index < cursor->count) {
+        int count = 0;
+        size_t wanted = 0;
+
+        while (count < FAT32_IOV_BATCH && moved + wanted < length && cursor->index < cursor->count) {
+            const struct iovec* vector = &cursor->iov[cursor->index];
+            size_t part = vector->iov_len - cursor->skip;
+
+            if (part > length - moved - wanted) {
+                part = length - moved - wanted;
+            }
+
+            parts[count].iov_base = (char*)vector->iov_base + cursor->skip;
+            parts[count].iov_len = part;
+            count += part > 0;
+            wanted += part;
+
+            cursor->skip += part;
+
+            if (cursor->skip == vector->iov_len) {
+                cursor->index++;
+                cursor->skip = 0;
+            }
+        }
+
+        size_t result = write ? fat32_writev_at(fat, offset + moved, parts, count)
+                              : fat32_readv_at(fat, offset + moved, parts, count);
+
+        moved += result;
+
+        if (result < wanted) {
+            break;
+        }
+    }
+
+    return moved;
+}
+
+// Maps `total` bytes starting `in_cluster` bytes into `cluster` onto runs of consecutive
+// clusters and transfers each run with one call.
+static size_t fat32_transfer_chain(fat_t* fat, uint32_t cluster, size_t in_cluster, size_t total,
+                                   fat32_iov_cursor_t* cursor, bool write) {
+    size_t done = 0;
+
+    while (done < total && cluster >= 2 && cluster < fat->cluster_count) {
+        uint32_t first = cluster;
+        uint32_t next = fat32_get_fat_entry(fat, cluster);
+        size_t length = fat->cluster_size - in_cluster;
+
+        while (done + length < total && next == cluster + 1) {
+            cluster = next;
+            next = fat32_get_fat_entry(fat, cluster);
+            length += fat->cluster_size;
+        }
+
+        if (length > total - done) {
+            length = total - done;
+        }
+
+        size_t moved = fat32_transfer_run(fat, fat32_cluster_offset(fat, first) + in_cluster,
+                                          length, cursor, write);
+
+        done += moved;
+
+        if (moved < length) {
+            break;
+        }
+
+        cluster = next;
+        in_cluster = 0;
+    }
+
+    return done;
+}
+
+// Cluster `index` clusters into the chain, 0 if the chain is shorter.
+static uint32_t fat32_chain_at(fat_t* fat, uint32_t cluster, size_t index) {
+    for (size_t i = 0; i < index && cluster >= 2 && cluster < fat->cluster_count; i++) {
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
+
+    return cluster >= 2 && cluster < fat->cluster_count ? cluster : 0;
+}
+
+static size_t fat32_iov_total(const struct iovec* iov, int count) {
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+// Reads from `offset` of a file into the vectors, stopping at `file_size`. `cluster` is
+// the one holding `offset`, 0 if there is none.
+static size_t fat32_read_from(fat_t* fat, uint32_t cluster, size_t file_size, size_t offset, const struct iovec* iov, int count) {
+    size_t total = fat32_iov_total(iov, count);
+
+    if (cluster == 0 || offset >= file_size) {
+        return 0;
+    }
+
+    if (total > file_size - offset) {
+        total = file_size - offset;
+    }
+
+    fat32_iov_cursor_t cursor = {iov, count, 0, 0};
+
+    return fat32_transfer_chain(fat, cluster, offset & fat->cluster_mask, total, &cursor, false);
+}
+
+// Does not move any position, so threads can read different parts of one file at once.
+size_t fat32_readv(fat_t* fat, uint32_t start_cluster, size_t file_size, size_t offset, const struct iovec* iov, int count) {
+    uint64_t traced = fat_trace_begin(fat);
+    FAT_OP_BEGIN(started);
+
+    uint32_t cluster = offset < file_size ? fat32_chain_at(fat, start_cluster, offset >> fat->cluster_shift) : 0;
+    size_t done = fat32_read_from(fat, cluster, file_size, offset, iov, count);
+
+    FAT_OP_END(fat, FAT_OP_READ, started);
+    FAT_TRACE_END(fat, traced, FAT_TRACE_READ, NULL, NULL, .cluster = start_cluster, .offset = offset,
+                  .size = fat32_iov_total(iov, count), .result = done);
+
+    return done;
+}
+
+// Takes the chain from the catalog's extents instead of walking the FAT. They are copied,
+// the catalog may be detached while the file is open.
+static void fat32_file_from_catalog(fat_t* fat, const fat_catalog_node_t* node, fat32_file_t* file) {
+    const fat_catalog_extent_t* extents = &fat->catalog->extents[node->first_extent];
+
+    file->size = node->size;
+
+    if (node->extent_count == 0) {
+        return;
+    }
+
+    file->extents = malloc(node->extent_count * sizeof(fat_catalog_extent_t));
+    file->extent_count = node->extent_count;
+    memcpy(file->extents, extents, node->extent_count * sizeof(fat_catalog_extent_t));
+
+    for (uint32_t i = 0; i < node->extent_count; i++) {
+        file->clusters += extents[i].length;
+    }
+
+    file->first_cluster = extents[0].cluster;
+    file->last_cluster = extents[node->extent_count - 1].cluster + extents[node->extent_count - 1].length - 1;
+}
+
+// Traced as a lookup of the file's first cluster, so replay can map the reads of files
+// that existed before the trace started.
+bool fat32_file_open(fat_t* fat, const char* path, fat32_file_t* file) {
+    uint64_t traced = fat_trace_begin(fat);
+    bool found;
+
+    memset(file, 0, sizeof(fat32_file_t));
+
+    if (fat_catalog_usable(fat)) {
+        const fat_catalog_node_t* node = fat_catalog_lookup(fat->catalog, path);
+
+        found = node && !(node->attributes & ATTR_DIRECTORY);
+
+        if (found) {
+            fat32_file_from_catalog(fat, node, file);
+        }
+    } else {
+        const char* name;
+        size_t dir_cluster = fat32_parent_cluster(fat, path, &name);
+        DirectoryEntry_t entry = {0};
+
+        if (dir_cluster != 0) {
+            entry = fat32_read_file_info(fat, dir_cluster, name);
+        }
+
+        found = entry.name[0] != 0 && !(entry.attributes & ATTR_DIRECTORY);
+
+        if (found) {
+            file->size = entry.file_size;
+            file->first_cluster = FAT_DIRENT_CLUSTER(&entry);
+
+            // Walked once here; afterwards the end of the chain is known without walking it.
+            uint32_t cluster = file->first_cluster;
+
+            while (cluster >= 2 && cluster < fat->cluster_count && file->clusters < fat->cluster_count) {
+                file->last_cluster = cluster;
+                file->clusters++;
+                cluster = fat32_get_fat_entry(fat, cluster);
+            }
+
+            if (file->clusters == 0) {
+                file->first_cluster = 0;
+            }
+        }
+    }
+
+    if (found) {
+        file->path = strdup(path);
+    }
+
+    FAT_TRACE_END(fat, traced, FAT_TRACE_LOOKUP, path, NULL, .result = file->first_cluster);
+
+    return found;
+}
+
+// Cluster `index` of an open file's chain, 0 past its end. Walks on from the cluster
+// looked up last when that lies before `index`, so sequential I/O does not start at the
+// head of the chain every call. Readers share the cursor, hence one atomic word.
+static uint32_t fat32_file_cluster(fat_t* fat, fat32_file_t* file, uint32_t index) {
+    if (index >= file->clusters) {
+        return 0;
+    }
+
+    if (index == file->clusters - 1) {
+        return file->last_cluster;
+    }
+
+    // Clusters appended since open lie past the extents and are walked to as below.
+    uint32_t skipped = 0;
+
+    for (uint32_t i = 0; file->extents && i < file->extent_count; i++) {
+        const fat_catalog_extent_t* extent = &file->extents[i];
+
+        if (index - skipped < extent->length) {
+            return extent->cluster + (index - skipped);
+        }
+
+        skipped += extent->length;
+    }
+
+    uint64_t cursor = __atomic_load_n(&file->cursor, __ATOMIC_RELAXED);
+    uint32_t from = cursor >> 32;
+    uint32_t cluster = (uint32_t)cursor;
+
+    if (cluster < 2 || from > index) {
+        from = 0;
+        cluster = file->first_cluster;
+    }
+
+    cluster = fat32_chain_at(fat, cluster, index - from);
+
+    if (cluster) {
+        __atomic_store_n(&file->cursor, (uint64_t)index << 32 | cluster, __ATOMIC_RELAXED);
+    }
+
+    return cluster;
+}
+
+size_t fat32_file_readv(fat_t* fat, fat32_file_t* file, size_t offset, const struct iovec* iov, int count) {
+    uint64_t traced = fat_trace_begin(fat);
+    FAT_OP_BEGIN(started);
+
+    uint32_t cluster = offset < file->size ? fat32_file_cluster(fat, file, offset >> fat->cluster_shift) : 0;
+    size_t done = fat32_read_from(fat, cluster, file->size, offset, iov, count);
+
+    FAT_OP_END(fat, FAT_OP_READ, started);
+    FAT_TRACE_END(fat, traced, FAT_TRACE_READ, file->path, NULL, .cluster = file->first_cluster, .offset = offset,
+                  .size = fat32_iov_total(iov, count), .result = done);
+
+    return done;
+}
+
+// Grows the chain of an open file in one reservation so `end` bytes fit.
+static bool fat32_file_grow(fat_t* fat, fat32_file_t* file, size_t end, bool zero_fill) {
+    uint32_t needed = fat32_clusters_for(fat, end);
+
+    if (file->clusters >= needed) {
+        return true;
+    }
+
+    uint32_t first = fat32_reserve_clusters(fat, file->last_cluster, needed - file->clusters, zero_fill, &file->last_cluster);
+
+    if (first == 0) {
+        return false;
+    }
+
+    if (file->clusters == 0) {
+        file->first_cluster = first;
+    }
+
+    file->clusters = needed;
+    file->dirty = true;
+
+    return true;
+}
+
+// Hands the clusters past what `length` bytes need back in one pass and clears the rest
+// of the new last cluster, so growing the file again exposes no stale data.
+static void fat32_file_shrink(fat_t* fat, fat32_file_t* file, size_t length) {
+    uint32_t keep = fat32_clusters_for(fat, length);
+
+    if (file->clusters == 0) {
+        return;
+    }
+
+    if (keep < file->clusters) {
+        uint32_t last = fat32_file_cluster(fat, file, keep - 1);
+
+        if (last == 0) {
+            return;
+        }
+
+        uint32_t tail = fat32_get_fat_entry(fat, last);
+
+        fat32_set_fat_entry(fat, last, 0x0FFFFFF8);
+        fat32_free_chain(fat, tail);
+
+        file->last_cluster = last;
+        file->clusters = keep;
+        file->dirty = true;
+
+        // The freed clusters may come back elsewhere when the file grows again.
+        free(file->extents);
+        file->extents = NULL;
+        file->extent_count = 0;
+
+        __atomic_store_n(&file->cursor, 0, __ATOMIC_RELAXED);
+    }
+
+    size_t used = length - (size_t)(keep - 1) * fat->cluster_size;
+
+    if (used < fat->cluster_size) {
+        fat32_zero_range(fat, fat32_cluster_offset(fat, file->last_cluster) + used, fat->cluster_size - used);
+    }
+}
+
+// Sets the size of an open file to `length`; space it grows by reads as zeros.
+bool fat32_file_truncate(fat_t* fat, fat32_file_t* file, size_t length) {
+    if (length > 0xFFFFFFFF) {
+        return false;
+    }
+
+    if (length > file->size) {
+        if (!fat32_file_grow(fat, file, length, true)) {
+            return false;
+        }
+    } else {
+        fat32_file_shrink(fat, file, length);
+    }
+
+    file->size = length;
+    file->dirty = true;
+
+    return true;
+}
+
+// Each physical run is written with one call. The size only changes in memory, it
+// reaches the directory entry with fat32_file_sync.
+size_t fat32_file_writev(fat_t* fat, fat32_file_t* file, size_t offset, const struct iovec* iov, int count) {
+    uint64_t traced = fat_trace_begin(fat);
+    FAT_OP_BEGIN(started);
+
+    size_t total = fat32_iov_total(iov, count);
+    size_t done = 0;
+
+    // New clusters need zeroing unless this write fills them completely.
+    bool covered = offset <= (size_t)file->clusters << fat->cluster_shift && ((offset + total) & fat->cluster_mask) == 0;
+
+    if (total > 0 && offset + total <= 0xFFFFFFFF && fat32_file_grow(fat, file, offset + total, !covered)) {
+        fat32_iov_cursor_t cursor = {iov, count, 0, 0};
+        uint32_t cluster = fat32_file_cluster(fat, file, offset >> fat->cluster_shift);
+
+        done = fat32_transfer_chain(fat, cluster, offset & fat->cluster_mask, total, &cursor, true);
+
+        if (offset + done > file->size) {
+            file->size = offset + done;
+            file->dirty = true;
+        }
+    }
+
+    FAT_OP_END(fat, FAT_OP_WRITE, started);
+    FAT_TRACE_END(fat, traced, FAT_TRACE_WRITE, file->path, NULL, .offset = offset, .size = total, .result = done);
+
+    return done;
+}
+
+// Writes size and first cluster back to the directory entry if they changed and
+// flushes the volume.
+void fat32_file_sync(fat_t* fat, fat32_file_t* file) {
+    if (file->dirty && !file->unlinked) {
+        const char* name;
+        size_t dir_cluster = fat32_parent_cluster(fat, file->path, &name);
+        size_t entry_cluster = 0;
+        size_t entry_offset = 0;
+
+        if (dir_cluster != 0) {
+            fat32_get_file_info_coords(fat, dir_cluster, name, &entry_cluster, &entry_offset);
+        }
+
+        if (entry_cluster != 0) {
+            size_t offset = fat32_cluster_offset(fat, entry_cluster) + entry_offset;
+            DirectoryEntry_t entry;
+
+            fat32_read_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
+
+            entry.file_size = file->size;
+            entry.high_cluster = (file->first_cluster >> 16) & 0xFFFF;
+            entry.low_cluster = file->first_cluster & 0xFFFF;
 
-            total_bytes_read += bytes_to_read;
+            fat32_write_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
         }
 
-        cluster = fat->fat_chain[cluster];
-        cluster_count++;
-        byte_offset = 0;  // Only the first iteration needs a non-zero byte offset
+        file->dirty = false;
     }
 
-    return total_bytes_read;
+    fat32_flush(fat);
 }
 
-void fast_traverse(direntry_t* dir) {
-    do {
-        printf("T: %d; Name: %s; Size: %zu; (-> %p) (priv: %u)\n", dir->type, dir->name, dir->size, dir->next, dir->priv_data);
-        dir = dir->next;
-    } while(dir);
+void fat32_file_close(fat_t* fat, fat32_file_t* file) {
+    if (file->unlinked) {
+        fat32_free_chain(fat, file->first_cluster);
+        fat32_flush(fat);
+    } else if (file->dirty) {
+        fat32_file_sync(fat, file);
+    }
+
+    free(file->path);
+    free(file->extents);
+    file->path = NULL;
+    file->extents = NULL;
 }
 
-size_t fat32_search_on_cluster(fat_t* fat, size_t cluster, const char* name) {
-    uint32_t found_cluster = 0;
+// Sets the modification time and the access date of a file or directory; -1 leaves
+// a field as it is. The root has no entry to keep them in.
+bool fat32_set_times(fat_t* fat, const char* path, time_t modified, time_t accessed) {
+    const char* name;
+    size_t dir_cluster = fat32_parent_cluster(fat, path, &name);
+    size_t entry_cluster = 0;
+    size_t entry_offset = 0;
 
-    direntry_t* entries = read_directory(fat, cluster);
-    direntry_t* orig = entries;
+    if (dir_cluster == 0 || fat->read_only) {
+        return false;
+    }
 
-    fast_traverse(entries);
+    fat32_get_file_info_coords(fat, dir_cluster, name, &entry_cluster, &entry_offset);
 
-    do {
-        printf("1: '%s'; 2: '%s'; %d\n", entries->name, name, strcmp(entries->name, name));
-        if(strcmp(entries->name, name) == 0) {
-            found_cluster = (uint32_t)(size_t)entries->priv_data;
+    if (entry_cluster == 0) {
+        return false;
+    }
 
-            printf("Found cluster: %d (%p)\n", found_cluster, entries->priv_data);
-            break;
-        }
+    size_t offset = fat32_cluster_offset(fat, entry_cluster) + entry_offset;
+    DirectoryEntry_t entry;
+    uint16_t dos_date;
+    uint16_t dos_time;
 
-        entries = entries->next;
-    } while(entries);
+    fat32_read_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
 
-    /* FIXME: KLUDGE! Replace it with `dirclose` when port to Veonter (Other OS) */
-    do {
-        direntry_t* k = orig;
-        orig = orig->next;
-        free(k);
-    } while(orig);
+    if (modified != (time_t)-1) {
+        fat32_encode_datetime(modified, &dos_date, &dos_time);
+        entry.modification_date = dos_date;
+        entry.modification_time = dos_time;
+    }
 
-    return found_cluster;
-}
+    if (accessed != (time_t)-1) {
+        fat32_encode_datetime(accessed, &dos_date, &dos_time);
+        entry.last_access_date = dos_date;
+    }
 
-size_t fat32_search(fat_t* fat, const char* path) {
-    printf("Searching: %s\n", path);
+    fat32_write_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
+    fat32_flush(fat);
 
-    size_t cluster = fat->fat->root_directory_offset_in_clusters;
+    return true;
+}
 
-    char temp_name[256] = {0};
+// Grows the chain so `length` bytes fit without further allocation. The new space reads
+// as zeros and the file size is raised to `length` if it was smaller.
+bool fat32_fallocate(fat_t* fat, const char* path, size_t length) {
+    fat32_file_t file;
 
-    while (*path != '\0') {
-        while (*path == '/') {
-            path++;
-        }
+    if (length > 0xFFFFFFFF || !fat32_file_open(fat, path, &file)) {
+        return false;
+    }
 
-        if (*path == '\0') {
-            break; // Reached end of path
-        }
+    bool allocated = fat32_file_grow(fat, &file, length, true);
 
-        const char* next_slash = path;
-        while (*next_slash != '/' && *next_slash != '\0') {
-            next_slash++;
-        }
+    if (allocated && file.size < length) {
+        file.size = length;
+        file.dirty = true;
+    }
 
-        size_t name_length = next_slash - path;
-        if (name_length >= sizeof(temp_name)) {
-            return 0;
-        }
+    fat32_file_sync(fat, &file);
+    fat32_file_close(fat, &file);
 
-        strncpy(temp_name, path, name_length);
-        temp_name[name_length] = '\0';
+    return allocated;
+}
 
-        cluster = fat32_search_on_cluster(fat, cluster, temp_name);
-        if (cluster == 0) {
-            return 0;
-        }
+bool fat32_truncate(fat_t* fat, const char* path, size_t length) {
+    uint64_t traced = fat_trace_begin(fat);
+    fat32_file_t file;
+    bool truncated = false;
 
-        path = next_slash;
+    if (fat32_file_open(fat, path, &file)) {
+        truncated = fat32_file_truncate(fat, &file, length);
+        fat32_file_sync(fat, &file);
+        fat32_file_close(fat, &file);
     }
 
-    return cluster;
+    FAT_TRACE_END(fat, traced, FAT_TRACE_TRUNCATE, path, NULL, .size = length, .result = truncated);
+
+    return truncated;
 }
 
-size_t fat32_get_file_size(fat_t* fat, const char* filename) {
-    size_t len = strlen(filename);
-    const char* end = filename + len;
+// One-shot positional write by path, synced before it returns.
+size_t fat32_writev(fat_t* fat, const char* path, size_t offset, const struct iovec* iov, int count) {
+    uint64_t traced = fat_trace_begin(fat);
+    fat32_file_t file;
+    size_t done = 0;
 
-    while(*end != '/') {
-        end--;
+    if (fat32_file_open(fat, path, &file)) {
+        done = fat32_file_writev(fat, &file, offset, iov, count);
+        fat32_file_sync(fat, &file);
+        fat32_file_close(fat, &file);
     }
 
-    char path[256] = {0};
-    char e_filename[256] = {0};
+    FAT_TRACE_END(fat, traced, FAT_TRACE_WRITE, path, NULL, .offset = offset, .size = fat32_iov_total(iov, count),
+                  .result = done);
 
-    strncpy(path, filename, end - filename);
+    return done;
+}
+
+// Copies bytes between two places of the image. copy_file_range keeps the data in the
+// kernel (and lets filesystems with reflinks share it); overlays, scheduled images and
+// kernels without it go through a large buffer.
+static bool fat32_copy_range(fat_t* fat, size_t from, size_t to, size_t size) {
+    size_t done = 0;
 
-    printf("Path: %s\n", path);
+#ifdef __linux__
+    if (fat->overlay == NULL && fat->sched == NULL) {
+        int fd = fileno(fat->image);
 
-    strncpy(e_filename, end + 1, len - (end - filename));
+        while (done < size) {
+            loff_t in = from + done;
+            loff_t out = to + done;
+            ssize_t result = copy_file_range(fd, &in, fd, &out, size - done, 0);
 
-    printf("Filename: %s\n", e_filename);
+            if (result <= 0) {
+                break;
+            }
 
-    
-    size_t clust = fat32_search(fat, path);
+            done += result;
+        }
 
-    if(clust == 0) {
-        return clust;
+        FAT_METRIC_ADD(fat, bytes_read, done);
+        FAT_METRIC_ADD(fat, bytes_written, done);
     }
+#endif
 
-    direntry_t* entries = read_directory(fat, clust);
-    direntry_t* orig = entries;
+    if (done < size) {
+        size_t chunk_size = size - done < 1024 * 1024 ? size - done : 1024 * 1024;
+        char* buffer = malloc(chunk_size);
 
-    size_t sz = 0;
+        while (done < size) {
+            size_t length = size - done < chunk_size ? size - done : chunk_size;
 
-    do {
-        printf("-> %s\n", entries->name);
-        
-        if(strcmp(entries->name, e_filename) == 0) {
-            sz = entries->size;
-            break;
+            if (fat32_read_at(fat, from + done, buffer, length) != length
+                || fat32_write_at(fat, to + done, buffer, length) != length) {
+                break;
+            }
+
+            done += length;
         }
-        
-        entries = entries->next;
-    } while(entries);
 
+        free(buffer);
+    }
 
-    return sz;
+    return done == size;
 }
 
+// Copies a file inside the image. The destination chain is reserved up front (one
+// contiguous run when there is one) and data moves in runs that are contiguous on both
+// sides. Only then is the entry written, with size, attributes and timestamps of the
+// source, followed by a single flush; a failed copy gives the chain back.
+static bool fat32_copy_file(fat_t* fat, const char* src_path, const char* dst_path) {
+    FAT_OP_BEGIN(started);
+
+    const char* src_name;
+    const char* dst_name;
+    size_t src_dir = fat32_parent_cluster(fat, src_path, &src_name);
+    size_t dst_dir = fat32_parent_cluster(fat, dst_path, &dst_name);
+    DirectoryEntry_t source = {0};
+    bool copied = false;
+
+    if (src_dir == 0 || dst_dir == 0 || fat->read_only) {
+        goto end;
+    }
 
-size_t fat32_find_free_cluster(fat_t* fat) {
-    for(int i = 0, sz = fat->fat_size / sizeof(uint32_t); i < sz; i++) {
-        if(fat->fat_chain[i] == 0) {
-            return i;
-        }
+    source = fat32_read_file_info(fat, src_dir, src_name);
+
+    if (source.name[0] == 0 || (source.attributes & ATTR_DIRECTORY)) {
+        goto end;
     }
 
-    return 0;
-}
+    if (fat32_read_file_info(fat, dst_dir, dst_name).name[0] != 0) {
+        goto end;
+    }
 
-void fat32_find_free_entry(fat_t* fat, size_t dir_cluster, size_t* out_cluster_number, size_t* out_offset) {
-    size_t cluster_count = read_cluster_chain(fat, dir_cluster, true, NULL);
+    uint32_t src_cluster = FAT_DIRENT_CLUSTER(&source);
+    uint32_t clusters = fat32_clusters_for(fat, source.file_size);
 
-    char* cluster_data = calloc(cluster_count, fat->cluster_size);
-    read_cluster_chain(fat, dir_cluster, false, cluster_data);
+    // Every cluster is overwritten or zeroed below, so skip zeroing them here.
+    uint32_t dst_first = fat32_reserve_clusters(fat, 0, clusters, false, NULL);
 
-    size_t entry_size = 32;  // Directory entry size is 32 bytes
-    size_t total_entries = (cluster_count * fat->cluster_size) / entry_size;
+    if (dst_first == 0) {
+        goto end;
+    }
 
-    for (size_t i = 0; i < total_entries; i++) {
-        char* entry = cluster_data + (i * entry_size);
+    uint32_t dst_cluster = dst_first;
+    uint32_t left = clusters;
+    bool ok = true;
 
-        if (entry[0] == 0x00 || entry[0] == 0xE5) {
-            size_t cluster_index = i / (fat->cluster_size / entry_size);
-            size_t offset_within_cluster = (i % (fat->cluster_size / entry_size)) * entry_size;
+    while (ok && left > 0) {
+        // A source chain shorter than its size: the rest of the copy reads as zeros.
+        if (src_cluster < 2 || src_cluster >= fat->cluster_count) {
+            fat32_zero_range(fat, fat32_cluster_offset(fat, dst_cluster), fat->cluster_size);
+            dst_cluster = fat32_get_fat_entry(fat, dst_cluster);
+            left--;
+            continue;
+        }
 
-            *out_cluster_number = dir_cluster;
-            *out_offset = offset_within_cluster;
+        uint32_t run = 1;
+        uint32_t src_next = fat32_get_fat_entry(fat, src_cluster);
+        uint32_t dst_next = fat32_get_fat_entry(fat, dst_cluster);
 
-            free(cluster_data);
-            return;
+        while (run < left && src_next == src_cluster + run && dst_next == dst_cluster + run) {
+            src_next = fat32_get_fat_entry(fat, src_next);
+            dst_next = fat32_get_fat_entry(fat, dst_next);
+            run++;
         }
-    }
 
-    *out_cluster_number = 0;
-    *out_offset = 0;
-    free(cluster_data);
-}
+        ok = fat32_copy_range(fat, fat32_cluster_offset(fat, src_cluster),
+                              fat32_cluster_offset(fat, dst_cluster), (size_t)run * fat->cluster_size);
 
-size_t fat32_get_last_cluster_in_chain(fat_t* fat, size_t start_cluster) {
-    if (start_cluster < 2 || start_cluster >= 0x0FFFFFF8) {
-        return 0;  // Invalid start cluster
+        left -= run;
+        src_cluster = src_next;
+        dst_cluster = dst_next;
     }
 
-    size_t current_cluster = start_cluster;
-
-    while (current_cluster < 0x0FFFFFF8) {
-        size_t next_cluster = fat->fat_chain[current_cluster];
+    DirectoryEntry_t entry = source;
 
-        if (next_cluster >= 0x0FFFFFF8) {
-            break;  // Reached the end of the chain
-        }
+    entry.attributes = source.attributes | ATTR_ARCHIVE;
 
-        current_cluster = next_cluster;
+    if (!ok || fat32_create_entry(fat, dst_dir, dst_name, true, &entry, dst_first) == 0) {
+        fat32_free_chain(fat, dst_first);
+        fat32_flush(fat);
+        goto end;
     }
 
-    return current_cluster;
+    copied = true;
+
+end:
+    FAT_OP_END(fat, FAT_OP_COPY, started);
+
+    return copied;
 }
 
-void fat32_allocate_cluster(fat_t* fat, size_t for_cluster) {
-    size_t last_cluster = fat32_get_last_cluster_in_chain(fat, for_cluster);
+bool fat32_copy(fat_t* fat, const char* src_path, const char* dst_path) {
+    uint64_t traced = fat_trace_begin(fat);
+    bool copied = fat32_copy_file(fat, src_path, dst_path);
 
-    if (last_cluster == 0) {
-        return;
-    }
+    FAT_TRACE_END(fat, traced, FAT_TRACE_COPY, src_path, dst_path, .result = copied);
 
-    size_t new_cluster = fat32_find_free_cluster(fat);
+    return copied;
+}
 
-    if (new_cluster == 0) {
-        return;
-    }
+typedef struct {
+    uint32_t first_slot;  // First LFN slot, or the short entry if there is no long name
+    uint32_t slots;
+    DirectoryEntry_t entry;
+} fat32_victim_t;
 
-    fat->fat_chain[last_cluster] = new_cluster;
+typedef struct {
+    const char** names;  // Sorted; NULL takes every entry
+    size_t name_count;
 
-    fat->fat_chain[new_cluster] = 0x0FFFFFF8;
+    fat32_victim_t* victims;
+    size_t count;
+    size_t capacity;
+} fat32_unlink_ctx_t;
 
-    uint32_t cluster_size = fat->cluster_size;
-    uint32_t offset = fat->cluster_base + (new_cluster * cluster_size);
-    fseek(fat->image, offset, SEEK_SET);
-    char* zero_buffer = calloc(1, cluster_size);
-    fwrite(zero_buffer, cluster_size, 1, fat->image);
-    free(zero_buffer);
+static bool fat32_is_dot_entry(const DirectoryEntry_t* entry) {
+    return entry->name[0] == '.' && (entry->name[1] == ' ' || entry->name[1] == '.');
 }
 
-void fat32_flush(fat_t* f) {
-    fseek(f->image, f->fat_offset, SEEK_SET);
-    fwrite(f->fat_chain, 1, f->fat_size, f->image);
+static int fat32_compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
 }
 
-size_t fat32_create_file(fat_t* fat, size_t dir_cluster, const char* filename, bool is_file) {
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 255) {
-        return 0;
-    }
-
-    size_t out_cluster_number = 0;
-    size_t out_offset = 0;    // PIKA PIKA 
-    fat32_find_free_entry(fat, dir_cluster, &out_cluster_number, &out_offset);
+static bool fat32_collect_victim(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    fat32_unlink_ctx_t* unlink = ctx;
+    const char* name = dirent->name;
 
-    printf("%d %d\n", out_cluster_number, out_offset);
+    if (fat32_is_dot_entry(&dirent->entry)) {
+        return true;
+    }
 
-    if (out_cluster_number == 0) {
-        return 0;
+    if (unlink->names && !bsearch(&name, unlink->names, unlink->name_count, sizeof(char*), fat32_compare_names)) {
+        return true;
     }
 
-    size_t new_cluster = fat32_find_free_cluster(fat);
-    if (new_cluster == 0) {
-        return 0;
+    if (unlink->count == unlink->capacity) {
+        unlink->capacity = unlink->capacity ? unlink->capacity * 2 : 32;
+        unlink->victims = realloc(unlink->victims, unlink->capacity * sizeof(fat32_victim_t));
     }
 
-    printf("Cluster: %d\n", new_cluster);
+    unlink->victims[unlink->count++] = (fat32_victim_t){dirent->slot - dirent->lfn_count, dirent->lfn_count + 1, dirent->entry};
 
-    fat->fat_chain[new_cluster] = 0x0FFFFFF8;
+    return true;
+}
 
-    char sfn[12] = {0};  // 8.3 format (8 chars + '.' + 3 chars)
-    LFN2SFN(filename, sfn);
+static bool fat32_find_any(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    if (fat32_is_dot_entry(&dirent->entry)) {
+        return true;
+    }
 
-    printf("SFN: %.11s\n", sfn);
+    *(bool*)ctx = true;
 
-    DirectoryEntry_t entry = {0};
-    memset(&entry, 0, sizeof(DirectoryEntry_t));
-    memcpy(entry.name, sfn, 8);
-    memcpy(entry.ext, sfn + 8, 3);
-    entry.attributes = is_file ? 0x20 : 0x10; // 0x20 for files, 0x10 for directories
-    entry.high_cluster = (new_cluster >> 16) & 0xFFFF;
-    entry.low_cluster = new_cluster & 0xFFFF;
-    entry.file_size = 0; // Directories have size 0
+    return false;
+}
 
-    if(!is_file) {
-        DirectoryEntry_t entry = {0};
-        memset(entry.name, ' ', 8);
-        memset(entry.ext, ' ', 3);
+// Marks the slots of every victim with 0xE5. Victims come in directory order, so each
+// directory cluster is read and written back at most once.
+static void fat32_mark_deleted(fat_t* fat, uint32_t dir_cluster, const fat32_victim_t* victims, size_t count) {
+    uint32_t per_cluster = fat->cluster_size / sizeof(DirectoryEntry_t);
+    uint8_t* data = malloc(fat->cluster_size);
+    uint32_t cluster = dir_cluster;
+    uint32_t index = 0;  // Position of `cluster` in the directory chain
+    bool loaded = false;
+
+    for (size_t v = 0; v < count && cluster >= 2 && cluster < 0x0FFFFFF8; v++) {
+        for (uint32_t slot = victims[v].first_slot; slot < victims[v].first_slot + victims[v].slots; slot++) {
+            while (index < slot / per_cluster && cluster >= 2 && cluster < 0x0FFFFFF8) {
+                if (loaded) {
+                    fat32_write_at(fat, fat32_cluster_offset(fat, cluster), data, fat->cluster_size);
+                    loaded = false;
+                }
 
-        entry.attributes |= ATTR_DIRECTORY;
+                cluster = fat32_get_fat_entry(fat, cluster);
+                index++;
+            }
 
-        entry.name[0] = '.';
+            if (cluster < 2 || cluster >= 0x0FFFFFF8) {
+                break;
+            }
 
-        size_t off = fat->cluster_base + (new_cluster * fat->cluster_size);
+            if (!loaded) {
+                fat32_read_at(fat, fat32_cluster_offset(fat, cluster), data, fat->cluster_size);
+                loaded = true;
+            }
 
-        fseek(fat->image, off, SEEK_SET);
-        fwrite(&entry, sizeof(DirectoryEntry_t), 1, fat->image);
+            data[(slot % per_cluster) * sizeof(DirectoryEntry_t)] = 0xE5;
+        }
 
-        entry.name[1] = '.';
-        fwrite(&entry, sizeof(DirectoryEntry_t), 1, fat->image);
+        fat_dir_index_release(fat, dir_cluster, victims[v].first_slot, victims[v].slots);
+        fat_dir_index_remove_name(fat, dir_cluster, (const char*)&victims[v].entry);
     }
 
-    uint32_t cluster_size = fat->cluster_size;
-    uint32_t entry_offset = fat->cluster_base + (out_cluster_number * cluster_size) + out_offset;
-    
-    unsigned short utf16_name[256] = {0};
-    utf8_to_utf16(filename, utf16_name);
-    
-    size_t lfn_entry_count = (strlen(filename) + 12) / 13;
-    
-    entry_offset += lfn_entry_count * 32;
-
-    for (size_t i = 0; i < lfn_entry_count; i++) {
-        LFN_t lfn_entry = {0};
-        lfn_entry.attribute = ATTR_LONG_FILE_NAME;
-        lfn_entry.checksum = lfn_checksum(sfn);
+    if (loaded) {
+        fat32_write_at(fat, fat32_cluster_offset(fat, cluster), data, fat->cluster_size);
+    }
 
-        printf("LFN!\n");
+    free(data);
+}
 
-        lfn_entry.attr_number = (i == lfn_entry_count - 1) ? 0x40 : 0x00; // Set LAST_LONG_ENTRY flag for the last entry
-        lfn_entry.attr_number |= (uint8_t)(i + 1); // Set the sequence number
+static void fat32_queue_compaction(fat_t* fat, uint32_t dir_cluster) {
+    if (fat->compact_threshold == 0) {
+        return;
+    }
 
-        size_t char_index = i * 13;
-        for (int p1 = 0; p1 < 5 && char_index < strlen(filename); p1++) {
-            lfn_entry.first_name_chunk[p1] = utf16_name[char_index++];
-        }
-        for (int p2 = 0; p2 < 6 && char_index < strlen(filename); p2++) {
-            lfn_entry.second_name_chunk[p2] = utf16_name[char_index++];
-        }
-        for (int p3 = 0; p3 < 2 && char_index < strlen(filename); p3++) {
-            lfn_entry.third_name_chunk[p3] = utf16_name[char_index++];
+    for (size_t i = 0; i < fat->compact_count; i++) {
+        if (fat->compact_queue[i] == dir_cluster) {
+            return;
         }
-
-        entry_offset -= 32; // Move to the position for the LFN entry
-        fseek(fat->image, entry_offset, SEEK_SET);
-        fwrite(&lfn_entry, sizeof(LFN_t), 1, fat->image);
     }
 
-    entry_offset += lfn_entry_count * 32;
-    
-    fseek(fat->image, entry_offset, SEEK_SET);
-    fwrite(&entry, sizeof(DirectoryEntry_t), 1, fat->image);
-
-    fat32_flush(fat);
-
-    return new_cluster;
+    if (fat->compact_count < FAT32_COMPACT_QUEUE) {
+        fat->compact_queue[fat->compact_count++] = dir_cluster;
+    }
 }
 
-size_t fat32_write_experimental(fat_t* fat, size_t start_cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer) {
-    size_t bytes_written = 0;
-    size_t cluster_size = fat->cluster_size;
-    size_t current_cluster = start_cluster;
-
-    // Calculate the offset within the first cluster
-    size_t cluster_offset = offset % cluster_size;
-
-    // Calculate the number of clusters needed for the write
-    size_t initial_cluster_offset = offset / cluster_size;
-    size_t end_offset = offset + size;
-    size_t total_clusters_needed = (end_offset + cluster_size - 1) / cluster_size;
-
-    // Traverse to the correct starting cluster based on the initial offset
-    for (size_t i = 0; i < initial_cluster_offset; i++) {
-        current_cluster = fat->fat_chain[current_cluster];
-        if (current_cluster >= 0x0FFFFFF8) {
-            // Reached the end of the chain unexpectedly
-            current_cluster = 0;
-            break;
+// A queued directory that is being freed must not be compacted later, its clusters may be reused by then.
+static void fat32_forget_compaction(fat_t* fat, uint32_t dir_cluster) {
+    for (size_t i = 0; i < fat->compact_count; i++) {
+        if (fat->compact_queue[i] == dir_cluster) {
+            fat->compact_queue[i] = fat->compact_queue[--fat->compact_count];
+            return;
         }
     }
+}
 
-    if (current_cluster == 0) {
-        // Handle file extension if needed
-        current_cluster = fat32_find_free_cluster(fat);
-        if (current_cluster == 0) {
-            // No free clusters available, cannot proceed
-            *out_file_size = file_size;
-            return 0;
-        }
-        fat->fat_chain[start_cluster] = current_cluster;
-    }
+// Frees everything below a directory that is released as a whole. Its own entries are
+// left as they are, the clusters holding them go back to the allocator anyway.
+static size_t fat32_free_tree(fat_t* fat, uint32_t dir_cluster, size_t depth) {
+    fat32_unlink_ctx_t list = {0};
+    size_t removed = 0;
 
-    // Start writing data
-    size_t buffer_offset = 0;
-    while (buffer_offset < size) {
-        // Calculate the number of bytes to write in the current cluster
-        size_t write_size = cluster_size - cluster_offset;
-        if (write_size > size - buffer_offset) {
-            write_size = size - buffer_offset;
-        }
+    if (depth > 64) {
+        return 0;  // Directory loop, the checker reports those
+    }
 
-        // Calculate the offset in the FAT image
-        size_t write_offset = fat->cluster_base + (current_cluster * cluster_size) + cluster_offset;
+    fat32_iterate_directory(fat, dir_cluster, 0, fat32_collect_victim, &list);
 
-        // Write the data
-        fseek(fat->image, write_offset, SEEK_SET);
-        fwrite(buffer + buffer_offset, 1, write_size, fat->image);
+    for (size_t i = 0; i < list.count; i++) {
+        uint32_t cluster = FAT_DIRENT_CLUSTER(&list.victims[i].entry);
 
-        // Update tracking variables
-        buffer_offset += write_size;
-        bytes_written += write_size;
-        cluster_offset = 0; // Only the first cluster might have an initial offset
+        if (cluster == fat->fat->root_directory_offset_in_clusters) {
+            continue;
+        }
 
-        // Move to the next cluster if needed
-        if (buffer_offset < size) {
-            size_t next_cluster = fat->fat_chain[current_cluster];
-            if (next_cluster >= 0x0FFFFFF8) {
-                // Allocate a new cluster if needed
-                next_cluster = fat32_find_free_cluster(fat);
-                if (next_cluster == 0) {
-                    // No more clusters available
-                    break;
-                }
-                fat->fat_chain[current_cluster] = next_cluster;
-                fat->fat_chain[next_cluster] = 0x0FFFFFF8; // Mark new cluster as end of the chain
-            }
-            current_cluster = next_cluster;
+        if (list.victims[i].entry.attributes & ATTR_DIRECTORY) {
+            removed += fat32_free_tree(fat, cluster, depth + 1);
+            fat32_forget_compaction(fat, cluster);
+            fat_dir_index_invalidate(fat, cluster);
         }
-    }
 
-    // Update the file size if it has grown
-    *out_file_size = offset + bytes_written > file_size ? offset + bytes_written : file_size;
+        fat32_free_chain(fat, cluster);
+        removed++;
+    }
 
-    fat32_flush(fat);
+    free(list.victims);
 
-    return bytes_written;
+    return removed;
 }
 
-void fat32_get_file_info_coords(fat_t* fat, uint32_t dir_cluster, const char* filename, size_t* out_cluster, size_t* out_offset) {
-    uint32_t cluster_size = fat->cluster_size;
-    uint32_t current_cluster = dir_cluster;
-    size_t current_offset = 0;
-
-    // Buffer to store the reconstructed LFN
-    uint16_t in_name_buffer[256] = {0};
-    size_t in_name_ptr = 0;
-    char out_name_buffer[256] = {0};
+// Removes the named entries of one directory in a single pass over it. Directories must
+// be empty unless `recursive` is set. Entries are marked deleted before their clusters
+// are freed, so a crash in between leaves lost clusters rather than dangling entries.
+// Returns the number of entries removed, including everything below removed directories.
+size_t fat32_unlink_batch(fat_t* fat, uint32_t dir_cluster, const char* const* names, size_t count, bool recursive) {
+    FAT_OP_BEGIN(started);
 
-    while (current_cluster < 0x0FFFFFF8) {
-        char* cluster_data = calloc(1, cluster_size);
-        read_cluster_chain(fat, current_cluster, false, cluster_data);
+    fat32_unlink_ctx_t unlink = {0};
+    size_t removed = 0;
+    size_t kept = 0;
 
-        for (size_t offset = 0; offset < cluster_size; offset += 32) {
-            DirectoryEntry_t* entry = (DirectoryEntry_t*)(cluster_data + offset);
+    if (fat->read_only || dir_cluster < 2 || count == 0) {
+        goto end;
+    }
 
-            if (entry->name[0] == 0x00) {
-                // End of directory
-                free(cluster_data);
-                return;
-            }
+    unlink.names = malloc(count * sizeof(char*));
+    unlink.name_count = count;
+    memcpy(unlink.names, names, count * sizeof(char*));
+    qsort(unlink.names, count, sizeof(char*), fat32_compare_names);
 
-            if ((uint8_t)entry->name[0] == 0xE5) {
-                // Deleted entry, skip
-                continue;
-            }
+    fat32_iterate_directory(fat, dir_cluster, 0, fat32_collect_victim, &unlink);
 
-            if (entry->attributes & ATTR_LONG_FILE_NAME) {
-                // Handle LFN entry
-                LFN_t* lfn = (LFN_t*)(cluster_data + offset);
-                in_name_ptr = 0; // Reset the name pointer
+    for (size_t i = 0; i < unlink.count; i++) {
+        const DirectoryEntry_t* entry = &unlink.victims[i].entry;
+        uint32_t cluster = FAT_DIRENT_CLUSTER(entry);
 
-                for (int i = 0; i < 5; i++) {
-                    if (lfn->first_name_chunk[i] == 0x0000) break;
-                    in_name_buffer[in_name_ptr++] = lfn->first_name_chunk[i];
-                }
+        if ((entry->attributes & ATTR_DIRECTORY) && !recursive && cluster >= 2) {
+            bool has_entries = false;
+            fat32_iterate_directory(fat, cluster, 0, fat32_find_any, &has_entries);
 
-                for (int i = 0; i < 6; i++) {
-                    if (lfn->second_name_chunk[i] == 0x0000) break;
-                    in_name_buffer[in_name_ptr++] = lfn->second_name_chunk[i];
-                }
+            if (has_entries) {
+                continue;
+            }
+        }
 
-                for (int i = 0; i < 2; i++) {
-                    if (lfn->third_name_chunk[i] == 0x0000) break;
-                    in_name_buffer[in_name_ptr++] = lfn->third_name_chunk[i];
-                }
+        unlink.victims[kept++] = unlink.victims[i];
+    }
 
-                // If this is the last LFN part (indicated by bit 6 of the sequence number), process it
-                if (lfn->attr_number & 0x40) {
-                    utf16_to_utf8(in_name_buffer, in_name_ptr, out_name_buffer);
-
-                    // Compare the reconstructed LFN with the target filename
-                    if (strcmp(out_name_buffer, filename) == 0) {
-                        offset += (lfn->attr_number & ~0x40) * 32;
-
-                        bool ow = offset / fat->cluster_size;
-                        
-                        if(ow) {
-                            current_cluster++;
-                            offset %= fat->cluster_size;
-                        }
-
-                        *out_cluster = current_cluster;
-                        *out_offset = offset;
-                        free(cluster_data);
-                        return;
-                    }
+    fat32_mark_deleted(fat, dir_cluster, unlink.victims, kept);
 
-                    // Reset the buffers for the next file entry
-                    memset(in_name_buffer, 0, sizeof(in_name_buffer));
-                    memset(out_name_buffer, 0, sizeof(out_name_buffer));
-                }
-            } else if (!(entry->attributes & ATTR_LONG_FILE_NAME)) {
-                // Handle short file name (SFN) entries (non-LFN case)
-                char sfn[12] = {0};
-                memcpy(sfn, entry->name, 8);
-                if (entry->ext[0] != ' ') {
-                    strcat(sfn, ".");
-                    strncat(sfn, entry->ext, 3);
-                }
+    for (size_t i = 0; i < kept; i++) {
+        const DirectoryEntry_t* entry = &unlink.victims[i].entry;
+        uint32_t cluster = FAT_DIRENT_CLUSTER(entry);
 
-                // Compare the SFN with the target filename
-                if (strcmp(sfn, filename) == 0) {
-                    *out_cluster = current_cluster;
-                    *out_offset = offset;
-                    free(cluster_data);
-                    return;
-                }
-            }
+        if ((entry->attributes & ATTR_DIRECTORY) && cluster >= 2) {
+            removed += fat32_free_tree(fat, cluster, 0);
+            fat32_forget_compaction(fat, cluster);
+            fat_dir_index_invalidate(fat, cluster);
         }
 
-        // Move to the next cluster in the chain
-        current_cluster = fat->fat_chain[current_cluster];
-        free(cluster_data);
+        fat32_free_chain(fat, cluster);
+        removed++;
     }
 
-    // If we reach here, the file was not found
-    *out_cluster = 0;
-    *out_offset = 0;
-}
+    if (kept) {
+        fat32_queue_compaction(fat, dir_cluster);
+    }
 
-DirectoryEntry_t fat32_read_file_info(fat_t* fat, size_t dir_clust, const char* file) {
-    size_t out_clust, out_offset;
-    DirectoryEntry_t de = {0};
+    fat32_flush(fat);
 
-    fat32_get_file_info_coords(fat, dir_clust, file, &out_clust, &out_offset);
+end:
+    free(unlink.victims);
+    free(unlink.names);
+
+    FAT_OP_END(fat, FAT_OP_DELETE, started);
 
-    size_t offset = fat->cluster_base + (out_clust * fat->cluster_size) + out_offset;
-    fseek(fat->image, offset, SEEK_SET);
+    return removed;
+}
 
-    fread(&de, sizeof(DirectoryEntry_t), 1, fat->image);
+// Removes a file or an empty directory.
+bool fat32_unlink(fat_t* fat, const char* path) {
+    uint64_t traced = fat_trace_begin(fat);
+    const char* name;
+    size_t dir_cluster = fat32_parent_cluster(fat, path, &name);
+    bool removed = fat32_unlink_batch(fat, dir_cluster, &name, 1, false) != 0;
 
-    return de; 
+    FAT_TRACE_END(fat, traced, FAT_TRACE_UNLINK, path, NULL, .result = removed);
+
+    return removed;
 }
 
-void fat32_write_file_info(fat_t* fat, size_t dir_clust, const char* file, DirectoryEntry_t ent) {
-    size_t out_clust, out_offset;
+// Removes the entry of an open file. Its clusters stay with the handle, which can keep
+// reading and writing them, and are freed by fat32_file_close.
+bool fat32_file_unlink(fat_t* fat, fat32_file_t* file) {
+    uint64_t traced = fat_trace_begin(fat);
+    const char* name;
+    size_t dir_cluster = fat32_parent_cluster(fat, file->path, &name);
+    fat32_unlink_ctx_t unlink = {.names = &name, .name_count = 1};
 
-    fat32_get_file_info_coords(fat, dir_clust, file, &out_clust, &out_offset);
+    if (dir_cluster >= 2 && !fat->read_only && !file->unlinked) {
+        fat32_iterate_directory(fat, dir_cluster, 0, fat32_collect_victim, &unlink);
+    }
 
-    size_t offset = fat->cluster_base + (out_clust * fat->cluster_size) + out_offset;
-    fseek(fat->image, offset, SEEK_SET);
+    bool removed = unlink.count == 1 && !(unlink.victims[0].entry.attributes & ATTR_DIRECTORY);
 
-    fwrite(&ent, sizeof(DirectoryEntry_t), 1, fat->image);
-}
+    if (removed) {
+        fat32_mark_deleted(fat, dir_cluster, unlink.victims, 1);
+        fat32_queue_compaction(fat, dir_cluster);
+        fat32_flush(fat);
 
-void fat32_write_size(fat_t* fat, size_t fp_cluster, size_t fp_offset, size_t size) {
-    size_t offset = fat->cluster_base + (fp_cluster * fat->cluster_size) + fp_offset;
-    printf("=====> %x\n", offset);
-    fseek(fat->image, offset, SEEK_SET);
+        file->unlinked = true;
+    }
 
-    DirectoryEntry_t entry;
-    fread(&entry, sizeof(DirectoryEntry_t), 1, fat->image);
+    free(unlink.victims);
 
-    fseek(fat->image, offset, SEEK_SET);
-    
-    entry.file_size = size;
+    FAT_TRACE_END(fat, traced, FAT_TRACE_UNLINK, file->path, NULL, .result = removed);
 
-    fwrite(&entry, sizeof(DirectoryEntry_t), 1, fat->image);
+    return removed;
 }
 
-void fat32_write(fat_t* fat, const char* path, size_t offset, size_t size, const char* buffer) {
-    size_t out_file_size;
+// Removes a file or a directory with everything below it, returns the number of entries removed.
+size_t fat32_remove_tree(fat_t* fat, const char* path) {
+    const char* name;
+    size_t dir_cluster = fat32_parent_cluster(fat, path, &name);
 
-    size_t cluster = fat32_search(fat, path);
+    return fat32_unlink_batch(fat, dir_cluster, &name, 1, true);
+}
 
-    size_t filesize = fat32_get_file_size(fat, path);
+// Moves the live entries of a directory to its front, LFN runs and their short entries
+// unchanged, and frees the clusters no longer needed. Does nothing unless at least
+// `min_dead_percent` of the used slots are deleted ones. Entries only ever move towards
+// the start and clusters are written in chain order, so an interrupted pass can leave an
+// entry duplicated but never lost. Returns the number of clusters freed.
+size_t fat32_compact_directory(fat_t* fat, uint32_t dir_cluster, uint32_t min_dead_percent) {
+    if (fat->read_only || dir_cluster < 2) {
+        return 0;
+    }
 
-    fat32_write_experimental(fat, cluster, filesize, offset, size, &out_file_size, buffer);
+    size_t chain_length = read_cluster_chain(fat, dir_cluster, true, NULL);
+    uint32_t cluster_size = fat->cluster_size;
+    uint32_t per_cluster = cluster_size / sizeof(DirectoryEntry_t);
 
-    size_t fcl, fof;
+    uint32_t* clusters = malloc(chain_length * sizeof(uint32_t));
+    uint8_t* data = malloc(chain_length * cluster_size);
 
-    // TODO: Get directory cluster and filename
+    uint32_t cluster = dir_cluster;
+    for (size_t i = 0; i < chain_length; i++) {
+        clusters[i] = cluster;
+        fat32_read_at(fat, fat32_cluster_offset(fat, cluster), data + i * cluster_size, cluster_size);
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
 
-    const char* file = path + strlen(path);
+    size_t total = chain_length * per_cluster;
+    size_t live = 0;
+    size_t dead = 0;
+    size_t first_dead = total;
 
-    while(*file != '/') {
-        file--;
-    }
+    for (size_t slot = 0; slot < total; slot++) {
+        uint8_t* entry = data + slot * sizeof(DirectoryEntry_t);
 
-    file++;
+        if (entry[0] == 0x00) {
+            break;
+        }
 
-    
-    char* dirp = calloc((file - path) + 1, 1);
+        if (entry[0] == 0xE5) {
+            if (dead++ == 0) {
+                first_dead = slot;
+            }
+            continue;
+        }
 
-    memcpy(dirp, path, file - path);
+        if (live != slot) {
+            memcpy(data + live * sizeof(DirectoryEntry_t), entry, sizeof(DirectoryEntry_t));
+        }
 
-    printf("Path: %s\n", dirp);
-    printf("File: %s\n", file);
+        live++;
+    }
 
-    size_t dir_cluster = fat32_search(fat, dirp);
-     
-    free(dirp);
+    size_t freed = 0;
 
-    fat32_get_file_info_coords(fat, dir_cluster, file, &fcl, &fof);
-    fat32_write_size(fat, fcl, fof, out_file_size);
-}
+    if (dead == 0 || dead * 100 < (size_t)min_dead_percent * (live + dead)) {
+        goto end;
+    }
 
-int main() {
-    fat_t myfat;
+    memset(data + live * sizeof(DirectoryEntry_t), 0, (total - live) * sizeof(DirectoryEntry_t));
+    fat_dir_index_invalidate(fat, dir_cluster);
 
-    fat32_init("disk.img", &myfat);
+    size_t keep = (live + per_cluster - 1) / per_cluster;
+    if (keep == 0) {
+        keep = 1;
+    }
 
-    printf("Cluster size: %d\n", myfat.cluster_size);
-    printf("Fat offset: %d\n", myfat.fat_offset);
-    printf("Fat size: %d\n", myfat.fat_size);
-    printf("Reserved FAT offset: %d\n", myfat.reserved_fat_offset);
-    printf("Root directory offset: %d\n", myfat.root_directory_offset);
-    printf("Root directory cluster: %d\n", myfat.fat->root_directory_offset_in_clusters);
-    printf("Cluster base: %d\n", myfat.cluster_base);
+    for (size_t i = first_dead / per_cluster; i < keep; i++) {
+        fat32_write_at(fat, fat32_cluster_offset(fat, clusters[i]), data + i * cluster_size, cluster_size);
+    }
 
-    direntry_t* dir = read_directory(&myfat, myfat.fat->root_directory_offset_in_clusters);
-    direntry_t* orig = dir;
+    if (keep < chain_length) {
+        fat32_set_fat_entry(fat, clusters[keep - 1], 0x0FFFFFF8);
+        freed = fat32_free_chain(fat, clusters[keep]);
+    }
 
-    fast_traverse(dir);
+    fat32_flush(fat);
 
-    //fat32_create_file(&myfat, 2, "Gavno", false);
-    //size_t cluster = fat32_create_file(&myfat, 2, "Pokemon.txt", true);
+end:
+    free(data);
+    free(clusters);
 
-    //printf("File at cluster: %zu\n", cluster);
+    return freed;
+}
 
-    char* memory = "Pikachu forever!!!\n";
+// Deferred work that is too slow for the operation that caused it. Currently compacts the
+// directories queued by unlinks once their dead slot share reaches compact_threshold.
+// Called on unmount; long running hosts can call it when idle.
+size_t fat32_maintenance(fat_t* fat) {
+    fat_sched_class_t saved = fat_sched_set_class(FAT_SCHED_BACKGROUND);
+    size_t freed = 0;
 
-    //size_t cluster = fat32_create_file(&myfat, 2, "Pokemon.txt", true);
+    while (fat->compact_count > 0) {
+        freed += fat32_compact_directory(fat, fat->compact_queue[--fat->compact_count], fat->compact_threshold);
+    }
 
-    fat32_write(&myfat, "/Pokemon.txt", 4, strlen(memory), memory);
+    fat_sched_set_class(saved);
 
-    fat32_deinit(&myfat);
+    return freed;
 }
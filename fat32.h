@@ -3,7 +3,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 #include "vfs.h"
+#include "fat_cache.h"
+#include "fat_rle.h"
+#include "fat_metrics.h"
 
 typedef unsigned char u8;
 typedef unsigned short u16;
@@ -19,6 +25,21 @@ typedef unsigned int u32;
 #define ATTR_LONG_FILE_NAME 0x0F
 #define ATTR_LFN_MASK 0x3F
 
+// UTF-16 units in a long name; longer runs on disk are corrupt.
+#define FAT32_LFN_MAX 255
+
+#define FAT32_FREE_UNKNOWN 0xFFFFFFFF
+
+// Vectors handed to one preadv/pwritev call by the scatter-gather paths.
+#define FAT32_IOV_BATCH 64
+
+// Directories queued for compaction after losing entries, and the share of dead
+// slots (percent) at which fat32_maintenance compacts one. 0 disables it.
+#define FAT32_COMPACT_QUEUE 64
+#ifndef FAT32_COMPACT_THRESHOLD
+#define FAT32_COMPACT_THRESHOLD 50
+#endif
+
 typedef struct {
     char bootcode[3];
     char OEM[8];
@@ -50,18 +71,43 @@ typedef struct {
     char bootcode_next[];
 } __attribute__((packed)) FATInfo_t;
 
-typedef struct {
+typedef struct fat {
     FILE* image;
     FATInfo_t* fat;
 
-    uint32_t* fat_chain;
+    fat_cache_t fat_cache;  // Demand-paged FAT, see fat_cache.c
+    fat_rle_t* fat_runs;    // Used instead of the cache on read-only mounts
+    bool read_only;
+    pthread_mutex_t fat_lock;  // Guards FAT entry access
 
     uint32_t cluster_size;
+    uint32_t cluster_shift;  // log2(cluster_size), FAT cluster sizes are powers of two
+    uint32_t cluster_mask;   // cluster_size - 1
     uint32_t fat_offset;
     uint32_t fat_size;
     uint32_t reserved_fat_offset;
-    uint32_t root_directory_offset;
-    uint32_t cluster_base;
+    uint64_t root_directory_offset;
+    uint64_t cluster_base;  // Where cluster 0 would start; may lie before the image and wrap
+    uint32_t cluster_count;  // Including the two reserved entries
+    uint32_t next_free;      // Where to start looking for a free cluster
+    uint32_t free_clusters;  // Kept up to date by fat32_set_fat_entry, FAT32_FREE_UNKNOWN until counted
+    bool fsinfo_dirty;       // FSInfo sector is behind free_clusters/next_free
+
+    uint32_t generation;  // Bumped in FSInfo by every flush that follows a write
+    bool modified;        // Written to since the last flush
+    struct fat_catalog* catalog;  // Optional tree sidecar, see fat_catalog.c
+
+    struct fat_overlay* overlay;  // Copy-on-write delta over a read-only base, see fat_overlay.c
+    struct fat_sched* sched;      // Optional I/O scheduler, see fat_sched.c
+    struct fat_trace* trace;      // Workload recording, see fat_trace.c
+
+    struct fat_dir_index* dir_index;  // Free slot indexes of recently used directories, see fat_dirindex.c
+
+    uint32_t compact_threshold;
+    uint32_t compact_queue[FAT32_COMPACT_QUEUE];
+    size_t compact_count;
+
+    fat_metrics_t metrics;   // Only updated when built with FAT32_METRICS
 } fat_t;
 
 typedef struct {
@@ -80,6 +126,118 @@ typedef struct {
     uint32_t file_size;
 } __attribute__((packed)) DirectoryEntry_t;
 
+typedef struct {
+    DirectoryEntry_t entry;  // Short entry
+    char name[768];          // Long name if present, 8.3 name otherwise (UTF-8)
+    uint32_t cluster;        // Directory cluster holding the short entry
+    uint32_t offset;         // Offset of the short entry inside that cluster
+    uint32_t slot;           // Index of the short entry inside the directory
+    uint32_t lfn_count;      // Number of LFN slots right before it
+} fat32_dirent_t;
+
+// One path of fat32_stat_batch.
+typedef struct {
+    const char* path;  // Set by the caller, everything else is filled in
+    bool found;
+    direntry_type_t type;
+    uint8_t attributes;
+    uint32_t cluster;  // Root cluster for "/"
+    size_t size;
+    datetime_t created;
+    datetime_t modified;
+    datetime_t accessed;  // Date only
+} fat32_stat_t;
+
+// An open file, resolved once by fat32_file_open so positional reads and writes walk
+// neither the path nor the whole chain. Size and first cluster changes stay here until
+// fat32_file_sync writes them to the directory entry.
+typedef struct {
+    char* path;
+    uint32_t first_cluster;  // 0 while the file owns no cluster
+    uint32_t last_cluster;
+    uint32_t clusters;       // Chain length
+    uint32_t size;
+    bool dirty;              // Entry or FAT behind what is here
+    bool unlinked;           // Entry removed, the chain goes with the last close
+    uint64_t cursor;         // Last cluster looked up, index << 32 | cluster
+
+    // Chain as the catalog had it at open, NULL without one or once the chain shrank.
+    struct fat_catalog_extent* extents;
+    uint32_t extent_count;
+} fat32_file_t;
+
+// Return false to stop the iteration.
+typedef bool (*fat32_dirent_fn_t)(fat_t* fat, const fat32_dirent_t* dirent, void* ctx);
+
+// Image offset of a data cluster, in 64 bits so images past 4 GB work.
+static inline uint64_t fat32_cluster_offset(const fat_t* fat, uint32_t cluster) {
+    return fat->cluster_base + ((uint64_t)cluster << fat->cluster_shift);
+}
+
+#define FAT_DIRENT_CLUSTER(e) ((uint32_t)(((e)->high_cluster << 16) | (e)->low_cluster))
+
+void fat32_init(const char* filename, fat_t* fat);
+void fat32_init_readonly(const char* filename, fat_t* fat);
+void fat32_deinit(fat_t* fat);
+
+bool fat32_init_overlay(const char* base_filename, const char* delta_filename, fat_t* fat);
+bool fat32_overlay_commit(fat_t* fat);
+bool fat32_overlay_sync(fat_t* fat);
+void fat32_overlay_discard(fat_t* fat);
+
 direntry_t* read_directory(fat_t* fat, uint32_t start_cluster);
+void fat32_free_directory(direntry_t* dir);
+void fat32_decode_datetime(uint16_t date, uint16_t time, uint8_t tenths, datetime_t* out);
+void fast_traverse(direntry_t* dir);
 void read_file_data(fat_t* fat, uint32_t start_cluster);
 size_t read_cluster_chain(fat_t* fat, uint32_t start_cluster, bool probe, void* out);
+size_t fat32_iterate_directory(fat_t* fat, uint32_t start_cluster, size_t max_clusters, fat32_dirent_fn_t fn, void* ctx);
+
+size_t fat32_read_at(fat_t* fat, size_t offset, void* buffer, size_t size);
+size_t fat32_write_at(fat_t* fat, size_t offset, const void* buffer, size_t size);
+size_t fat32_readv_at(fat_t* fat, size_t offset, const struct iovec* iov, int count);
+size_t fat32_device_io(fat_t* fat, bool write, size_t offset, const struct iovec* iov, int count);
+void fat32_device_zero(fat_t* fat, size_t offset, size_t size);
+size_t fat32_writev_at(fat_t* fat, size_t offset, const struct iovec* iov, int count);
+
+size_t fat32_find_free_cluster(fat_t* fat);
+size_t fat32_allocate_cluster(fat_t* fat, size_t for_cluster, bool zero_fill);
+void fat32_zero_range(fat_t* fat, size_t offset, size_t size);
+uint32_t fat32_find_free_run(fat_t* fat, uint32_t from, uint32_t count);
+size_t fat32_free_chain(fat_t* fat, uint32_t start);
+uint32_t fat32_free_clusters(fat_t* fat);
+void fat32_flush(fat_t* f);
+
+size_t fat32_search(fat_t* fat, const char* path);
+size_t fat32_get_file_size(fat_t* fat, const char* filename);
+size_t fat32_stat_batch(fat_t* fat, fat32_stat_t* stats, size_t count);
+DirectoryEntry_t fat32_read_file_info(fat_t* fat, size_t dir_clust, const char* file);
+size_t fat32_create_file(fat_t* fat, size_t dir_cluster, const char* filename, bool is_file);
+size_t fat32_write_experimental(fat_t* fat, size_t start_cluster, size_t file_size, size_t offset, size_t size, size_t* out_file_size, const char* buffer);
+void fat32_write(fat_t* fat, const char* path, size_t offset, size_t size, const char* buffer);
+size_t fat32_readv(fat_t* fat, uint32_t start_cluster, size_t file_size, size_t offset, const struct iovec* iov, int count);
+size_t fat32_writev(fat_t* fat, const char* path, size_t offset, const struct iovec* iov, int count);
+
+bool fat32_file_open(fat_t* fat, const char* path, fat32_file_t* file);
+size_t fat32_file_readv(fat_t* fat, fat32_file_t* file, size_t offset, const struct iovec* iov, int count);
+size_t fat32_file_writev(fat_t* fat, fat32_file_t* file, size_t offset, const struct iovec* iov, int count);
+bool fat32_file_truncate(fat_t* fat, fat32_file_t* file, size_t length);
+void fat32_file_sync(fat_t* fat, fat32_file_t* file);
+void fat32_file_close(fat_t* fat, fat32_file_t* file);
+bool fat32_file_unlink(fat_t* fat, fat32_file_t* file);
+
+bool fat32_fallocate(fat_t* fat, const char* path, size_t length);
+bool fat32_truncate(fat_t* fat, const char* path, size_t length);
+bool fat32_copy(fat_t* fat, const char* src_path, const char* dst_path);
+bool fat32_unlink(fat_t* fat, const char* path);
+bool fat32_set_times(fat_t* fat, const char* path, time_t modified, time_t accessed);
+size_t fat32_unlink_batch(fat_t* fat, uint32_t dir_cluster, const char* const* names, size_t count, bool recursive);
+size_t fat32_remove_tree(fat_t* fat, const char* path);
+size_t fat32_compact_directory(fat_t* fat, uint32_t dir_cluster, uint32_t min_dead_percent);
+size_t fat32_maintenance(fat_t* fat);
+size_t read_cluster_chain_advanced(fat_t* fat, uint32_t start_cluster, size_t byte_offset, size_t size, bool probe, void* out);
+
+uint32_t fat32_get_fat_entry(fat_t* fat, uint32_t cluster);
+void fat32_set_fat_entry(fat_t* fat, uint32_t cluster, uint32_t value);
+void fat_cache_flush(fat_t* fat);
+void fat_cache_resize(fat_t* fat, size_t capacity);
@@ -0,0 +1,344 @@
+#include "fat_cache.h"
+#include "fat32.h"
+#include "fat_sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void fat_page_pool_init(fat_page_pool_t* pool) {
+    memset(pool, 0, sizeof(fat_page_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+// Frees pages nobody is using until at most `keep` bytes of them are left.
+void fat_page_pool_trim(fat_page_pool_t* pool, size_t keep) {
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->free_pages && pool->free_count * pool->page_size > keep) {
+        fat_page_t* page = pool->free_pages;
+        pool->free_pages = page->hash_next;
+        pool->free_count--;
+
+        free(page->entries);
+        free(page);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t fat_page_pool_free_bytes(fat_page_pool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    size_t bytes = pool->free_count * pool->page_size;
+    pthread_mutex_unlock(&pool->lock);
+
+    return bytes;
+}
+
+void fat_page_pool_destroy(fat_page_pool_t* pool) {
+    fat_page_pool_trim(pool, 0);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static fat_page_t* fat_cache_alloc_page(fat_cache_t* cache) {
+    fat_page_pool_t* pool = cache->pool;
+    fat_page_t* page = NULL;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->free_pages && pool->page_size == cache->page_size) {
+            page = pool->free_pages;
+            pool->free_pages = page->hash_next;
+            pool->free_count--;
+        }
+
+        pool->used += cache->page_size;
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (page == NULL) {
+        page = calloc(1, sizeof(fat_page_t));
+        page->entries = calloc(1, cache->page_size);
+    }
+
+    page->hash_next = NULL;
+
+    return page;
+}
+
+static void fat_cache_free_page(fat_cache_t* cache, fat_page_t* page) {
+    fat_page_pool_t* pool = cache->pool;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+
+        pool->used -= cache->page_size;
+
+        // The free list holds one page size, the first one returned decides it.
+        if (pool->free_pages == NULL) {
+            pool->page_size = cache->page_size;
+        }
+
+        if (pool->page_size == cache->page_size) {
+            page->hash_next = pool->free_pages;
+            pool->free_pages = page;
+            pool->free_count++;
+            page = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (page) {
+        free(page->entries);
+        free(page);
+    }
+}
+
+static void fat_cache_alloc_table(fat_cache_t* cache) {
+    cache->bucket_count = 1;
+    while (cache->bucket_count < cache->capacity * 2) {
+        cache->bucket_count <<= 1;
+    }
+
+    cache->pages = calloc(cache->capacity, sizeof(fat_page_t*));
+    cache->buckets = calloc(cache->bucket_count, sizeof(fat_page_t*));
+}
+
+void fat_cache_init(fat_cache_t* cache, size_t page_size, size_t capacity) {
+    memset(cache, 0, sizeof(fat_cache_t));
+
+    cache->page_size = page_size;
+    cache->capacity = capacity ? capacity : 1;
+
+    fat_cache_alloc_table(cache);
+}
+
+void fat_cache_destroy(fat_cache_t* cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        fat_cache_free_page(cache, cache->pages[i]);
+    }
+
+    free(cache->pages);
+    free(cache->buckets);
+
+    memset(cache, 0, sizeof(fat_cache_t));
+}
+
+static fat_page_t* fat_cache_lookup(fat_cache_t* cache, uint32_t index) {
+    fat_page_t* page = cache->buckets[index & (cache->bucket_count - 1)];
+
+    while (page) {
+        if (page->index == index) {
+            return page;
+        }
+
+        page = page->hash_next;
+    }
+
+    return NULL;
+}
+
+static void fat_cache_unlink(fat_cache_t* cache, fat_page_t* page) {
+    fat_page_t** slot = &cache->buckets[page->index & (cache->bucket_count - 1)];
+
+    while (*slot != page) {
+        slot = &(*slot)->hash_next;
+    }
+
+    *slot = page->hash_next;
+    page->hash_next = NULL;
+}
+
+// Writes the page into every copy of the FAT.
+static void fat_cache_write_back(fat_t* fat, fat_page_t* page) {
+    size_t page_offset = (size_t)page->index * fat->fat_cache.page_size;
+    bool urgent = fat_sched_set_urgent(true);  // Under fat_lock, see fat_sched_set_urgent
+
+    for (uint8_t copy = 0; copy < fat->fat->copies; copy++) {
+        size_t offset = fat->fat_offset + (size_t)copy * fat->fat_size + page_offset;
+
+        fat32_write_at(fat, offset, page->entries, page->length);
+    }
+
+    fat_sched_set_urgent(urgent);
+    page->dirty = false;
+}
+
+// Empties the least recently used page, preferring clean ones, and returns its slot.
+static size_t fat_cache_evict(fat_t* fat) {
+    fat_cache_t* cache = &fat->fat_cache;
+    size_t victim = 0;
+
+    for (size_t i = 1; i < cache->count; i++) {
+        fat_page_t* v = cache->pages[victim];
+        fat_page_t* p = cache->pages[i];
+
+        if ((v->dirty && !p->dirty) || (v->dirty == p->dirty && p->last_used < v->last_used)) {
+            victim = i;
+        }
+    }
+
+    if (cache->pages[victim]->dirty) {
+        fat_cache_write_back(fat, cache->pages[victim]);
+    }
+
+    fat_cache_unlink(cache, cache->pages[victim]);
+
+    return victim;
+}
+
+// Changes how many pages the cache may hold, writing back and releasing pages
+// when it shrinks. Used to keep several mounts within one memory budget.
+void fat_cache_resize(fat_t* fat, size_t capacity) {
+    fat_cache_t* cache = &fat->fat_cache;
+
+    if (capacity == 0) {
+        capacity = 1;
+    }
+
+    pthread_mutex_lock(&fat->fat_lock);
+
+    while (cache->count > capacity) {
+        size_t victim = fat_cache_evict(fat);
+
+        fat_cache_free_page(cache, cache->pages[victim]);
+        cache->pages[victim] = cache->pages[--cache->count];
+    }
+
+    fat_page_t** pages = cache->pages;
+    fat_page_t** buckets = cache->buckets;
+
+    cache->capacity = capacity;
+    fat_cache_alloc_table(cache);
+
+    for (size_t i = 0; i < cache->count; i++) {
+        fat_page_t* page = pages[i];
+        fat_page_t** bucket = &cache->buckets[page->index & (cache->bucket_count - 1)];
+
+        cache->pages[i] = page;
+        page->hash_next = *bucket;
+        *bucket = page;
+    }
+
+    free(pages);
+    free(buckets);
+
+    pthread_mutex_unlock(&fat->fat_lock);
+}
+
+static fat_page_t* fat_cache_get_page(fat_t* fat, uint32_t index) {
+    fat_cache_t* cache = &fat->fat_cache;
+    fat_page_t* page = fat_cache_lookup(cache, index);
+
+    if (page) {
+        FAT_METRIC_ADD(fat, fat_cache_hits, 1);
+        page->last_used = ++cache->clock;
+        return page;
+    }
+
+    FAT_METRIC_ADD(fat, fat_cache_misses, 1);
+
+    if (cache->count < cache->capacity) {
+        page = fat_cache_alloc_page(cache);
+        cache->pages[cache->count++] = page;
+    } else {
+        page = cache->pages[fat_cache_evict(fat)];
+    }
+
+    size_t page_offset = (size_t)index * cache->page_size;
+
+    page->index = index;
+    page->length = cache->page_size;
+    if (page_offset >= fat->fat_size) {
+        page->length = 0;  // Callers check the cluster range, this only keeps the read in bounds
+    } else if (page_offset + page->length > fat->fat_size) {
+        page->length = fat->fat_size - page_offset;
+    }
+
+    page->dirty = false;
+    page->last_used = ++cache->clock;
+
+    memset(page->entries, 0, cache->page_size);
+
+    bool urgent = fat_sched_set_urgent(true);
+    fat32_read_at(fat, fat->fat_offset + page_offset, page->entries, page->length);
+    fat_sched_set_urgent(urgent);
+
+    fat_page_t** bucket = &cache->buckets[index & (cache->bucket_count - 1)];
+    page->hash_next = *bucket;
+    *bucket = page;
+
+    return page;
+}
+
+uint32_t fat32_get_fat_entry(fat_t* fat, uint32_t cluster) {
+    uint32_t value;
+
+    // A corrupt link past the volume ends the chain; its entry would lie beyond the FAT.
+    if (cluster >= fat->cluster_count) {
+        return 0x0FFFFFFF;
+    }
+
+    FAT_METRIC_ADD(fat, fat_lookups, 1);
+    pthread_mutex_lock(&fat->fat_lock);
+
+    if (fat->fat_runs) {
+        value = fat_rle_lookup(fat->fat_runs, cluster);
+    } else {
+        size_t per_page = fat->fat_cache.page_size / sizeof(uint32_t);
+        fat_page_t* page = fat_cache_get_page(fat, cluster / per_page);
+
+        value = page->entries[cluster % per_page] & 0x0FFFFFFF;
+    }
+
+    pthread_mutex_unlock(&fat->fat_lock);
+
+    return value;
+}
+
+void fat32_set_fat_entry(fat_t* fat, uint32_t cluster, uint32_t value) {
+    if (fat->read_only || cluster >= fat->cluster_count) {
+        return;
+    }
+
+    FAT_METRIC_ADD(fat, fat_updates, 1);
+    pthread_mutex_lock(&fat->fat_lock);
+
+    size_t per_page = fat->fat_cache.page_size / sizeof(uint32_t);
+    fat_page_t* page = fat_cache_get_page(fat, cluster / per_page);
+    uint32_t* entry = &page->entries[cluster % per_page];
+
+    bool was_free = (*entry & 0x0FFFFFFF) == 0;
+    bool is_free = (value & 0x0FFFFFFF) == 0;
+
+    if (was_free != is_free && fat->free_clusters != FAT32_FREE_UNKNOWN) {
+        fat->free_clusters += is_free ? 1 : -1;
+        fat->fsinfo_dirty = true;
+    }
+
+    // Upper 4 bits are reserved and must be preserved.
+    *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    page->dirty = true;
+
+    pthread_mutex_unlock(&fat->fat_lock);
+}
+
+void fat_cache_flush(fat_t* fat) {
+    fat_cache_t* cache = &fat->fat_cache;
+
+    if (fat->read_only) {
+        return;
+    }
+
+    pthread_mutex_lock(&fat->fat_lock);
+
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->pages[i]->dirty) {
+            fat_cache_write_back(fat, cache->pages[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&fat->fat_lock);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// FAT is loaded in pages of this many sectors on first access.
+#define FAT_CACHE_PAGE_SECTORS 8
+// Pages kept in memory per mounted image (8 sectors * 512 bytes * 64 = 256 KB).
+#ifndef FAT_CACHE_DEFAULT_PAGES
+#define FAT_CACHE_DEFAULT_PAGES 64
+#endif
+
+typedef struct fat_page {
+    uint32_t index;        // Page number inside the FAT
+    uint32_t length;       // Valid bytes (last page of the FAT may be short)
+    bool dirty;
+    uint64_t last_used;
+
+    uint32_t* entries;
+
+    struct fat_page* hash_next;
+} fat_page_t;
+
+// Pages shared by the caches of several images. Released pages are kept for reuse
+// by any cache with the same page size; `used` is what all caches hold together.
+typedef struct fat_page_pool {
+    pthread_mutex_t lock;
+    size_t page_size;      // Size of the pages on the free list
+    size_t used;           // Bytes in pages handed out
+    fat_page_t* free_pages;
+    size_t free_count;
+} fat_page_pool_t;
+
+typedef struct {
+    size_t page_size;      // In bytes
+    size_t capacity;       // Max resident pages
+    size_t count;          // Resident pages
+
+    fat_page_t** pages;    // `capacity` slots, filled on demand
+    fat_page_t** buckets;
+    size_t bucket_count;   // Power of two
+
+    uint64_t clock;
+    fat_page_pool_t* pool; // NULL for private pages
+} fat_cache_t;
+
+void fat_cache_init(fat_cache_t* cache, size_t page_size, size_t capacity);
+void fat_cache_destroy(fat_cache_t* cache);
+
+void fat_page_pool_init(fat_page_pool_t* pool);
+void fat_page_pool_trim(fat_page_pool_t* pool, size_t keep);
+size_t fat_page_pool_free_bytes(fat_page_pool_t* pool);
+void fat_page_pool_destroy(fat_page_pool_t* pool);
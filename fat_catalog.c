@@ -0,0 +1,662 @@
+#define _GNU_SOURCE
+
+#include "fat_catalog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    fat_catalog_node_t node;
+    char* name;
+} catalog_child_t;
+
+typedef struct {
+    fat_catalog_node_t* nodes;
+    size_t node_count;
+    size_t node_capacity;
+
+    fat_catalog_extent_t* extents;
+    size_t extent_count;
+    size_t extent_capacity;
+
+    char* names;
+    size_t names_size;
+    size_t names_capacity;
+
+    uint64_t* chunks;
+    uint32_t chunk_count;
+    uint64_t fat_hash;
+
+    // What can be taken over from the previous catalog.
+    const fat_catalog_t* previous;
+    uint8_t* changed;            // Per FAT chunk, NULL if nothing can be reused
+    uint32_t* previous_dirs;     // Node indexes of its directories, by cluster
+    size_t previous_dir_count;
+
+    uint8_t* visited;  // Directory clusters already listed, guards against loops
+    size_t reused;
+
+    // Children of the directory being listed.
+    catalog_child_t* children;
+    size_t child_count;
+    size_t child_capacity;
+} catalog_builder_t;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+#define HASH_SEED 0xCBF29CE484222325ULL
+
+// Hashes the on-disk FAT chunk by chunk.
+static void hash_fat(fat_t* fat, catalog_builder_t* builder) {
+    uint8_t* data = malloc(FAT_CATALOG_CHUNK);
+
+    builder->chunk_count = (fat->fat_size + FAT_CATALOG_CHUNK - 1) / FAT_CATALOG_CHUNK;
+    builder->chunks = calloc(builder->chunk_count ? builder->chunk_count : 1, sizeof(uint64_t));
+    builder->fat_hash = HASH_SEED;
+
+    for (uint32_t i = 0; i < builder->chunk_count; i++) {
+        size_t offset = (size_t)i * FAT_CATALOG_CHUNK;
+        size_t length = fat->fat_size - offset < FAT_CATALOG_CHUNK ? fat->fat_size - offset : FAT_CATALOG_CHUNK;
+
+        length = fat32_read_at(fat, fat->fat_offset + offset, data, length);
+
+        builder->chunks[i] = hash_bytes(HASH_SEED, data, length);
+        builder->fat_hash = hash_bytes(builder->fat_hash, &builder->chunks[i], sizeof(uint64_t));
+    }
+
+    free(data);
+}
+
+static uint32_t add_name(catalog_builder_t* builder, const char* name) {
+    size_t length = strlen(name) + 1;
+
+    while (builder->names_size + length > builder->names_capacity) {
+        builder->names_capacity = builder->names_capacity ? builder->names_capacity * 2 : 4096;
+        builder->names = realloc(builder->names, builder->names_capacity);
+    }
+
+    memcpy(builder->names + builder->names_size, name, length);
+    builder->names_size += length;
+
+    return builder->names_size - length;
+}
+
+static uint32_t add_node(catalog_builder_t* builder, const fat_catalog_node_t* node) {
+    if (builder->node_count == builder->node_capacity) {
+        builder->node_capacity = builder->node_capacity ? builder->node_capacity * 2 : 256;
+        builder->nodes = realloc(builder->nodes, builder->node_capacity * sizeof(fat_catalog_node_t));
+    }
+
+    builder->nodes[builder->node_count] = *node;
+
+    return builder->node_count++;
+}
+
+static void push_extent(catalog_builder_t* builder, fat_catalog_node_t* node, uint32_t cluster, uint32_t length) {
+    fat_catalog_extent_t* last = node->extent_count ? &builder->extents[builder->extent_count - 1] : NULL;
+
+    if (last && last->cluster + last->length == cluster) {
+        last->length += length;
+        return;
+    }
+
+    if (builder->extent_count == builder->extent_capacity) {
+        builder->extent_capacity = builder->extent_capacity ? builder->extent_capacity * 2 : 256;
+        builder->extents = realloc(builder->extents, builder->extent_capacity * sizeof(fat_catalog_extent_t));
+    }
+
+    if (node->extent_count == 0) {
+        node->first_extent = builder->extent_count;
+    }
+
+    builder->extents[builder->extent_count++] = (fat_catalog_extent_t){cluster, length};
+    node->extent_count++;
+}
+
+static void walk_extents(fat_t* fat, catalog_builder_t* builder, fat_catalog_node_t* node) {
+    uint32_t cluster = node->cluster;
+
+    node->first_extent = builder->extent_count;
+    node->extent_count = 0;
+
+    for (uint32_t steps = 0; cluster >= 2 && cluster < fat->cluster_count && steps < fat->cluster_count; steps++) {
+        push_extent(builder, node, cluster, 1);
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
+}
+
+// A chain can be taken over if none of the FAT chunks holding its entries changed.
+static bool chain_unchanged(const catalog_builder_t* builder, const fat_catalog_node_t* old) {
+    if (builder->changed == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < old->extent_count; i++) {
+        const fat_catalog_extent_t* extent = &builder->previous->extents[old->first_extent + i];
+        uint64_t first = (uint64_t)extent->cluster * sizeof(uint32_t) / FAT_CATALOG_CHUNK;
+        uint64_t last = ((uint64_t)extent->cluster + extent->length) * sizeof(uint32_t) / FAT_CATALOG_CHUNK;
+
+        for (uint64_t chunk = first; chunk <= last && chunk < builder->chunk_count; chunk++) {
+            if (builder->changed[chunk]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void set_extents(fat_t* fat, catalog_builder_t* builder, fat_catalog_node_t* node, const fat_catalog_node_t* old) {
+    if (old && old->cluster == node->cluster && chain_unchanged(builder, old)) {
+        node->first_extent = builder->extent_count;
+        node->extent_count = 0;
+
+        for (uint32_t i = 0; i < old->extent_count; i++) {
+            const fat_catalog_extent_t* extent = &builder->previous->extents[old->first_extent + i];
+            push_extent(builder, node, extent->cluster, extent->length);
+        }
+    } else {
+        walk_extents(fat, builder, node);
+    }
+}
+
+static uint64_t hash_directory(fat_t* fat, const catalog_builder_t* builder, const fat_catalog_node_t* dir) {
+    uint8_t* data = malloc(fat->cluster_size);
+    uint64_t hash = HASH_SEED;
+
+    for (uint32_t i = 0; i < dir->extent_count; i++) {
+        const fat_catalog_extent_t* extent = &builder->extents[dir->first_extent + i];
+
+        for (uint32_t c = 0; c < extent->length; c++) {
+            fat32_read_at(fat, fat32_cluster_offset(fat, extent->cluster + c), data, fat->cluster_size);
+            hash = hash_bytes(hash, data, fat->cluster_size);
+        }
+    }
+
+    free(data);
+
+    return hash ? hash : 1;
+}
+
+static int compare_previous_dirs(const void* a, const void* b, void* ctx) {
+    const fat_catalog_t* previous = ctx;
+    uint32_t left = previous->nodes[*(const uint32_t*)a].cluster;
+    uint32_t right = previous->nodes[*(const uint32_t*)b].cluster;
+
+    return (left > right) - (left < right);
+}
+
+static const fat_catalog_node_t* find_previous_dir(const catalog_builder_t* builder, uint32_t cluster) {
+    size_t low = 0;
+    size_t high = builder->previous_dir_count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        const fat_catalog_node_t* node = &builder->previous->nodes[builder->previous_dirs[middle]];
+
+        if (node->cluster == cluster) {
+            return node;
+        }
+
+        if (node->cluster < cluster) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+static bool collect_child(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+
+    catalog_builder_t* builder = ctx;
+    const DirectoryEntry_t* entry = &dirent->entry;
+
+    if (strcmp(dirent->name, ".") == 0 || strcmp(dirent->name, "..") == 0) {
+        return true;
+    }
+
+    if (builder->child_count == builder->child_capacity) {
+        builder->child_capacity = builder->child_capacity ? builder->child_capacity * 2 : 64;
+        builder->children = realloc(builder->children, builder->child_capacity * sizeof(catalog_child_t));
+    }
+
+    catalog_child_t* child = &builder->children[builder->child_count++];
+
+    memset(&child->node, 0, sizeof(fat_catalog_node_t));
+    child->name = strdup(dirent->name);
+    child->node.cluster = FAT_DIRENT_CLUSTER(entry);
+    child->node.size = entry->file_size;
+    child->node.attributes = entry->attributes;
+    child->node.creation_time = entry->creation_time;
+    child->node.creation_date = entry->creation_date;
+    child->node.modification_time = entry->modification_time;
+    child->node.modification_date = entry->modification_date;
+
+    return true;
+}
+
+static int compare_children(const void* a, const void* b) {
+    return strcmp(((const catalog_child_t*)a)->name, ((const catalog_child_t*)b)->name);
+}
+
+// Appends the children of node `index`. A directory whose raw contents hash the same
+// as in the previous catalog is copied from there instead of being parsed again.
+static void fill_directory(fat_t* fat, catalog_builder_t* builder, uint32_t index) {
+    uint32_t cluster = builder->nodes[index].cluster;
+    uint32_t first_child = builder->node_count;
+
+    builder->nodes[index].first_child = first_child;
+    builder->nodes[index].child_count = 0;
+
+    if (cluster < 2 || cluster >= fat->cluster_count || (builder->visited[cluster >> 3] & (1 << (cluster & 7)))) {
+        return;
+    }
+
+    builder->visited[cluster >> 3] |= 1 << (cluster & 7);
+
+    uint64_t hash = hash_directory(fat, builder, &builder->nodes[index]);
+    const fat_catalog_node_t* old = builder->changed ? find_previous_dir(builder, cluster) : NULL;
+
+    builder->nodes[index].dir_hash = hash;
+
+    if (old && old->dir_hash == hash) {
+        for (uint32_t i = 0; i < old->child_count; i++) {
+            const fat_catalog_node_t* old_child = &builder->previous->nodes[old->first_child + i];
+            fat_catalog_node_t node = *old_child;
+
+            node.parent = index;
+            node.first_child = 0;
+            node.child_count = 0;
+            node.dir_hash = 0;
+            node.name = add_name(builder, fat_catalog_name(builder->previous, old_child));
+
+            set_extents(fat, builder, &node, old_child);
+            add_node(builder, &node);
+        }
+
+        builder->reused++;
+    } else {
+        builder->child_count = 0;
+        fat32_iterate_directory(fat, cluster, 0, collect_child, builder);
+
+        qsort(builder->children, builder->child_count, sizeof(catalog_child_t), compare_children);
+
+        for (size_t i = 0; i < builder->child_count; i++) {
+            fat_catalog_node_t* node = &builder->children[i].node;
+            const fat_catalog_node_t* previous = NULL;
+
+            // A directory that moved keeps its chain under the same start cluster.
+            if (builder->changed && (node->attributes & ATTR_DIRECTORY)) {
+                previous = find_previous_dir(builder, node->cluster);
+            }
+
+            node->parent = index;
+            node->name = add_name(builder, builder->children[i].name);
+
+            set_extents(fat, builder, node, previous);
+            add_node(builder, node);
+
+            free(builder->children[i].name);
+        }
+    }
+
+    builder->nodes[index].child_count = builder->node_count - first_child;
+}
+
+static void build(fat_t* fat, catalog_builder_t* builder) {
+    fat_catalog_node_t root = {0};
+
+    root.cluster = fat->fat->root_directory_offset_in_clusters;
+    root.attributes = ATTR_DIRECTORY;
+    root.name = add_name(builder, "");
+
+    builder->visited = calloc((fat->cluster_count + 7) / 8, 1);
+
+    const fat_catalog_node_t* previous_root = builder->changed ? &builder->previous->nodes[0] : NULL;
+    set_extents(fat, builder, &root, previous_root);
+    add_node(builder, &root);
+
+    // Breadth first, so the children of every node end up next to each other.
+    for (uint32_t i = 0; i < builder->node_count; i++) {
+        if (builder->nodes[i].attributes & ATTR_DIRECTORY) {
+            fill_directory(fat, builder, i);
+        }
+    }
+
+    free(builder->visited);
+    free(builder->children);
+}
+
+static size_t align8(size_t value) {
+    return (value + 7) & ~(size_t)7;
+}
+
+// Written next to the target and renamed over it, so readers never see half a catalog.
+static bool write_catalog(fat_t* fat, const catalog_builder_t* builder, const char* path) {
+    fat_catalog_header_t header = {0};
+
+    memcpy(header.magic, FAT_CATALOG_MAGIC, sizeof(header.magic));
+    header.version = FAT_CATALOG_VERSION;
+    header.volume_serial = fat->fat->volume_serial_number;
+    header.generation = fat->generation;
+    header.cluster_size = fat->cluster_size;
+    header.node_count = builder->node_count;
+    header.extent_count = builder->extent_count;
+    header.chunk_count = builder->chunk_count;
+    header.names_size = builder->names_size;
+    header.fat_hash = builder->fat_hash;
+
+    header.nodes_offset = align8(sizeof(header));
+    header.extents_offset = align8(header.nodes_offset + builder->node_count * sizeof(fat_catalog_node_t));
+    header.chunks_offset = align8(header.extents_offset + builder->extent_count * sizeof(fat_catalog_extent_t));
+    header.names_offset = align8(header.chunks_offset + builder->chunk_count * sizeof(uint64_t));
+
+    size_t temp_length = strlen(path) + 5;
+    char* temp = malloc(temp_length);
+    snprintf(temp, temp_length, "%s.tmp", path);
+
+    FILE* file = fopen(temp, "wb");
+    bool ok = file != NULL;
+
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1
+             && fseek(file, header.nodes_offset, SEEK_SET) == 0
+             && fwrite(builder->nodes, sizeof(fat_catalog_node_t), builder->node_count, file) == builder->node_count
+             && fseek(file, header.extents_offset, SEEK_SET) == 0
+             && fwrite(builder->extents, sizeof(fat_catalog_extent_t), builder->extent_count, file) == builder->extent_count
+             && fseek(file, header.chunks_offset, SEEK_SET) == 0
+             && fwrite(builder->chunks, sizeof(uint64_t), builder->chunk_count, file) == builder->chunk_count
+             && fseek(file, header.names_offset, SEEK_SET) == 0
+             && fwrite(builder->names, 1, builder->names_size, file) == builder->names_size;
+
+        ok = fclose(file) == 0 && ok;
+    }
+
+    ok = ok && rename(temp, path) == 0;
+
+    if (!ok) {
+        unlink(temp);
+    }
+
+    free(temp);
+
+    return ok;
+}
+
+static void unmap_catalog(fat_catalog_t* catalog) {
+    if (catalog) {
+        munmap(catalog->map, catalog->map_size);
+        free(catalog);
+    }
+}
+
+// Every node's children, extents and parent must lie inside the tables, and every extent
+// inside the volume; lookups and fat32_file_open index them without further checks.
+static bool links_valid(fat_t* fat, const fat_catalog_header_t* header, const fat_catalog_node_t* nodes,
+                        const fat_catalog_extent_t* extents) {
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        const fat_catalog_node_t* node = &nodes[i];
+
+        if (node->parent >= header->node_count
+            || (uint64_t)node->first_child + node->child_count > header->node_count
+            || (uint64_t)node->first_extent + node->extent_count > header->extent_count) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->extent_count; i++) {
+        if (extents[i].cluster < 2 || extents[i].length == 0
+            || (uint64_t)extents[i].cluster + extents[i].length > fat->cluster_count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Maps a catalog file and checks that its tables lie inside it; NULL if it does not.
+static fat_catalog_t* map_catalog(fat_t* fat, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(fat_catalog_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const fat_catalog_header_t* header = map;
+    size_t size = st.st_size;
+
+    bool valid = memcmp(header->magic, FAT_CATALOG_MAGIC, sizeof(header->magic)) == 0
+                 && header->version == FAT_CATALOG_VERSION
+                 && header->node_count > 0
+                 && header->nodes_offset + (uint64_t)header->node_count * sizeof(fat_catalog_node_t) <= size
+                 && header->extents_offset + (uint64_t)header->extent_count * sizeof(fat_catalog_extent_t) <= size
+                 && header->chunks_offset + (uint64_t)header->chunk_count * sizeof(uint64_t) <= size
+                 && header->names_offset + header->names_size <= size
+                 && header->names_size > 0
+                 && ((const char*)map)[header->names_offset + header->names_size - 1] == '\0'
+                 && header->nodes_offset % 8 == 0 && header->extents_offset % 4 == 0
+                 && links_valid(fat, header, (const fat_catalog_node_t*)((const char*)map + header->nodes_offset),
+                                (const fat_catalog_extent_t*)((const char*)map + header->extents_offset));
+
+    if (!valid) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    fat_catalog_t* catalog = calloc(1, sizeof(fat_catalog_t));
+
+    catalog->map = map;
+    catalog->map_size = size;
+    catalog->header = header;
+    catalog->nodes = (const fat_catalog_node_t*)((const char*)map + header->nodes_offset);
+    catalog->extents = (const fat_catalog_extent_t*)((const char*)map + header->extents_offset);
+    catalog->chunks = (const uint64_t*)((const char*)map + header->chunks_offset);
+    catalog->names = (const char*)map + header->names_offset;
+
+    return catalog;
+}
+
+// Marks the chunks that differ from the previous catalog, and indexes its directories
+// by cluster. Without a comparable previous catalog nothing is reused.
+static void prepare_reuse(catalog_builder_t* builder, const fat_catalog_t* previous) {
+    if (previous == NULL || previous->header->chunk_count != builder->chunk_count) {
+        return;
+    }
+
+    builder->previous = previous;
+    builder->changed = calloc(builder->chunk_count ? builder->chunk_count : 1, 1);
+
+    for (uint32_t i = 0; i < builder->chunk_count; i++) {
+        builder->changed[i] = previous->chunks[i] != builder->chunks[i];
+    }
+
+    builder->previous_dirs = malloc(previous->header->node_count * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < previous->header->node_count; i++) {
+        if (previous->nodes[i].attributes & ATTR_DIRECTORY) {
+            builder->previous_dirs[builder->previous_dir_count++] = i;
+        }
+    }
+
+    qsort_r(builder->previous_dirs, builder->previous_dir_count, sizeof(uint32_t), compare_previous_dirs, (void*)previous);
+}
+
+static void free_builder(catalog_builder_t* builder) {
+    free(builder->nodes);
+    free(builder->extents);
+    free(builder->names);
+    free(builder->chunks);
+    free(builder->changed);
+    free(builder->previous_dirs);
+}
+
+fat_catalog_t* fat_catalog_attach(fat_t* fat, const char* path) {
+    fat_catalog_detach(fat);
+
+    // Settle the generation and the on-disk FAT before comparing against them.
+    if (!fat->read_only) {
+        fat32_flush(fat);
+    }
+
+    catalog_builder_t builder = {0};
+    hash_fat(fat, &builder);
+
+    fat_catalog_t* catalog = map_catalog(fat, path);
+
+    if (catalog && (catalog->header->volume_serial != fat->fat->volume_serial_number
+                    || catalog->header->cluster_size != fat->cluster_size)) {
+        unmap_catalog(catalog);
+        catalog = NULL;
+    }
+
+    bool fresh = catalog && catalog->header->generation == fat->generation
+                 && catalog->header->fat_hash == builder.fat_hash;
+
+    if (!fresh) {
+        prepare_reuse(&builder, catalog);
+        build(fat, &builder);
+
+        size_t reused = builder.reused;
+        bool written = write_catalog(fat, &builder, path);
+
+        unmap_catalog(catalog);
+        catalog = written ? map_catalog(fat, path) : NULL;
+
+        if (catalog) {
+            catalog->reused = reused;
+        }
+    }
+
+    free_builder(&builder);
+
+    fat->catalog = catalog;
+
+    return catalog;
+}
+
+void fat_catalog_detach(fat_t* fat) {
+    unmap_catalog(fat->catalog);
+    fat->catalog = NULL;
+}
+
+// Any write since the catalog was attached makes it stale until it is attached again.
+bool fat_catalog_usable(const fat_t* fat) {
+    return fat->catalog && !fat->modified && fat->generation == fat->catalog->header->generation;
+}
+
+const char* fat_catalog_name(const fat_catalog_t* catalog, const fat_catalog_node_t* node) {
+    return node->name < catalog->header->names_size ? catalog->names + node->name : "";
+}
+
+static const fat_catalog_node_t* find_child(const fat_catalog_t* catalog, const fat_catalog_node_t* dir,
+                                            const char* name, size_t length) {
+    size_t low = 0;
+    size_t high = dir->child_count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        const fat_catalog_node_t* child = &catalog->nodes[dir->first_child + middle];
+        const char* child_name = fat_catalog_name(catalog, child);
+        int result = strncmp(child_name, name, length);
+
+        if (result == 0) {
+            result = child_name[length] != '\0';
+        }
+
+        if (result == 0) {
+            return child;
+        }
+
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+const fat_catalog_node_t* fat_catalog_lookup(const fat_catalog_t* catalog, const char* path) {
+    const fat_catalog_node_t* node = &catalog->nodes[0];
+
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+
+        if (*path == '\0') {
+            break;
+        }
+
+        const char* end = path;
+        while (*end != '/' && *end != '\0') {
+            end++;
+        }
+
+        if (!(node->attributes & ATTR_DIRECTORY)) {
+            return NULL;
+        }
+
+        node = find_child(catalog, node, path, end - path);
+
+        if (node == NULL) {
+            return NULL;
+        }
+
+        path = end;
+    }
+
+    return node;
+}
+
+direntry_t* fat_catalog_list(const fat_catalog_t* catalog, const fat_catalog_node_t* dir) {
+    direntry_t* head = NULL;
+    direntry_t** link = &head;
+
+    for (uint32_t i = 0; i < dir->child_count; i++) {
+        const fat_catalog_node_t* child = &catalog->nodes[dir->first_child + i];
+        direntry_t* entry = calloc(1, sizeof(direntry_t));
+
+        entry->name = strdup(fat_catalog_name(catalog, child));
+        entry->type = (child->attributes & ATTR_DIRECTORY) ? ENT_DIRECTORY : ENT_FILE;
+        entry->size = child->size;
+        entry->priv_data = (void*)(size_t)child->cluster;
+        fat32_decode_datetime(child->creation_date, child->creation_time, 0, &entry->created);
+        fat32_decode_datetime(child->modification_date, child->modification_time, 0, &entry->modified);
+
+        *link = entry;
+        link = &entry->next;
+    }
+
+    return head;
+}
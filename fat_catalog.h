@@ -0,0 +1,86 @@
+#pragma once
+
+#include "fat32.h"
+
+// Sidecar file with the whole directory tree of an image, so lookups and listings can be
+// served from one mmap instead of parsing directories. Layout: header, nodes, extents,
+// FAT chunk hashes, names. Nodes are in breadth-first order, the children of a node are
+// contiguous and sorted by name; node 0 is the root directory.
+
+#define FAT_CATALOG_MAGIC "FATCATLG"
+#define FAT_CATALOG_VERSION 1
+
+// FAT bytes per hashed chunk. A rebuild only walks chains again for files whose
+// clusters lie in chunks that changed.
+#define FAT_CATALOG_CHUNK (64 * 1024)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t volume_serial;
+    uint32_t generation;  // FSInfo generation the catalog was built at
+    uint32_t cluster_size;
+    uint32_t node_count;
+    uint32_t extent_count;
+    uint32_t chunk_count;
+    uint32_t names_size;
+    uint64_t fat_hash;  // Over all chunk hashes
+
+    uint64_t nodes_offset;
+    uint64_t extents_offset;
+    uint64_t chunks_offset;
+    uint64_t names_offset;
+} fat_catalog_header_t;
+
+typedef struct {
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t name;  // Offset of the NUL-terminated UTF-8 name
+    uint32_t cluster;
+    uint32_t size;
+    uint32_t first_extent;
+    uint32_t extent_count;
+    uint64_t dir_hash;  // Raw contents of a directory, 0 for files
+
+    uint16_t creation_time;
+    uint16_t creation_date;
+    uint16_t modification_time;
+    uint16_t modification_date;
+    uint8_t attributes;
+    uint8_t reserved[7];
+} fat_catalog_node_t;
+
+typedef struct fat_catalog_extent {
+    uint32_t cluster;
+    uint32_t length;  // Contiguous clusters
+} fat_catalog_extent_t;
+
+typedef struct fat_catalog {
+    void* map;
+    size_t map_size;
+
+    const fat_catalog_header_t* header;
+    const fat_catalog_node_t* nodes;
+    const fat_catalog_extent_t* extents;
+    const uint64_t* chunks;
+    const char* names;
+
+    size_t reused;  // Directories taken over from the previous catalog by the last rebuild
+} fat_catalog_t;
+
+// Maps the catalog at `path` and checks it against the image, rebuilding and rewriting it
+// if it is missing or stale. The catalog is then used by fat32_search, fat32_file_open
+// (chains from the extents) and the vfs driver until the image is changed.
+fat_catalog_t* fat_catalog_attach(fat_t* fat, const char* path);
+void fat_catalog_detach(fat_t* fat);
+
+// True while the attached catalog matches the image.
+bool fat_catalog_usable(const fat_t* fat);
+
+const fat_catalog_node_t* fat_catalog_lookup(const fat_catalog_t* catalog, const char* path);
+const char* fat_catalog_name(const fat_catalog_t* catalog, const fat_catalog_node_t* node);
+
+// The children of `dir` sorted by name, without touching the image. The catalog is built
+// with fat32_iterate_directory, as fat32_vfs_diropen lists, so only the order differs.
+direntry_t* fat_catalog_list(const fat_catalog_t* catalog, const fat_catalog_node_t* dir);
@@ -0,0 +1,428 @@
+#include "fat_check.h"
+#include "fat_dirindex.h"
+#include "fat_sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct check_task {
+    uint32_t cluster;
+    size_t cluster_count;  // Validated length of the directory chain
+    char* path;
+
+    struct check_task* next;
+} check_task_t;
+
+typedef struct {
+    fat_t* fat;
+    const fat_check_options_t* options;
+    fat_check_report_t* report;
+
+    uint64_t* claimed;  // One bit per cluster
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    check_task_t* queue;
+    size_t active;
+} checker_t;
+
+typedef struct {
+    checker_t* checker;
+    const char* path;
+} check_dir_ctx_t;
+
+#define CHECK_COUNT(ck, field) __atomic_fetch_add(&(ck)->report->field, 1, __ATOMIC_RELAXED)
+
+static inline bool is_chain_cluster(fat_t* fat, uint32_t cluster) {
+    return cluster >= 2 && cluster < fat->cluster_count;
+}
+
+// Returns true if the cluster was not claimed before.
+static inline bool claim(checker_t* ck, uint32_t cluster) {
+    uint64_t bit = 1ULL << (cluster & 63);
+    uint64_t old = __atomic_fetch_or(&ck->claimed[cluster >> 6], bit, __ATOMIC_RELAXED);
+
+    return !(old & bit);
+}
+
+// Brent's algorithm. Returns number of distinct clusters in a cyclic chain, 0 if there is no cycle.
+static size_t find_cycle(fat_t* fat, uint32_t start) {
+    size_t power = 1, lambda = 1;
+    uint32_t tortoise = start;
+    uint32_t hare = fat32_get_fat_entry(fat, start);
+
+    while (is_chain_cluster(fat, hare) && tortoise != hare) {
+        if (power == lambda) {
+            tortoise = hare;
+            power *= 2;
+            lambda = 0;
+        }
+
+        hare = fat32_get_fat_entry(fat, hare);
+        lambda++;
+    }
+
+    if (!is_chain_cluster(fat, hare)) {
+        return 0;
+    }
+
+    size_t mu = 0;
+    tortoise = hare = start;
+
+    for (size_t i = 0; i < lambda; i++) {
+        hare = fat32_get_fat_entry(fat, hare);
+    }
+
+    while (tortoise != hare) {
+        tortoise = fat32_get_fat_entry(fat, tortoise);
+        hare = fat32_get_fat_entry(fat, hare);
+        mu++;
+    }
+
+    return mu + lambda;
+}
+
+static void problem(checker_t* ck, const char* path, const char* what) {
+    if (ck->options->verbose) {
+        printf("%s: %s%s\n", path, what, ck->options->repair ? " (fixed)" : "");
+    }
+}
+
+static void terminate_chain(checker_t* ck, uint32_t last) {
+    if (ck->options->repair && last != 0) {
+        fat32_set_fat_entry(ck->fat, last, 0x0FFFFFF8);
+        CHECK_COUNT(ck, repaired);
+    }
+}
+
+// Walks and claims a chain. Returns the number of clusters that can be trusted.
+static size_t check_chain(checker_t* ck, uint32_t start, const char* path) {
+    fat_t* fat = ck->fat;
+
+    if (!is_chain_cluster(fat, start)) {
+        CHECK_COUNT(ck, bad_links);
+        problem(ck, path, "start cluster out of range");
+        return 0;
+    }
+
+    size_t limit = find_cycle(fat, start);
+    size_t length = 0;
+    uint32_t prev = 0;
+    uint32_t cluster = start;
+
+    while (true) {
+        if (limit && length == limit) {
+            CHECK_COUNT(ck, cycles);
+            problem(ck, path, "cluster chain loops");
+            terminate_chain(ck, prev);
+            break;
+        }
+
+        if (!is_chain_cluster(fat, cluster)) {
+            if (cluster < 0x0FFFFFF8) {
+                CHECK_COUNT(ck, bad_links);
+                problem(ck, path, "cluster chain points to an invalid cluster");
+                terminate_chain(ck, prev);
+            }
+
+            break;
+        }
+
+        if (!claim(ck, cluster)) {
+            CHECK_COUNT(ck, cross_links);
+            problem(ck, path, "cross-linked with another chain");
+            terminate_chain(ck, prev);
+            break;
+        }
+
+        length++;
+        prev = cluster;
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
+
+    return length;
+}
+
+static void fix_file_size(checker_t* ck, const fat32_dirent_t* dirent, size_t chain_length) {
+    fat_t* fat = ck->fat;
+    size_t expected = (dirent->entry.file_size + fat->cluster_size - 1) / fat->cluster_size;
+
+    if (expected == 0) {
+        expected = 1;  // Empty files keep the cluster they were created with
+    }
+
+    if (chain_length > expected) {
+        // Keep `expected` clusters, release the tail.
+        uint32_t last = FAT_DIRENT_CLUSTER(&dirent->entry);
+
+        for (size_t i = 1; i < expected; i++) {
+            last = fat32_get_fat_entry(fat, last);
+        }
+
+        uint32_t cluster = fat32_get_fat_entry(fat, last);
+        fat32_set_fat_entry(fat, last, 0x0FFFFFF8);
+
+        for (size_t i = expected; i < chain_length; i++) {
+            uint32_t next = fat32_get_fat_entry(fat, cluster);
+            fat32_set_fat_entry(fat, cluster, 0);
+            cluster = next;
+        }
+    } else {
+        DirectoryEntry_t entry = dirent->entry;
+        size_t offset = fat32_cluster_offset(fat, dirent->cluster) + dirent->offset;
+
+        entry.file_size = chain_length * fat->cluster_size;
+        fat32_write_at(fat, offset, &entry, sizeof(DirectoryEntry_t));
+    }
+
+    CHECK_COUNT(ck, repaired);
+}
+
+static void push_task(checker_t* ck, uint32_t cluster, size_t cluster_count, char* path) {
+    check_task_t* task = calloc(1, sizeof(check_task_t));
+    task->cluster = cluster;
+    task->cluster_count = cluster_count;
+    task->path = path;
+
+    pthread_mutex_lock(&ck->lock);
+    task->next = ck->queue;
+    ck->queue = task;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+static bool check_dirent(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    check_dir_ctx_t* dir = ctx;
+    checker_t* ck = dir->checker;
+    const DirectoryEntry_t* entry = &dirent->entry;
+
+    if (entry->name[0] == '.' && (entry->name[1] == ' ' || entry->name[1] == '.')) {
+        return true;
+    }
+
+    size_t path_length = strlen(dir->path) + strlen(dirent->name) + 2;
+    char* path = calloc(1, path_length);
+    snprintf(path, path_length, "%s/%s", dir->path, dirent->name);
+
+    uint32_t cluster = FAT_DIRENT_CLUSTER(entry);
+
+    if (entry->attributes & ATTR_DIRECTORY) {
+        CHECK_COUNT(ck, directories);
+
+        size_t length = cluster ? check_chain(ck, cluster, path) : 0;
+        if (length) {
+            push_task(ck, cluster, length, path);  // Task owns the path now
+            return true;
+        }
+
+        free(path);
+        return true;
+    }
+
+    CHECK_COUNT(ck, files);
+
+    if (cluster == 0) {
+        if (entry->file_size != 0) {
+            CHECK_COUNT(ck, size_mismatches);
+            problem(ck, path, "file has a size but no clusters");
+        }
+
+        free(path);
+        return true;
+    }
+
+    size_t length = check_chain(ck, cluster, path);
+    size_t expected = (entry->file_size + fat->cluster_size - 1) / fat->cluster_size;
+
+    if (length && length != expected && !(expected == 0 && length == 1)) {
+        CHECK_COUNT(ck, size_mismatches);
+        problem(ck, path, "file size does not match cluster chain length");
+
+        if (ck->options->repair) {
+            fix_file_size(ck, dirent, length);
+        }
+    }
+
+    free(path);
+    return true;
+}
+
+static void* check_worker(void* arg) {
+    checker_t* ck = arg;
+
+    fat_sched_set_class(FAT_SCHED_BACKGROUND);
+
+    pthread_mutex_lock(&ck->lock);
+
+    while (true) {
+        while (ck->queue == NULL && ck->active > 0) {
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        }
+
+        if (ck->queue == NULL) {
+            break;  // Nothing queued and nobody can queue more
+        }
+
+        check_task_t* task = ck->queue;
+        ck->queue = task->next;
+        ck->active++;
+
+        pthread_mutex_unlock(&ck->lock);
+
+        check_dir_ctx_t ctx = {ck, task->path};
+        fat32_iterate_directory(ck->fat, task->cluster, task->cluster_count, check_dirent, &ctx);
+
+        free(task->path);
+        free(task);
+
+        pthread_mutex_lock(&ck->lock);
+        ck->active--;
+
+        if (ck->queue == NULL && ck->active == 0) {
+            pthread_cond_broadcast(&ck->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&ck->lock);
+
+    return NULL;
+}
+
+static void check_lost_clusters(checker_t* ck) {
+    fat_t* fat = ck->fat;
+
+    for (uint32_t cluster = 2; cluster < fat->cluster_count; cluster++) {
+        bool claimed = ck->claimed[cluster >> 6] & (1ULL << (cluster & 63));
+
+        if (claimed) {
+            ck->report->used_clusters++;
+            continue;
+        }
+
+        uint32_t value = fat32_get_fat_entry(fat, cluster);
+
+        if (value != 0 && value != 0x0FFFFFF7) {
+            ck->report->lost_clusters++;
+
+            if (ck->options->repair) {
+                fat32_set_fat_entry(fat, cluster, 0);
+                ck->report->repaired++;
+            }
+        }
+    }
+
+    if (ck->options->verbose && ck->report->lost_clusters) {
+        printf("%zu lost clusters%s\n", ck->report->lost_clusters, ck->options->repair ? " (freed)" : "");
+    }
+}
+
+static void check_fat_copies(checker_t* ck) {
+    fat_t* fat = ck->fat;
+    size_t chunk_size = fat->fat_cache.page_size ? fat->fat_cache.page_size : 4096;
+    uint32_t* primary = calloc(1, chunk_size);
+    uint32_t* copy = calloc(1, chunk_size);
+
+    for (uint8_t n = 1; n < fat->fat->copies; n++) {
+        for (size_t offset = 0; offset < fat->fat_size; offset += chunk_size) {
+            size_t length = fat->fat_size - offset < chunk_size ? fat->fat_size - offset : chunk_size;
+            size_t copy_offset = fat->fat_offset + (size_t)n * fat->fat_size + offset;
+            size_t mismatches = 0;
+
+            fat32_read_at(fat, fat->fat_offset + offset, primary, length);
+            fat32_read_at(fat, copy_offset, copy, length);
+
+            for (size_t i = 0; i < length / sizeof(uint32_t); i++) {
+                if (primary[i] != copy[i]) {
+                    mismatches++;
+                }
+            }
+
+            if (mismatches) {
+                ck->report->fat_mismatches += mismatches;
+
+                if (ck->options->repair) {
+                    fat32_write_at(fat, copy_offset, primary, length);
+                    ck->report->repaired++;
+                }
+            }
+        }
+    }
+
+    if (ck->options->verbose && ck->report->fat_mismatches) {
+        printf("%zu FAT entries differ between copies%s\n", ck->report->fat_mismatches,
+               ck->options->repair ? " (copied from the first FAT)" : "");
+    }
+
+    free(primary);
+    free(copy);
+}
+
+bool fat32_check(fat_t* fat, const fat_check_options_t* options, fat_check_report_t* report) {
+    fat_check_options_t defaults = {0};
+    checker_t ck = {0};
+
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    memset(report, 0, sizeof(fat_check_report_t));
+
+    fat_sched_class_t saved = fat_sched_set_class(FAT_SCHED_BACKGROUND);
+
+    ck.fat = fat;
+    ck.options = options;
+    ck.report = report;
+    ck.claimed = calloc((fat->cluster_count + 63) / 64, sizeof(uint64_t));
+
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.cond, NULL);
+
+    uint32_t root = fat->fat->root_directory_offset_in_clusters;
+    size_t root_length = check_chain(&ck, root, "/");
+
+    if (root_length) {
+        ck.queue = calloc(1, sizeof(check_task_t));
+        ck.queue->cluster = root;
+        ck.queue->cluster_count = root_length;
+        ck.queue->path = calloc(1, 1);  // Children are printed as "/name"
+    }
+
+    int thread_count = options->threads;
+    if (thread_count <= 0) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, check_worker, &ck);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+
+    check_lost_clusters(&ck);
+
+    // Repairs may have trimmed directory chains under cached slot indexes.
+    if (report->repaired) {
+        fat_dir_index_clear(fat);
+    }
+
+    // Both copies are written from the cache, bring them up to date before comparing.
+    fat_cache_flush(fat);
+    check_fat_copies(&ck);
+
+    pthread_cond_destroy(&ck.cond);
+    pthread_mutex_destroy(&ck.lock);
+    free(ck.claimed);
+
+    fat_sched_set_class(saved);
+
+    return report->cycles == 0 && report->cross_links == 0 && report->bad_links == 0
+        && report->lost_clusters == 0 && report->size_mismatches == 0 && report->fat_mismatches == 0;
+}
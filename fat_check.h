@@ -0,0 +1,28 @@
+#pragma once
+
+#include "fat32.h"
+
+typedef struct {
+    int threads;   // 0 means one per online CPU
+    bool repair;
+    bool verbose;  // Print every problem found
+} fat_check_options_t;
+
+typedef struct {
+    size_t directories;
+    size_t files;
+    size_t used_clusters;
+
+    size_t cycles;           // Chains looping back into themselves
+    size_t cross_links;      // Clusters claimed by more than one chain
+    size_t bad_links;        // Chains running into free or out of range clusters
+    size_t lost_clusters;    // Allocated, but not reachable from any entry
+    size_t size_mismatches;  // File size does not match the chain length
+    size_t fat_mismatches;   // Entries that differ between FAT copies
+
+    size_t repaired;
+} fat_check_report_t;
+
+// Walks the whole directory tree and validates every cluster chain.
+// Returns true when no problems were found.
+bool fat32_check(fat_t* fat, const fat_check_options_t* options, fat_check_report_t* report);
@@ -0,0 +1,294 @@
+#include "fat_defrag.h"
+#include "fat_sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    DirectoryEntry_t entry;
+    uint32_t cluster;  // Where the entry itself lives
+    uint32_t offset;
+} defrag_entry_t;
+
+typedef struct {
+    defrag_entry_t* entries;
+    size_t count;
+    size_t capacity;
+} defrag_list_t;
+
+typedef bool (*defrag_visit_fn_t)(fat_t* fat, const defrag_entry_t* file, void* ctx);
+
+typedef struct {
+    fat_t* fat;
+    const fat_defrag_options_t* options;
+    fat_defrag_state_t* state;
+
+    size_t visited;
+    size_t moved;
+    char* buffer;
+    size_t buffer_size;
+    struct timespec started;
+    size_t started_bytes;
+} defrag_t;
+
+static bool collect_entry(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    defrag_list_t* list = ctx;
+    const DirectoryEntry_t* entry = &dirent->entry;
+
+    if (entry->name[0] == '.' && (entry->name[1] == ' ' || entry->name[1] == '.')) {
+        return true;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 32;
+        list->entries = realloc(list->entries, list->capacity * sizeof(defrag_entry_t));
+    }
+
+    list->entries[list->count++] = (defrag_entry_t){*entry, dirent->cluster, dirent->offset};
+
+    return true;
+}
+
+// Visits files in directory order, then descends into subdirectories.
+static bool defrag_walk(fat_t* fat, uint32_t dir_cluster, size_t depth, defrag_visit_fn_t visit, void* ctx) {
+    defrag_list_t list = {0};
+    bool keep_going = true;
+
+    if (depth > 64) {
+        return true;  // Directory loop, the checker reports those
+    }
+
+    fat32_iterate_directory(fat, dir_cluster, 0, collect_entry, &list);
+
+    for (size_t i = 0; i < list.count && keep_going; i++) {
+        if (!(list.entries[i].entry.attributes & ATTR_DIRECTORY)) {
+            keep_going = visit(fat, &list.entries[i], ctx);
+        }
+    }
+
+    for (size_t i = 0; i < list.count && keep_going; i++) {
+        uint32_t cluster = FAT_DIRENT_CLUSTER(&list.entries[i].entry);
+
+        if ((list.entries[i].entry.attributes & ATTR_DIRECTORY) && cluster >= 2) {
+            keep_going = defrag_walk(fat, cluster, depth + 1, visit, ctx);
+        }
+    }
+
+    free(list.entries);
+
+    return keep_going;
+}
+
+static size_t count_extents(fat_t* fat, uint32_t start, size_t* out_clusters) {
+    size_t extents = 0;
+    size_t clusters = 0;
+    uint32_t prev = 0;
+    uint32_t cluster = start;
+
+    while (cluster >= 2 && cluster < fat->cluster_count && clusters < fat->cluster_count) {
+        if (cluster != prev + 1) {
+            extents++;
+        }
+
+        clusters++;
+        prev = cluster;
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
+
+    *out_clusters = clusters;
+
+    return extents;
+}
+
+static bool stats_visit(fat_t* fat, const defrag_entry_t* file, void* ctx) {
+    fat_frag_stats_t* stats = ctx;
+    size_t clusters;
+    size_t extents = count_extents(fat, FAT_DIRENT_CLUSTER(&file->entry), &clusters);
+
+    stats->files++;
+    stats->extents += extents;
+    stats->clusters += clusters;
+
+    if (extents > 1) {
+        stats->fragmented_files++;
+    }
+
+    return true;
+}
+
+void fat32_fragmentation_stats(fat_t* fat, fat_frag_stats_t* stats) {
+    memset(stats, 0, sizeof(fat_frag_stats_t));
+
+    defrag_walk(fat, fat->fat->root_directory_offset_in_clusters, 0, stats_visit, stats);
+}
+
+static void throttle(defrag_t* df) {
+    size_t limit = df->options ? df->options->max_bytes_per_second : 0;
+
+    if (limit == 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - df->started.tv_sec) + (now.tv_nsec - df->started.tv_nsec) / 1e9;
+    double allowed = (double)(df->state->bytes_copied - df->started_bytes) / limit;
+
+    if (allowed > elapsed) {
+        double delay = allowed - elapsed;
+        struct timespec ts = {(time_t)delay, (long)((delay - (time_t)delay) * 1e9)};
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Copies one physical extent of the old chain into the new run.
+static void copy_extent(defrag_t* df, uint32_t from, uint32_t to, size_t clusters) {
+    fat_t* fat = df->fat;
+    size_t bytes = clusters * fat->cluster_size;
+    size_t src = fat32_cluster_offset(fat, from);
+    size_t dst = fat32_cluster_offset(fat, to);
+
+    for (size_t done = 0; done < bytes; ) {
+        size_t length = bytes - done < df->buffer_size ? bytes - done : df->buffer_size;
+
+        fat32_read_at(fat, src + done, df->buffer, length);
+        fat32_write_at(fat, dst + done, df->buffer, length);
+
+        done += length;
+        df->state->bytes_copied += length;
+
+        throttle(df);
+    }
+}
+
+// New data and chain are written first, the directory entry is switched with a single
+// 32 byte write, and only then the old chain is released. A crash leaves lost clusters
+// at worst, never two files sharing a chain.
+static bool relocate(defrag_t* df, const defrag_entry_t* file, size_t clusters) {
+    fat_t* fat = df->fat;
+    uint32_t start = FAT_DIRENT_CLUSTER(&file->entry);
+    uint32_t target = fat32_find_free_run(fat, 2, clusters);
+
+    if (target == 0) {
+        return false;
+    }
+
+    FAT_METRIC_ADD(fat, clusters_allocated, clusters);
+
+    // Copy extent by extent, so each physical run is one large read.
+    uint32_t extent_start = start;
+    size_t extent_length = 0;
+    size_t copied = 0;
+    uint32_t cluster = start;
+
+    while (copied + extent_length < clusters) {
+        uint32_t next = fat32_get_fat_entry(fat, cluster);
+        extent_length++;
+
+        if (next != cluster + 1 || copied + extent_length == clusters) {
+            copy_extent(df, extent_start, target + copied, extent_length);
+
+            copied += extent_length;
+            extent_start = next;
+            extent_length = 0;
+        }
+
+        cluster = next;
+    }
+
+    for (size_t i = 0; i < clusters; i++) {
+        fat32_set_fat_entry(fat, target + i, i + 1 == clusters ? 0x0FFFFFF8 : target + i + 1);
+    }
+
+    fat32_flush(fat);
+
+    DirectoryEntry_t entry = file->entry;
+    entry.high_cluster = (target >> 16) & 0xFFFF;
+    entry.low_cluster = target & 0xFFFF;
+
+    size_t entry_offset = fat32_cluster_offset(fat, file->cluster) + file->offset;
+    fat32_write_at(fat, entry_offset, &entry, sizeof(DirectoryEntry_t));
+
+    cluster = start;
+    for (size_t i = 0; i < clusters; i++) {
+        uint32_t next = fat32_get_fat_entry(fat, cluster);
+        fat32_set_fat_entry(fat, cluster, 0);
+        cluster = next;
+    }
+
+    fat32_flush(fat);
+
+    return true;
+}
+
+static bool defrag_visit(fat_t* fat, const defrag_entry_t* file, void* ctx) {
+    defrag_t* df = ctx;
+
+    // Files handled by an earlier pass.
+    if (df->visited++ < df->state->files_done) {
+        return true;
+    }
+
+    size_t clusters;
+    size_t extents = count_extents(fat, FAT_DIRENT_CLUSTER(&file->entry), &clusters);
+
+    if (extents > 1 && relocate(df, file, clusters)) {
+        df->moved++;
+        df->state->files_moved++;
+    }
+
+    df->state->files_done++;
+
+    size_t max_files = df->options ? df->options->max_files : 0;
+
+    return max_files == 0 || df->moved < max_files;
+}
+
+size_t fat32_defragment(fat_t* fat, const fat_defrag_options_t* options, fat_defrag_state_t* state,
+                        fat_frag_stats_t* before, fat_frag_stats_t* after) {
+    fat_defrag_state_t local_state = {0};
+    defrag_t df = {0};
+
+    if (state == NULL) {
+        state = &local_state;
+    }
+
+    if (state->finished) {
+        memset(state, 0, sizeof(fat_defrag_state_t));
+    }
+
+    if (before) {
+        fat32_fragmentation_stats(fat, before);
+    }
+
+    fat_sched_class_t saved = fat_sched_set_class(FAT_SCHED_BACKGROUND);
+
+    df.fat = fat;
+    df.options = options;
+    df.state = state;
+    df.buffer_size = options && options->copy_buffer_size ? options->copy_buffer_size : 1024 * 1024;
+    df.buffer_size -= df.buffer_size % fat->cluster_size;
+    if (df.buffer_size == 0) {
+        df.buffer_size = fat->cluster_size;
+    }
+
+    df.buffer = malloc(df.buffer_size);
+    df.started_bytes = state->bytes_copied;
+    clock_gettime(CLOCK_MONOTONIC, &df.started);
+
+    state->finished = defrag_walk(fat, fat->fat->root_directory_offset_in_clusters, 0, defrag_visit, &df);
+
+    free(df.buffer);
+
+    fat_sched_set_class(saved);
+
+    if (after) {
+        fat32_fragmentation_stats(fat, after);
+    }
+
+    return df.moved;
+}
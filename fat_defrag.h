@@ -0,0 +1,31 @@
+#pragma once
+
+#include "fat32.h"
+
+typedef struct {
+    size_t files;
+    size_t fragmented_files;  // Files with more than one extent
+    size_t extents;
+    size_t clusters;
+} fat_frag_stats_t;
+
+typedef struct {
+    size_t max_bytes_per_second;  // 0 means no throttling
+    size_t max_files;             // Stop after relocating this many files, 0 means no limit
+    size_t copy_buffer_size;      // 0 means 1 MB
+} fat_defrag_options_t;
+
+// Files are visited in the same order on every pass, so a pass stopped by `max_files`
+// continues where it left off when called again with the same state.
+typedef struct {
+    size_t files_done;
+    size_t files_moved;
+    size_t bytes_copied;
+    bool finished;
+} fat_defrag_state_t;
+
+void fat32_fragmentation_stats(fat_t* fat, fat_frag_stats_t* stats);
+
+// Returns number of files relocated in this call.
+size_t fat32_defragment(fat_t* fat, const fat_defrag_options_t* options, fat_defrag_state_t* state,
+                        fat_frag_stats_t* before, fat_frag_stats_t* after);
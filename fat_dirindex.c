@@ -0,0 +1,370 @@
+#include "fat_dirindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t slots_per_cluster(fat_t* fat) {
+    return fat->cluster_size / sizeof(DirectoryEntry_t);
+}
+
+static void push_run(fat_dir_index_t* index, uint32_t start, uint32_t length) {
+    size_t bucket = length < FAT_DIR_INDEX_BUCKETS ? length - 1 : FAT_DIR_INDEX_BUCKETS - 1;
+    fat_slot_run_t* run = malloc(sizeof(fat_slot_run_t));
+
+    run->start = start;
+    run->length = length;
+    run->next = index->runs[bucket];
+    index->runs[bucket] = run;
+}
+
+static void free_runs(fat_dir_index_t* index) {
+    for (size_t i = 0; i < FAT_DIR_INDEX_BUCKETS; i++) {
+        while (index->runs[i]) {
+            fat_slot_run_t* run = index->runs[i];
+            index->runs[i] = run->next;
+            free(run);
+        }
+    }
+}
+
+static void append_cluster(fat_dir_index_t* index, uint32_t cluster) {
+    if (index->cluster_count == index->cluster_capacity) {
+        index->cluster_capacity = index->cluster_capacity ? index->cluster_capacity * 2 : 8;
+        index->clusters = realloc(index->clusters, index->cluster_capacity * sizeof(uint32_t));
+    }
+
+    index->clusters[index->cluster_count++] = cluster;
+}
+
+static size_t hash_name(const char sfn[11]) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int i = 0; i < 11; i++) {
+        hash = (hash ^ (uint8_t)sfn[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static fat_name_slot_t* find_name(const fat_dir_index_t* index, const char sfn[11]) {
+    size_t mask = index->name_capacity - 1;
+
+    if (index->name_capacity == 0) {
+        return NULL;
+    }
+
+    for (size_t i = hash_name(sfn) & mask; index->names[i].state != 0; i = (i + 1) & mask) {
+        if (index->names[i].state == 1 && memcmp(index->names[i].name, sfn, 11) == 0) {
+            return &index->names[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void insert_name(fat_dir_index_t* index, const char sfn[11]) {
+    // Keep at least a quarter of the table empty so probes stay short. Rehashing
+    // also drops removed slots, so the size follows the live names.
+    if ((index->name_used + 1) * 4 > index->name_capacity * 3) {
+        fat_name_slot_t* old = index->names;
+        size_t old_capacity = index->name_capacity;
+        size_t live = 1;
+
+        for (size_t i = 0; i < old_capacity; i++) {
+            live += old[i].state == 1;
+        }
+
+        index->name_capacity = 64;
+        while (index->name_capacity < live * 2) {
+            index->name_capacity <<= 1;
+        }
+
+        index->names = calloc(index->name_capacity, sizeof(fat_name_slot_t));
+        index->name_used = 0;
+
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].state == 1) {
+                insert_name(index, old[i].name);
+            }
+        }
+
+        free(old);
+    }
+
+    size_t mask = index->name_capacity - 1;
+    size_t i = hash_name(sfn) & mask;
+
+    while (index->names[i].state == 1) {
+        i = (i + 1) & mask;
+    }
+
+    if (index->names[i].state == 0) {
+        index->name_used++;
+    }
+
+    memcpy(index->names[i].name, sfn, 11);
+    index->names[i].state = 1;
+}
+
+static void index_destroy(fat_dir_index_t* index) {
+    free_runs(index);
+    free(index->clusters);
+    free(index->names);
+    free(index);
+}
+
+// One pass over the directory. Deleted slots become holes and the first 0x00 slot
+// starts the tail; stale bytes after it are cleared, since new entries placed
+// there would move the end marker past them.
+static void index_build(fat_t* fat, fat_dir_index_t* index) {
+    uint32_t per_cluster = slots_per_cluster(fat);
+    uint8_t* data = malloc(fat->cluster_size);
+    bool ended = false;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+
+    free_runs(index);
+    index->cluster_count = 0;
+    index->fragmented = false;
+
+    free(index->names);
+    index->names = NULL;
+    index->name_capacity = 0;
+    index->name_used = 0;
+
+    uint32_t cluster = index->dir_cluster;
+
+    while (cluster >= 2 && cluster < fat->cluster_count && index->cluster_count < fat->cluster_count) {
+        size_t offset = fat32_cluster_offset(fat, cluster);
+        bool dirty = false;
+
+        append_cluster(index, cluster);
+        fat32_read_at(fat, offset, data, fat->cluster_size);
+
+        for (uint32_t i = 0; i < per_cluster; i++) {
+            uint8_t* entry = data + i * sizeof(DirectoryEntry_t);
+            uint32_t slot = (index->cluster_count - 1) * per_cluster + i;
+
+            if (ended) {
+                if (entry[0] != 0x00) {
+                    memset(entry, 0, sizeof(DirectoryEntry_t));
+                    dirty = true;
+                }
+                continue;
+            }
+
+            if (entry[0] == 0x00) {
+                ended = true;
+                index->end = slot;
+                continue;
+            }
+
+            if (entry[0] == 0xE5) {
+                if (run_length++ == 0) {
+                    run_start = slot;
+                }
+                continue;
+            }
+
+            if (run_length) {
+                push_run(index, run_start, run_length);
+                run_length = 0;
+            }
+
+            if ((entry[11] & ATTR_LFN_MASK) != ATTR_LONG_FILE_NAME) {
+                insert_name(index, (const char*)entry);
+            }
+        }
+
+        if (dirty && !fat->read_only) {
+            fat32_write_at(fat, offset, data, fat->cluster_size);
+        }
+
+        cluster = fat32_get_fat_entry(fat, cluster);
+    }
+
+    if (!ended) {
+        index->end = index->cluster_count * per_cluster;
+    }
+
+    // Deleted slots right before the tail just extend it.
+    if (run_length) {
+        index->end = run_start;
+    }
+
+    free(data);
+}
+
+fat_dir_index_t* fat_dir_index_get(fat_t* fat, uint32_t dir_cluster) {
+    fat_dir_index_t** link = &fat->dir_index;
+
+    while (*link) {
+        fat_dir_index_t* index = *link;
+
+        if (index->dir_cluster == dir_cluster) {
+            *link = index->next;
+            index->next = fat->dir_index;
+            fat->dir_index = index;
+
+            return index;
+        }
+
+        link = &index->next;
+    }
+
+    fat_dir_index_t* index = calloc(1, sizeof(fat_dir_index_t));
+    index->dir_cluster = dir_cluster;
+    index_build(fat, index);
+
+    if (index->cluster_count == 0) {
+        index_destroy(index);
+        return NULL;
+    }
+
+    index->next = fat->dir_index;
+    fat->dir_index = index;
+
+    // Drop the least recently used ones past the limit.
+    link = &fat->dir_index;
+    for (size_t i = 0; *link && i < FAT_DIR_INDEX_CACHED; i++) {
+        link = &(*link)->next;
+    }
+
+    while (*link) {
+        fat_dir_index_t* old = *link;
+        *link = old->next;
+        index_destroy(old);
+    }
+
+    return index;
+}
+
+// Finds `count` consecutive free slots: the smallest bucket that fits, then the tail,
+// growing the directory by zeroed clusters when the tail is too short.
+bool fat_dir_index_alloc(fat_t* fat, fat_dir_index_t* index, uint32_t count, uint32_t* out_slot) {
+    uint32_t per_cluster = slots_per_cluster(fat);
+
+    if (count == 0) {
+        return false;
+    }
+
+    while (true) {
+        for (size_t bucket = count - 1; bucket < FAT_DIR_INDEX_BUCKETS; bucket++) {
+            fat_slot_run_t* run = index->runs[bucket];
+
+            if (run == NULL) {
+                continue;
+            }
+
+            index->runs[bucket] = run->next;
+            *out_slot = run->start;
+
+            if (run->length > count) {
+                push_run(index, run->start + count, run->length - count);
+            }
+
+            free(run);
+
+            return true;
+        }
+
+        if (!index->fragmented) {
+            break;
+        }
+
+        // Neighbouring holes may add up to enough, merge them before growing.
+        index_build(fat, index);
+    }
+
+    while (index->end + count > index->cluster_count * per_cluster) {
+        uint32_t cluster = fat32_allocate_cluster(fat, index->clusters[index->cluster_count - 1], true);
+
+        if (cluster == 0) {
+            return false;
+        }
+
+        append_cluster(index, cluster);
+    }
+
+    *out_slot = index->end;
+    index->end += count;
+
+    return true;
+}
+
+// Slots that were freed on disk (or handed out and never written).
+void fat_dir_index_release(fat_t* fat, uint32_t dir_cluster, uint32_t first_slot, uint32_t count) {
+    fat_dir_index_t* index = fat->dir_index;
+
+    while (index && index->dir_cluster != dir_cluster) {
+        index = index->next;
+    }
+
+    if (index == NULL || count == 0) {
+        return;
+    }
+
+    if (first_slot + count == index->end) {
+        index->end = first_slot;
+        return;
+    }
+
+    push_run(index, first_slot, count);
+    index->fragmented = true;
+}
+
+size_t fat_dir_index_offset(fat_t* fat, const fat_dir_index_t* index, uint32_t slot) {
+    uint32_t per_cluster = slots_per_cluster(fat);
+
+    return fat32_cluster_offset(fat, index->clusters[slot / per_cluster]) +
+           (slot % per_cluster) * sizeof(DirectoryEntry_t);
+}
+
+bool fat_dir_index_has_name(const fat_dir_index_t* index, const char sfn[11]) {
+    return find_name(index, sfn) != NULL;
+}
+
+void fat_dir_index_add_name(fat_dir_index_t* index, const char sfn[11]) {
+    if (find_name(index, sfn) == NULL) {
+        insert_name(index, sfn);
+    }
+}
+
+void fat_dir_index_remove_name(fat_t* fat, uint32_t dir_cluster, const char sfn[11]) {
+    fat_dir_index_t* index = fat->dir_index;
+
+    while (index && index->dir_cluster != dir_cluster) {
+        index = index->next;
+    }
+
+    fat_name_slot_t* slot = index ? find_name(index, sfn) : NULL;
+
+    if (slot) {
+        slot->state = 2;
+    }
+}
+
+// For changes made behind the index's back (compaction, freed directories, repairs).
+void fat_dir_index_invalidate(fat_t* fat, uint32_t dir_cluster) {
+    fat_dir_index_t** link = &fat->dir_index;
+
+    while (*link) {
+        fat_dir_index_t* index = *link;
+
+        if (index->dir_cluster == dir_cluster) {
+            *link = index->next;
+            index_destroy(index);
+            return;
+        }
+
+        link = &index->next;
+    }
+}
+
+void fat_dir_index_clear(fat_t* fat) {
+    while (fat->dir_index) {
+        fat_dir_index_t* index = fat->dir_index;
+        fat->dir_index = index->next;
+        index_destroy(index);
+    }
+}
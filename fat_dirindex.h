@@ -0,0 +1,57 @@
+#pragma once
+
+#include "fat32.h"
+
+// Directories whose slot index is kept in memory per mounted image.
+#ifndef FAT_DIR_INDEX_CACHED
+#define FAT_DIR_INDEX_CACHED 16
+#endif
+
+// An LFN name takes at most 20 slots, plus one for the short entry.
+#define FAT_DIR_INDEX_BUCKETS 21
+
+typedef struct {
+    char name[11];
+    uint8_t state;  // 0 empty, 1 used, 2 removed
+} fat_name_slot_t;
+
+typedef struct fat_slot_run {
+    uint32_t start;
+    uint32_t length;
+    struct fat_slot_run* next;
+} fat_slot_run_t;
+
+// Free 32 byte slots of one directory. Slots are numbered from the start of the
+// directory, slot / (cluster_size / 32) is the position in `clusters`.
+typedef struct fat_dir_index {
+    uint32_t dir_cluster;
+
+    uint32_t* clusters;  // Directory chain
+    uint32_t cluster_count;
+    uint32_t cluster_capacity;
+
+    uint32_t end;  // First slot of the unused tail, everything from here on is free
+    // Holes left by deleted entries, bucket N holds runs of N + 1 slots and the
+    // last one everything longer.
+    fat_slot_run_t* runs[FAT_DIR_INDEX_BUCKETS];
+    bool fragmented;  // Holes were added without merging neighbours
+
+    // Short names in use, open addressing over `name_capacity` (a power of two) slots.
+    fat_name_slot_t* names;
+    size_t name_capacity;
+    size_t name_used;  // Used plus removed slots
+
+    struct fat_dir_index* next;  // Most recently used first
+} fat_dir_index_t;
+
+fat_dir_index_t* fat_dir_index_get(fat_t* fat, uint32_t dir_cluster);
+bool fat_dir_index_alloc(fat_t* fat, fat_dir_index_t* index, uint32_t count, uint32_t* out_slot);
+void fat_dir_index_release(fat_t* fat, uint32_t dir_cluster, uint32_t first_slot, uint32_t count);
+size_t fat_dir_index_offset(fat_t* fat, const fat_dir_index_t* index, uint32_t slot);
+
+bool fat_dir_index_has_name(const fat_dir_index_t* index, const char sfn[11]);
+void fat_dir_index_add_name(fat_dir_index_t* index, const char sfn[11]);
+void fat_dir_index_remove_name(fat_t* fat, uint32_t dir_cluster, const char sfn[11]);
+
+void fat_dir_index_invalidate(fat_t* fat, uint32_t dir_cluster);
+void fat_dir_index_clear(fat_t* fat);
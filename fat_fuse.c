@@ -0,0 +1,797 @@
+// FUSE daemon serving one image through the fat32 vfs driver. Built with `make fuse`
+// (needs libfuse3), run as: fat32-fuse IMAGE MOUNTPOINT [FUSE options]
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+
+#include <fuse.h>
+
+#include "fat_vfs.h"
+#include "fat_catalog.h"
+#include "fat_trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+// Largest read/write the kernel is asked to send in one request.
+#ifndef FAT_FUSE_MAX_IO
+#define FAT_FUSE_MAX_IO (1024 * 1024)
+#endif
+
+// Seconds between attempts to run fat32_maintenance.
+#ifndef FAT_FUSE_MAINTENANCE_INTERVAL
+#define FAT_FUSE_MAINTENANCE_INTERVAL 5
+#endif
+
+typedef enum {
+    FUSE_OP_GETATTR = 0,
+    FUSE_OP_READDIR,
+    FUSE_OP_OPEN,
+    FUSE_OP_READ,
+    FUSE_OP_WRITE,
+    FUSE_OP_CREATE,
+    FUSE_OP_MKDIR,
+    FUSE_OP_UNLINK,
+    FUSE_OP_TRUNCATE,
+    FUSE_OP_FSYNC,
+    FUSE_OP_STATFS,
+    FUSE_OP_COUNT
+} fuse_op_t;
+
+static const char* fuse_op_names[FUSE_OP_COUNT] = {
+    "getattr",
+    "readdir",
+    "open",
+    "read",
+    "write",
+    "create",
+    "mkdir",
+    "unlink",
+    "truncate",
+    "fsync",
+    "statfs",
+};
+
+// Every handle of a path shares one NFILE, so the size and chain cached at open stay
+// the same for all of them.
+typedef struct fat_fuse_file {
+    NFILE* fp;
+    size_t users;
+    struct fat_fuse_file* next;
+} fat_fuse_file_t;
+
+typedef struct {
+    fat_t fat;
+    fs_object_t fs;
+
+    // The engine is not safe for concurrent changes: lookups and reads share it,
+    // anything that writes to the image holds it exclusively.
+    pthread_rwlock_t lock;
+
+    // Open files, guarded by files_lock. Taken after `lock`, never before.
+    fat_fuse_file_t* files;
+    pthread_mutex_t files_lock;
+
+    // Tree sidecar (FAT32_CATALOG_FILE), built again by maintenance after writes.
+    const char* catalog_path;
+
+    pthread_t maintenance;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+
+    fat_histogram_t latency[FUSE_OP_COUNT];
+} fat_fuse_t;
+
+static fat_fuse_t* get_context(void) {
+    return fuse_get_context()->private_data;
+}
+
+#define OP_BEGIN() uint64_t op_started = fat_metrics_now()
+#define OP_END(ctx, op) fat_histogram_record(&(ctx)->latency[op], fat_metrics_now() - op_started)
+
+// `path` split into a parent directory and the last component.
+static char* split_path(const char* path, const char** out_name) {
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    char* parent = calloc((name - path) + 1, 1);
+    memcpy(parent, path, name - path);
+
+    *out_name = name;
+
+    return parent;
+}
+
+static time_t datetime_to_time(const datetime_t* datetime) {
+    if (datetime->year == 0) {
+        return 0;
+    }
+
+    struct tm tm = {
+        .tm_year = datetime->year - 1900,
+        .tm_mon = datetime->month - 1,
+        .tm_mday = datetime->day,
+        .tm_hour = datetime->hour,
+        .tm_min = datetime->minute,
+        .tm_sec = datetime->second,
+    };
+
+    return timegm(&tm);
+}
+
+static void fill_stat(fat_fuse_t* ctx, const direntry_t* entry, struct stat* st) {
+    memset(st, 0, sizeof(struct stat));
+
+    if (entry->type == ENT_DIRECTORY) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = entry->size;
+    }
+
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = ctx->fat.cluster_size;
+    st->st_blocks = (entry->size + 511) / 512;
+    st->st_mtime = datetime_to_time(&entry->modified);
+    st->st_ctime = datetime_to_time(&entry->created);
+    st->st_atime = st->st_mtime;
+}
+
+static NFILE* get_file(struct fuse_file_info* fi) {
+    return ((fat_fuse_file_t*)(size_t)fi->fh)->fp;
+}
+
+// Called with files_lock held.
+static fat_fuse_file_t* find_file(fat_fuse_t* ctx, const char* path) {
+    for (fat_fuse_file_t* file = ctx->files; file; file = file->next) {
+        if (strcmp(file->fp->path, path) == 0) {
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+// Sizes of open files run ahead of their entries until the files are synced.
+static void open_file_size(fat_fuse_t* ctx, const char* path, size_t* size) {
+    pthread_mutex_lock(&ctx->files_lock);
+
+    fat_fuse_file_t* file = find_file(ctx, path);
+
+    if (file) {
+        *size = file->fp->size;
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+}
+
+static int fat_fuse_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
+    fat_fuse_t* ctx = get_context();
+    int result = -ENOENT;
+
+    OP_BEGIN();
+
+    fat32_stat_t stat = {.path = path};
+
+    pthread_rwlock_rdlock(&ctx->lock);
+
+    // Unlinked files that are still open have no path and no entry left, only the handle.
+    if (path == NULL) {
+        stat.found = fi != NULL;
+        stat.type = ENT_FILE;
+        stat.size = stat.found ? get_file(fi)->size : 0;
+    } else {
+        fat32_stat_batch(&ctx->fat, &stat, 1);
+    }
+
+    if (path && stat.found && stat.type == ENT_FILE) {
+        open_file_size(ctx, path, &stat.size);
+    }
+
+    pthread_rwlock_unlock(&ctx->lock);
+
+    if (stat.found) {
+        direntry_t entry = {
+            .type = stat.type,
+            .size = stat.size,
+            .created = stat.created,
+            .modified = stat.modified,
+        };
+
+        fill_stat(ctx, &entry, st);
+        result = 0;
+    }
+
+    OP_END(ctx, FUSE_OP_GETATTR);
+
+    return result;
+}
+
+// Every entry goes out with its attributes (readdirplus), so listing a directory
+// does not cost a lookup per name afterwards.
+static int fat_fuse_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset,
+                            struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+    (void)offset;
+    (void)fi;
+    (void)flags;
+
+    fat_fuse_t* ctx = get_context();
+    int result = 0;
+
+    OP_BEGIN();
+
+    pthread_rwlock_rdlock(&ctx->lock);
+
+    direntry_t* entries = ctx->fs.filesystem->diropen(&ctx->fs, path);
+
+    // No entries: tell an empty directory from a missing path or a file.
+    if (entries == NULL) {
+        fat32_stat_t stat = {.path = path};
+
+        fat32_stat_batch(&ctx->fat, &stat, 1);
+
+        if (!stat.found) {
+            result = -ENOENT;
+        } else if (stat.type != ENT_DIRECTORY) {
+            result = -ENOTDIR;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->files_lock);
+
+    for (direntry_t* entry = entries; entry && ctx->files; entry = entry->next) {
+        if (entry->type == ENT_FILE) {
+            char child[strlen(path) + strlen(entry->name) + 2];
+
+            snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry->name);
+
+            fat_fuse_file_t* file = find_file(ctx, child);
+
+            if (file) {
+                entry->size = file->fp->size;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    if (result == 0) {
+        filler(buffer, ".", NULL, 0, 0);
+        filler(buffer, "..", NULL, 0, 0);
+    }
+
+    for (direntry_t* entry = entries; entry; entry = entry->next) {
+        struct stat st;
+
+        fill_stat(ctx, entry, &st);
+
+        if (filler(buffer, entry->name, &st, 0, FUSE_FILL_DIR_PLUS)) {
+            break;
+        }
+    }
+
+    fat32_vfs_dirclose(entries);
+
+    OP_END(ctx, FUSE_OP_READDIR);
+
+    return result;
+}
+
+static int fat_fuse_open(const char* path, struct fuse_file_info* fi) {
+    fat_fuse_t* ctx = get_context();
+
+    OP_BEGIN();
+
+    pthread_rwlock_rdlock(&ctx->lock);
+    pthread_mutex_lock(&ctx->files_lock);
+
+    fat_fuse_file_t* file = find_file(ctx, path);
+
+    if (file == NULL) {
+        NFILE* fp = ctx->fs.filesystem->fileopen(&ctx->fs, path);
+
+        if (fp) {
+            file = calloc(1, sizeof(fat_fuse_file_t));
+            file->fp = fp;
+            file->next = ctx->files;
+            ctx->files = file;
+        }
+    }
+
+    if (file) {
+        file->users++;
+        fi->fh = (uint64_t)(size_t)file;
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_OPEN);
+
+    return file ? 0 : -ENOENT;
+}
+
+// The last handle of a path writes the size back and closes the shared NFILE, or frees
+// the clusters if the file was unlinked meanwhile.
+static int fat_fuse_release(const char* path, struct fuse_file_info* fi) {
+    (void)path;
+
+    fat_fuse_t* ctx = get_context();
+    fat_fuse_file_t* file = (fat_fuse_file_t*)(size_t)fi->fh;
+
+    pthread_rwlock_wrlock(&ctx->lock);
+    pthread_mutex_lock(&ctx->files_lock);
+
+    if (--file->users == 0) {
+        fat_fuse_file_t** link = &ctx->files;
+
+        while (*link && *link != file) {
+            link = &(*link)->next;
+        }
+
+        // Unlinked files are no longer listed.
+        if (*link) {
+            *link = file->next;
+        }
+
+        ctx->fs.filesystem->fileclose(&ctx->fs, file->fp);
+        free(file);
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    return 0;
+}
+
+// Reads run in parallel; the positional callbacks never touch the shared handle's position.
+static int fat_fuse_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
+    (void)path;
+
+    fat_fuse_t* ctx = get_context();
+    NFILE* fp = get_file(fi);
+
+    OP_BEGIN();
+
+    pthread_rwlock_rdlock(&ctx->lock);
+    size_t done = ctx->fs.filesystem->filepread(&ctx->fs, buffer, size, offset, fp);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_READ);
+
+    return done;
+}
+
+static int fat_fuse_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
+    (void)path;
+
+    fat_fuse_t* ctx = get_context();
+    NFILE* fp = get_file(fi);
+
+    OP_BEGIN();
+
+    pthread_rwlock_wrlock(&ctx->lock);
+    size_t done = ctx->fs.filesystem->filepwrite(&ctx->fs, buffer, size, offset, fp);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_WRITE);
+
+    return done;
+}
+
+static int fat_fuse_make(const char* path, bool is_file, fuse_op_t op) {
+    fat_fuse_t* ctx = get_context();
+    const char* name;
+    char* parent = split_path(path, &name);
+    size_t cluster = 0;
+
+    OP_BEGIN();
+
+    pthread_rwlock_wrlock(&ctx->lock);
+
+    size_t dir_cluster = fat32_search(&ctx->fat, parent);
+
+    if (dir_cluster != 0) {
+        cluster = fat32_create_file(&ctx->fat, dir_cluster, name, is_file);
+    }
+
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, op);
+
+    free(parent);
+
+    if (dir_cluster == 0) {
+        return -ENOENT;
+    }
+
+    return cluster ? 0 : -ENOSPC;
+}
+
+static int fat_fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+    (void)mode;
+
+    int result = fat_fuse_make(path, true, FUSE_OP_CREATE);
+
+    return result ? result : fat_fuse_open(path, fi);
+}
+
+static int fat_fuse_mkdir(const char* path, mode_t mode) {
+    (void)mode;
+
+    return fat_fuse_make(path, false, FUSE_OP_MKDIR);
+}
+
+// Open files lose their entry right away; their clusters stay readable and writable
+// through the open handles and are freed when the last one is released.
+static int fat_fuse_remove(const char* path, bool is_dir) {
+    fat_fuse_t* ctx = get_context();
+    fat32_stat_t stat = {.path = path};
+    int result;
+
+    OP_BEGIN();
+
+    pthread_rwlock_wrlock(&ctx->lock);
+
+    fat32_stat_batch(&ctx->fat, &stat, 1);
+
+    if (!stat.found) {
+        result = -ENOENT;
+    } else if (is_dir != (stat.type == ENT_DIRECTORY)) {
+        result = is_dir ? -ENOTDIR : -EISDIR;
+    } else if (is_dir) {
+        // fat32_unlink refuses directories that still have entries.
+        result = fat32_unlink(&ctx->fat, path) ? 0 : -ENOTEMPTY;
+    } else {
+        pthread_mutex_lock(&ctx->files_lock);
+
+        fat_fuse_file_t* file = find_file(ctx, path);
+        bool removed;
+
+        if (file) {
+            removed = fat32_file_unlink(&ctx->fat, file->fp->priv_data);
+
+            if (removed) {
+                fat_fuse_file_t** link = &ctx->files;
+
+                while (*link != file) {
+                    link = &(*link)->next;
+                }
+
+                *link = file->next;
+            }
+        } else {
+            removed = fat32_unlink(&ctx->fat, path);
+        }
+
+        pthread_mutex_unlock(&ctx->files_lock);
+
+        result = removed ? 0 : -EIO;
+    }
+
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_UNLINK);
+
+    return result;
+}
+
+static int fat_fuse_unlink(const char* path) {
+    return fat_fuse_remove(path, false);
+}
+
+static int fat_fuse_rmdir(const char* path) {
+    return fat_fuse_remove(path, true);
+}
+
+static int fat_fuse_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    fat_fuse_t* ctx = get_context();
+    bool done;
+
+    OP_BEGIN();
+
+    pthread_rwlock_wrlock(&ctx->lock);
+
+    // An open file is truncated through the NFILE its handles share, which caches the
+    // chain, also when the call comes by path. Readers look at its size under the read lock.
+    pthread_mutex_lock(&ctx->files_lock);
+
+    fat_fuse_file_t* file = fi ? (fat_fuse_file_t*)(size_t)fi->fh : find_file(ctx, path);
+
+    if (file) {
+        NFILE* fp = file->fp;
+
+        done = fat32_file_truncate(&ctx->fat, fp->priv_data, size);
+        fp->size = ((fat32_file_t*)fp->priv_data)->size;
+    } else {
+        done = fat32_truncate(&ctx->fat, path, size);
+    }
+
+    pthread_mutex_unlock(&ctx->files_lock);
+
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_TRUNCATE);
+
+    return done ? 0 : -EIO;
+}
+
+// Sizes of open files only reach their entries here and when the last handle closes.
+static int fat_fuse_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    (void)path;
+    (void)datasync;
+
+    fat_fuse_t* ctx = get_context();
+
+    OP_BEGIN();
+
+    pthread_rwlock_wrlock(&ctx->lock);
+
+    if (fi) {
+        fat32_vfs_filesync(&ctx->fs, get_file(fi));
+    } else {
+        fat32_flush(&ctx->fat);
+    }
+
+    pthread_rwlock_unlock(&ctx->lock);
+
+    OP_END(ctx, FUSE_OP_FSYNC);
+
+    return 0;
+}
+
+static int fat_fuse_flush(const char* path, struct fuse_file_info* fi) {
+    return fat_fuse_fsync(path, 0, fi);
+}
+
+// Only the modification time and the access date have a place in the entry.
+static int fat_fuse_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
+    (void)fi;
+
+    fat_fuse_t* ctx = get_context();
+    time_t now = time(NULL);
+    time_t accessed = now;
+    time_t modified = now;
+
+    // Nothing left to stamp on a file unlinked while open.
+    if (path == NULL) {
+        return 0;
+    }
+
+    if (strcmp(path, "/") == 0) {
+        return -EPERM;
+    }
+
+    if (tv) {
+        accessed = tv[0].tv_nsec == UTIME_OMIT ? (time_t)-1 : tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+        modified = tv[1].tv_nsec == UTIME_OMIT ? (time_t)-1 : tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec;
+    }
+
+    pthread_rwlock_wrlock(&ctx->lock);
+    bool done = fat32_set_times(&ctx->fat, path, modified, accessed);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    return done ? 0 : -ENOENT;
+}
+
+static int fat_fuse_statfs(const char* path, struct statvfs* st) {
+    (void)path;
+
+    fat_fuse_t* ctx = get_context();
+
+    OP_BEGIN();
+
+    memset(st, 0, sizeof(struct statvfs));
+
+    pthread_rwlock_wrlock(&ctx->lock);  // The first call may count free clusters
+    st->f_bfree = fat32_free_clusters(&ctx->fat);
+    pthread_rwlock_unlock(&ctx->lock);
+
+    st->f_bsize = ctx->fat.cluster_size;
+    st->f_frsize = ctx->fat.cluster_size;
+    st->f_blocks = ctx->fat.cluster_count - 2;
+    st->f_bavail = st->f_bfree;
+    st->f_namemax = 255;
+
+    OP_END(ctx, FUSE_OP_STATFS);
+
+    return 0;
+}
+
+// Runs the engine's deferred work, directory compaction, while the daemon is idle. A tick
+// that finds the lock taken skips its turn instead of queueing behind requests.
+static void* fat_fuse_maintenance(void* arg) {
+    fat_fuse_t* ctx = arg;
+
+    pthread_mutex_lock(&ctx->stop_lock);
+
+    while (!ctx->stop) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FAT_FUSE_MAINTENANCE_INTERVAL;
+
+        pthread_cond_timedwait(&ctx->stop_cond, &ctx->stop_lock, &deadline);
+
+        if (ctx->stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&ctx->stop_lock);
+
+        if (pthread_rwlock_trywrlock(&ctx->lock) == 0) {
+            fat32_maintenance(&ctx->fat);
+
+            // The rebuild only parses directories that changed since the last one.
+            if (ctx->catalog_path && !fat_catalog_usable(&ctx->fat)) {
+                fat_catalog_attach(&ctx->fat, ctx->catalog_path);
+            }
+
+            pthread_rwlock_unlock(&ctx->lock);
+        }
+
+        pthread_mutex_lock(&ctx->stop_lock);
+    }
+
+    pthread_mutex_unlock(&ctx->stop_lock);
+
+    return NULL;
+}
+
+static void* fat_fuse_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    conn->max_write = FAT_FUSE_MAX_IO;
+    conn->max_readahead = FAT_FUSE_MAX_IO;
+
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+    }
+
+    // Always send attributes with the listing, not only for the first readdir.
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+
+    // All changes come through this daemon, so the kernel may cache what it got.
+    cfg->entry_timeout = 1.0;
+    cfg->attr_timeout = 1.0;
+    cfg->negative_timeout = 1.0;
+
+    // Files unlinked while open are dropped at once and reached through their handles
+    // with a NULL path; there is no rename to hide them behind.
+    cfg->hard_remove = 1;
+    cfg->nullpath_ok = 1;
+
+    // Started here rather than in main: fuse_main forks into the background first.
+    fat_fuse_t* ctx = get_context();
+
+    pthread_create(&ctx->maintenance, NULL, fat_fuse_maintenance, ctx);
+
+    return ctx;
+}
+
+static void fat_fuse_destroy(void* private_data) {
+    fat_fuse_t* ctx = private_data;
+
+    pthread_mutex_lock(&ctx->stop_lock);
+    ctx->stop = true;
+    pthread_cond_signal(&ctx->stop_cond);
+    pthread_mutex_unlock(&ctx->stop_lock);
+
+    pthread_join(ctx->maintenance, NULL);
+
+    fprintf(stderr, "%-10s %10s %12s %12s %12s\n", "op", "count", "p50 (ns)", "p99 (ns)", "max (ns)");
+
+    for (size_t op = 0; op < FUSE_OP_COUNT; op++) {
+        const fat_histogram_t* histogram = &ctx->latency[op];
+
+        if (histogram->count == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%-10s %10llu %12llu %12llu %12llu\n", fuse_op_names[op],
+                (unsigned long long)histogram->count,
+                (unsigned long long)fat_histogram_percentile(histogram, 50),
+                (unsigned long long)fat_histogram_percentile(histogram, 99),
+                (unsigned long long)histogram->max_ns);
+    }
+
+    fat32_deinit(&ctx->fat);
+    pthread_mutex_destroy(&ctx->files_lock);
+    pthread_rwlock_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->stop_cond);
+    pthread_mutex_destroy(&ctx->stop_lock);
+}
+
+static const struct fuse_operations fat_fuse_operations = {
+    .init = fat_fuse_init,
+    .destroy = fat_fuse_destroy,
+    .getattr = fat_fuse_getattr,
+    .readdir = fat_fuse_readdir,
+    .open = fat_fuse_open,
+    .release = fat_fuse_release,
+    .read = fat_fuse_read,
+    .write = fat_fuse_write,
+    .create = fat_fuse_create,
+    .mkdir = fat_fuse_mkdir,
+    .unlink = fat_fuse_unlink,
+    .rmdir = fat_fuse_rmdir,
+    .truncate = fat_fuse_truncate,
+    .flush = fat_fuse_flush,
+    .fsync = fat_fuse_fsync,
+    .utimens = fat_fuse_utimens,
+    .statfs = fat_fuse_statfs,
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s IMAGE MOUNTPOINT [FUSE options]\n", argv[0]);
+        return 1;
+    }
+
+    if (access(argv[1], R_OK | W_OK) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fat_fuse_t* ctx = calloc(1, sizeof(fat_fuse_t));
+
+    fat32_init(argv[1], &ctx->fat);
+    pthread_rwlock_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->files_lock, NULL);
+    pthread_mutex_init(&ctx->stop_lock, NULL);
+    pthread_cond_init(&ctx->stop_cond, NULL);
+
+    ctx->fs.valid = true;
+    ctx->fs.filesystem = &fat32_filesystem;
+    ctx->fs.priv_data = &ctx->fat;
+
+    if (!ctx->fs.filesystem->probe(0, &ctx->fs)) {
+        fprintf(stderr, "%s: not a FAT32 image\n", argv[1]);
+        fat32_deinit(&ctx->fat);
+        free(ctx);
+        return 1;
+    }
+
+    // Production workloads can be captured for fat32-replay.
+    const char* trace_path = getenv("FAT32_TRACE_FILE");
+
+    if (trace_path && !fat_trace_start(&ctx->fat, trace_path)) {
+        perror(trace_path);
+    }
+
+    // Read-mostly images can serve lookups, listings and opens from a tree sidecar.
+    ctx->catalog_path = getenv("FAT32_CATALOG_FILE");
+
+    if (ctx->catalog_path && !fat_catalog_attach(&ctx->fat, ctx->catalog_path)) {
+        perror(ctx->catalog_path);
+    }
+
+    // Multi-threaded unless -s is given; large reads need max_read as a mount option.
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    char max_read[64];
+
+    snprintf(max_read, sizeof(max_read), "-omax_read=%d", FAT_FUSE_MAX_IO);
+
+    fuse_opt_add_arg(&args, argv[0]);
+
+    for (int i = 2; i < argc; i++) {
+        fuse_opt_add_arg(&args, argv[i]);
+    }
+
+    fuse_opt_add_arg(&args, max_read);
+
+    int result = fuse_main(args.argc, args.argv, &fat_fuse_operations, ctx);
+
+    fuse_opt_free_args(&args);
+    free(ctx);
+
+    return result;
+}
@@ -0,0 +1,120 @@
+#include "fat_metrics.h"
+
+#include <string.h>
+
+static const char* op_names[FAT_OP_COUNT] = {
+    "lookup",
+    "read",
+    "write",
+    "create",
+    "flush",
+    "delete",
+    "copy",
+};
+
+void fat_histogram_record(fat_histogram_t* histogram, uint64_t ns) {
+    size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if (bucket >= FAT_HISTOGRAM_BUCKETS) {
+        bucket = FAT_HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, false,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Upper bound of the bucket holding the given percentile (0..100).
+uint64_t fat_histogram_percentile(const fat_histogram_t* histogram, double percentile) {
+    uint64_t target = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (size_t i = 0; i < FAT_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen >= target) {
+            uint64_t bound = 1ULL << i;
+            return bound < histogram->max_ns ? bound : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+void fat32_metrics_reset(fat_metrics_t* metrics) {
+    memset(metrics, 0, sizeof(fat_metrics_t));
+}
+
+void fat32_metrics_dump(const fat_metrics_t* m, FILE* out, bool json) {
+    const char* counter_names[] = {
+        "bytes_read", "bytes_written", "read_calls", "write_calls",
+        "fat_lookups", "fat_updates", "fat_cache_hits", "fat_cache_misses",
+        "dir_clusters_parsed", "clusters_allocated",
+    };
+    uint64_t counters[] = {
+        m->bytes_read, m->bytes_written, m->read_calls, m->write_calls,
+        m->fat_lookups, m->fat_updates, m->fat_cache_hits, m->fat_cache_misses,
+        m->dir_clusters_parsed, m->clusters_allocated,
+    };
+    size_t counter_count = sizeof(counters) / sizeof(counters[0]);
+
+    if (json) {
+        fprintf(out, "{");
+
+        for (size_t i = 0; i < counter_count; i++) {
+            fprintf(out, "\"%s\":%llu,", counter_names[i], (unsigned long long)counters[i]);
+        }
+
+        fprintf(out, "\"latency_ns\":{");
+
+        for (size_t op = 0; op < FAT_OP_COUNT; op++) {
+            const fat_histogram_t* h = &m->latency[op];
+
+            fprintf(out, "%s\"%s\":{\"count\":%llu,\"total\":%llu,\"max\":%llu,\"p50\":%llu,\"p99\":%llu,\"buckets\":[",
+                    op ? "," : "", op_names[op],
+                    (unsigned long long)h->count, (unsigned long long)h->total_ns, (unsigned long long)h->max_ns,
+                    (unsigned long long)fat_histogram_percentile(h, 50),
+                    (unsigned long long)fat_histogram_percentile(h, 99));
+
+            for (size_t i = 0; i < FAT_HISTOGRAM_BUCKETS; i++) {
+                fprintf(out, "%s%llu", i ? "," : "", (unsigned long long)h->buckets[i]);
+            }
+
+            fprintf(out, "]}");
+        }
+
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    for (size_t i = 0; i < counter_count; i++) {
+        fprintf(out, "%-20s %llu\n", counter_names[i], (unsigned long long)counters[i]);
+    }
+
+    for (size_t op = 0; op < FAT_OP_COUNT; op++) {
+        const fat_histogram_t* h = &m->latency[op];
+
+        if (h->count == 0) {
+            continue;
+        }
+
+        fprintf(out, "%-8s count %llu, avg %llu ns, p50 %llu ns, p99 %llu ns, max %llu ns\n", op_names[op],
+                (unsigned long long)h->count, (unsigned long long)(h->total_ns / h->count),
+                (unsigned long long)fat_histogram_percentile(h, 50),
+                (unsigned long long)fat_histogram_percentile(h, 99),
+                (unsigned long long)h->max_ns);
+    }
+}
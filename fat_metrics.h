@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Build with -DFAT32_METRICS to collect counters and latency histograms,
+// and with -DFAT32_DEBUG to get debug output. Both compile to nothing otherwise.
+
+typedef enum {
+    FAT_OP_LOOKUP = 0,
+    FAT_OP_READ,
+    FAT_OP_WRITE,
+    FAT_OP_CREATE,
+    FAT_OP_FLUSH,
+    FAT_OP_DELETE,
+    FAT_OP_COPY,
+    FAT_OP_COUNT
+} fat_op_t;
+
+// Bucket N counts operations that took less than 2^N nanoseconds.
+#define FAT_HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[FAT_HISTOGRAM_BUCKETS];
+} fat_histogram_t;
+
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_calls;
+    uint64_t write_calls;
+
+    uint64_t fat_lookups;
+    uint64_t fat_updates;
+    uint64_t fat_cache_hits;
+    uint64_t fat_cache_misses;
+
+    uint64_t dir_clusters_parsed;
+    uint64_t clusters_allocated;
+
+    fat_histogram_t latency[FAT_OP_COUNT];
+} fat_metrics_t;
+
+static inline uint64_t fat_metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void fat_histogram_record(fat_histogram_t* histogram, uint64_t ns);
+uint64_t fat_histogram_percentile(const fat_histogram_t* histogram, double percentile);
+
+void fat32_metrics_reset(fat_metrics_t* metrics);
+void fat32_metrics_dump(const fat_metrics_t* metrics, FILE* out, bool json);
+
+#ifdef FAT32_METRICS
+#define FAT_METRIC_ADD(fat, field, n) __atomic_add_fetch(&(fat)->metrics.field, (n), __ATOMIC_RELAXED)
+#define FAT_OP_BEGIN(name) uint64_t name = fat_metrics_now()
+#define FAT_OP_END(fat, op, name) fat_histogram_record(&(fat)->metrics.latency[op], fat_metrics_now() - (name))
+#else
+#define FAT_METRIC_ADD(fat, field, n) ((void)0)
+#define FAT_OP_BEGIN(name) ((void)0)
+#define FAT_OP_END(fat, op, name) ((void)0)
+#endif
+
+#ifdef FAT32_DEBUG
+#define FAT_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define FAT_DEBUG(...) ((void)0)
+#endif
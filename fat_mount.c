@@ -0,0 +1,369 @@
+#include "fat_mount.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MOUNT_DEFAULT_MIN_PAGES 4
+
+static size_t default_page_size(void) {
+    return FAT_CACHE_PAGE_SECTORS * 512;
+}
+
+static size_t mount_memory(const fat_mount_t* mount) {
+    fat_t* fat = mount->fat;
+
+    if (fat == NULL) {
+        return 0;
+    }
+
+    if (fat->fat_runs) {
+        return fat_rle_memory_usage(fat->fat_runs);
+    }
+
+    // Pinned images load and evict pages while we count.
+    pthread_mutex_lock(&fat->fat_lock);
+    size_t bytes = fat->fat_cache.count * fat->fat_cache.page_size;
+    pthread_mutex_unlock(&fat->fat_lock);
+
+    return bytes;
+}
+
+static fat_mount_t* get_mount(fat_mount_manager_t* manager, int id) {
+    if (id < 0 || (size_t)id >= manager->count) {
+        return NULL;
+    }
+
+    return manager->mounts[id];
+}
+
+static void close_mount(fat_mount_manager_t* manager, fat_mount_t* mount) {
+    fat32_deinit(mount->fat);
+    free(mount->fat);
+
+    mount->fat = NULL;
+    manager->open--;
+}
+
+// Pages of closed or shrunk caches wait on the pool's free list for reuse. Only as many
+// are kept as still fit in the budget next to what the open images hold.
+static void trim_pool(fat_mount_manager_t* manager) {
+    size_t used = 0;
+
+    for (size_t i = 0; i < manager->count; i++) {
+        if (manager->mounts[i]) {
+            used += mount_memory(manager->mounts[i]);
+        }
+    }
+
+    size_t budget = manager->options.memory_budget;
+
+    fat_page_pool_trim(&manager->pool, budget > used ? budget - used : 0);
+}
+
+// Read-only mounts keep their whole run index, the rest of the budget is split
+// evenly between the FAT caches of the writable ones. Caches of pinned mounts only
+// grow here; evicting pages under a busy image would stall its FAT lookups, so they
+// shrink once released.
+static void rebalance(fat_mount_manager_t* manager) {
+    size_t fixed = 0;
+    size_t writable = 0;
+
+    for (size_t i = 0; i < manager->count; i++) {
+        fat_mount_t* mount = manager->mounts[i];
+
+        if (mount && mount->fat) {
+            if (mount->fat->fat_runs) {
+                fixed += mount_memory(mount);
+            } else {
+                writable++;
+            }
+        }
+    }
+
+    size_t budget = manager->options.memory_budget;
+    size_t share = budget > fixed && writable ? (budget - fixed) / writable : 0;
+
+    for (size_t i = 0; writable && i < manager->count; i++) {
+        fat_mount_t* mount = manager->mounts[i];
+
+        if (mount && mount->fat && !mount->fat->fat_runs) {
+            size_t pages = share / mount->fat->fat_cache.page_size;
+
+            if (pages < manager->options.min_pages) {
+                pages = manager->options.min_pages;
+            }
+
+            size_t capacity = mount->fat->fat_cache.capacity;
+
+            if (pages > capacity || (pages < capacity && mount->users == 0)) {
+                fat_cache_resize(mount->fat, pages);
+            }
+        }
+    }
+
+    trim_pool(manager);
+}
+
+static fat_mount_t* coldest_unpinned(fat_mount_manager_t* manager, const fat_mount_t* except) {
+    fat_mount_t* coldest = NULL;
+
+    for (size_t i = 0; i < manager->count; i++) {
+        fat_mount_t* mount = manager->mounts[i];
+
+        if (mount && mount != except && mount->fat && mount->users == 0
+            && (coldest == NULL || mount->last_used < coldest->last_used)) {
+            coldest = mount;
+        }
+    }
+
+    return coldest;
+}
+
+// Closes cold images until `extra` more bytes fit in the budget and the open limit
+// allows one more image. Pinned images are never closed, so the budget can be
+// exceeded while all of them are in use.
+static void make_room(fat_mount_manager_t* manager, const fat_mount_t* except, size_t extra) {
+    while (true) {
+        size_t used = extra;
+
+        for (size_t i = 0; i < manager->count; i++) {
+            fat_mount_t* mount = manager->mounts[i];
+
+            if (mount && mount->fat) {
+                // Writable caches can shrink down to their minimum.
+                used += mount->fat->fat_runs ? mount_memory(mount)
+                                             : manager->options.min_pages * mount->fat->fat_cache.page_size;
+            }
+        }
+
+        bool over_limit = manager->options.max_open && manager->open + (except ? 0 : 1) > manager->options.max_open;
+
+        if (used <= manager->options.memory_budget && !over_limit) {
+            return;
+        }
+
+        fat_mount_t* victim = coldest_unpinned(manager, except);
+
+        if (victim == NULL) {
+            return;
+        }
+
+        close_mount(manager, victim);
+        victim->evictions++;
+    }
+}
+
+static bool open_mount(fat_mount_manager_t* manager, fat_mount_t* mount) {
+    if (access(mount->path, mount->read_only ? R_OK : R_OK | W_OK) != 0) {
+        return false;
+    }
+
+    make_room(manager, NULL, manager->options.min_pages * default_page_size());
+
+    mount->fat = calloc(1, sizeof(fat_t));
+
+    if (mount->read_only) {
+        fat32_init_readonly(mount->path, mount->fat);
+    } else {
+        fat32_init(mount->path, mount->fat);
+
+        // No page is loaded yet, so the pool can be attached right away.
+        mount->fat->fat_cache.pool = &manager->pool;
+    }
+
+    mount->opens++;
+    manager->open++;
+
+    // A run index is only sized once built; make space for it after the fact.
+    make_room(manager, mount, 0);
+    rebalance(manager);
+
+    return true;
+}
+
+void fat_mount_manager_init(fat_mount_manager_t* manager, const fat_mount_options_t* options) {
+    memset(manager, 0, sizeof(fat_mount_manager_t));
+
+    if (options) {
+        manager->options = *options;
+    }
+
+    if (manager->options.memory_budget == 0) {
+        manager->options.memory_budget = FAT_MOUNT_DEFAULT_BUDGET;
+    }
+
+    if (manager->options.min_pages == 0) {
+        manager->options.min_pages = MOUNT_DEFAULT_MIN_PAGES;
+    }
+
+    pthread_mutex_init(&manager->lock, NULL);
+    fat_page_pool_init(&manager->pool);
+}
+
+void fat_mount_manager_destroy(fat_mount_manager_t* manager) {
+    for (size_t i = 0; i < manager->count; i++) {
+        fat_mount_t* mount = manager->mounts[i];
+
+        if (mount == NULL) {
+            continue;
+        }
+
+        if (mount->fat) {
+            close_mount(manager, mount);
+        }
+
+        free(mount->path);
+        free(mount);
+    }
+
+    free(manager->mounts);
+
+    fat_page_pool_destroy(&manager->pool);
+    pthread_mutex_destroy(&manager->lock);
+}
+
+int fat_mount_add(fat_mount_manager_t* manager, const char* path, bool read_only) {
+    if (access(path, read_only ? R_OK : R_OK | W_OK) != 0) {
+        return -1;
+    }
+
+    fat_mount_t* mount = calloc(1, sizeof(fat_mount_t));
+    mount->path = strdup(path);
+    mount->read_only = read_only;
+
+    pthread_mutex_lock(&manager->lock);
+
+    size_t id = 0;
+    while (id < manager->count && manager->mounts[id]) {
+        id++;
+    }
+
+    if (id == manager->count) {
+        if (manager->count == manager->capacity) {
+            manager->capacity = manager->capacity ? manager->capacity * 2 : 16;
+            manager->mounts = realloc(manager->mounts, manager->capacity * sizeof(fat_mount_t*));
+        }
+
+        manager->count++;
+    }
+
+    manager->mounts[id] = mount;
+
+    pthread_mutex_unlock(&manager->lock);
+
+    return (int)id;
+}
+
+bool fat_mount_remove(fat_mount_manager_t* manager, int id) {
+    pthread_mutex_lock(&manager->lock);
+
+    fat_mount_t* mount = get_mount(manager, id);
+
+    if (mount == NULL || mount->users) {
+        pthread_mutex_unlock(&manager->lock);
+        return false;
+    }
+
+    if (mount->fat) {
+        close_mount(manager, mount);
+    }
+
+    manager->mounts[id] = NULL;
+
+    free(mount->path);
+    free(mount);
+
+    rebalance(manager);
+
+    pthread_mutex_unlock(&manager->lock);
+
+    return true;
+}
+
+fat_t* fat_mount_acquire(fat_mount_manager_t* manager, int id) {
+    fat_t* fat = NULL;
+
+    pthread_mutex_lock(&manager->lock);
+
+    fat_mount_t* mount = get_mount(manager, id);
+
+    if (mount && (mount->fat || open_mount(manager, mount))) {
+        mount->users++;
+        mount->last_used = ++manager->clock;
+        fat = mount->fat;
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+
+    return fat;
+}
+
+void fat_mount_release(fat_mount_manager_t* manager, int id) {
+    pthread_mutex_lock(&manager->lock);
+
+    fat_mount_t* mount = get_mount(manager, id);
+
+    if (mount && mount->users) {
+        mount->users--;
+
+        // Apply a shrink rebalance skipped while the image was busy.
+        if (mount->users == 0 && mount->fat && !mount->fat->fat_runs
+            && mount->fat->fat_cache.capacity > manager->options.min_pages) {
+            rebalance(manager);
+        }
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
+bool fat_mount_stats(fat_mount_manager_t* manager, int id, fat_mount_stats_t* stats) {
+    memset(stats, 0, sizeof(fat_mount_stats_t));
+
+    pthread_mutex_lock(&manager->lock);
+
+    fat_mount_t* mount = get_mount(manager, id);
+
+    if (mount) {
+        stats->path = mount->path;
+        stats->read_only = mount->read_only;
+        stats->open = mount->fat != NULL;
+        stats->users = mount->users;
+        stats->opens = mount->opens;
+        stats->evictions = mount->evictions;
+        stats->idle = manager->clock - mount->last_used;
+        stats->memory = mount_memory(mount);
+
+        if (mount->fat) {
+            pthread_mutex_lock(&mount->fat->fat_lock);
+            stats->cache_pages = mount->fat->fat_cache.count;
+            stats->cache_capacity = mount->fat->fat_cache.capacity;
+            pthread_mutex_unlock(&mount->fat->fat_lock);
+
+            stats->metrics = mount->fat->metrics;
+        }
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+
+    return mount != NULL;
+}
+
+// Includes pages waiting on the pool's free list.
+size_t fat_mount_memory_used(fat_mount_manager_t* manager) {
+    size_t used = 0;
+
+    pthread_mutex_lock(&manager->lock);
+
+    used += fat_page_pool_free_bytes(&manager->pool);
+
+    for (size_t i = 0; i < manager->count; i++) {
+        if (manager->mounts[i]) {
+            used += mount_memory(manager->mounts[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+
+    return used;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "fat32.h"
+
+// Default budget for FAT cache pages and read-only run indexes of all mounts.
+#ifndef FAT_MOUNT_DEFAULT_BUDGET
+#define FAT_MOUNT_DEFAULT_BUDGET (64 * 1024 * 1024)
+#endif
+
+typedef struct {
+    size_t memory_budget;  // Bytes, 0 means FAT_MOUNT_DEFAULT_BUDGET
+    size_t min_pages;      // FAT cache pages an open image gets at least, 0 means 4
+    size_t max_open;       // Images open at the same time, 0 means no limit
+} fat_mount_options_t;
+
+typedef struct fat_mount {
+    char* path;
+    bool read_only;
+
+    fat_t* fat;      // NULL while the image is closed
+    size_t users;    // Pinned by fat_mount_acquire, never closed while > 0
+    uint64_t last_used;
+
+    size_t opens;
+    size_t evictions;
+} fat_mount_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    fat_mount_options_t options;
+
+    fat_mount_t** mounts;  // Removed mounts leave NULL slots that are reused
+    size_t count;
+    size_t capacity;
+
+    size_t open;
+    uint64_t clock;
+
+    fat_page_pool_t pool;
+} fat_mount_manager_t;
+
+typedef struct {
+    const char* path;
+    bool read_only;
+    bool open;
+    size_t users;
+
+    size_t opens;
+    size_t evictions;
+    uint64_t idle;  // Acquires of other mounts since this one was last used
+
+    size_t cache_pages;     // Resident FAT pages
+    size_t cache_capacity;  // Pages the mount may hold under the current budget
+    size_t memory;          // Bytes charged to the budget
+
+    fat_metrics_t metrics;  // Since the image was last opened
+} fat_mount_stats_t;
+
+void fat_mount_manager_init(fat_mount_manager_t* manager, const fat_mount_options_t* options);
+void fat_mount_manager_destroy(fat_mount_manager_t* manager);
+
+// Registers an image without opening it. Returns the mount id, -1 on failure.
+int fat_mount_add(fat_mount_manager_t* manager, const char* path, bool read_only);
+bool fat_mount_remove(fat_mount_manager_t* manager, int id);
+
+// Opens the image if needed and pins it until fat_mount_release.
+fat_t* fat_mount_acquire(fat_mount_manager_t* manager, int id);
+void fat_mount_release(fat_mount_manager_t* manager, int id);
+
+bool fat_mount_stats(fat_mount_manager_t* manager, int id, fat_mount_stats_t* stats);
+size_t fat_mount_memory_used(fat_mount_manager_t* manager);
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+
+#include "fat_overlay.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// The bitmap follows the header page.
+#define OVERLAY_BITMAP_OFFSET 4096
+
+static bool block_present(fat_overlay_t* overlay, uint64_t block) {
+    return __atomic_load_n(&overlay->present[block >> 3], __ATOMIC_ACQUIRE) & (1 << (block & 7));
+}
+
+// Only after the block's data is in the delta, so readers never see a half copied block.
+static void mark_present(fat_overlay_t* overlay, uint64_t block) {
+    __atomic_fetch_or(&overlay->present[block >> 3], 1 << (block & 7), __ATOMIC_RELEASE);
+    overlay->bitmap_dirty = true;
+}
+
+static bool write_all(int fd, const void* buffer, size_t size, uint64_t offset) {
+    for (size_t done = 0; done < size;) {
+        ssize_t result = pwrite(fd, (const char*)buffer + done, size - done, offset + done);
+
+        if (result <= 0) {
+            return false;
+        }
+
+        done += result;
+    }
+
+    return true;
+}
+
+// Base image bytes of one block; parts outside the image (before offset 0 or past
+// the end) are zeros.
+static void read_base_block(fat_overlay_t* overlay, uint64_t block, uint8_t* out) {
+    uint32_t block_size = overlay->header.block_size;
+    int64_t start = (int64_t)(block * block_size) - overlay->header.shift;
+    int64_t from = start < 0 ? 0 : start;
+    int64_t to = start + block_size;
+
+    if (to > (int64_t)overlay->header.base_size) {
+        to = overlay->header.base_size;
+    }
+
+    memset(out, 0, block_size);
+
+    if (from < to) {
+        ssize_t result = pread(overlay->base_fd, out + (from - start), to - from, from);
+        (void)result;
+    }
+}
+
+// Writes `length` bytes at `in_block` of one block, copying the rest of the block
+// from the base first if it is not in the delta yet. NULL data writes zeros.
+static bool write_block(fat_overlay_t* overlay, uint64_t block, uint32_t in_block, const void* data, uint32_t length) {
+    uint32_t block_size = overlay->header.block_size;
+    uint64_t delta_offset = overlay->header.data_offset + block * block_size;
+    bool present = block_present(overlay, block);
+
+    if (!present && length < block_size) {
+        uint8_t* copy = malloc(block_size);
+
+        read_base_block(overlay, block, copy);
+
+        if (data) {
+            memcpy(copy + in_block, data, length);
+        } else {
+            memset(copy + in_block, 0, length);
+        }
+
+        bool ok = write_all(overlay->delta_fd, copy, block_size, delta_offset);
+        free(copy);
+
+        if (ok) {
+            mark_present(overlay, block);
+        }
+
+        return ok;
+    }
+
+    if (data == NULL) {
+#ifdef __linux__
+        // Holes read back as zeros, whole blocks cost no space at all.
+        if (length == block_size
+            && fallocate(overlay->delta_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, delta_offset, block_size) == 0) {
+            mark_present(overlay, block);
+            return true;
+        }
+#endif
+        void* zeros = calloc(1, length);
+        bool ok = write_all(overlay->delta_fd, zeros, length, delta_offset + in_block);
+        free(zeros);
+
+        if (ok && !present) {
+            mark_present(overlay, block);
+        }
+
+        return ok;
+    }
+
+    if (!write_all(overlay->delta_fd, data, length, delta_offset + in_block)) {
+        return false;
+    }
+
+    if (!present) {
+        mark_present(overlay, block);
+    }
+
+    return true;
+}
+
+static bool load_delta(fat_overlay_t* overlay, const fat_overlay_header_t* expected) {
+    fat_overlay_header_t header;
+
+    if (pread(overlay->delta_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return false;
+    }
+
+    if (memcmp(header.magic, FAT_OVERLAY_MAGIC, sizeof(header.magic)) != 0 || header.version != FAT_OVERLAY_VERSION
+        || header.block_size != expected->block_size || header.shift != expected->shift
+        || header.volume_serial != expected->volume_serial || header.base_size != expected->base_size) {
+        return false;
+    }
+
+    overlay->header = header;
+
+    return pread(overlay->delta_fd, overlay->present, overlay->bitmap_size, OVERLAY_BITMAP_OFFSET) == (ssize_t)overlay->bitmap_size;
+}
+
+static bool create_delta(fat_overlay_t* overlay, const fat_overlay_header_t* header) {
+    uint64_t align = header->block_size > 4096 ? header->block_size : 4096;
+
+    overlay->header = *header;
+    overlay->header.data_offset = (OVERLAY_BITMAP_OFFSET + overlay->bitmap_size + align - 1) / align * align;
+
+    // Full size up front, the blocks stay holes until written.
+    if (ftruncate(overlay->delta_fd, overlay->header.data_offset + overlay->block_count * header->block_size) != 0) {
+        return false;
+    }
+
+    overlay->bitmap_dirty = true;
+
+    return fat_overlay_sync(overlay);
+}
+
+// Opens `delta_path`, creating an empty delta if the file does not exist or is empty.
+// Returns NULL if an existing delta was made for another base or geometry.
+fat_overlay_t* fat_overlay_open(const char* base_path, int base_fd, const char* delta_path,
+                                uint32_t block_size, uint32_t shift, uint32_t volume_serial) {
+    struct stat base_stat;
+
+    if (block_size == 0 || fstat(base_fd, &base_stat) != 0) {
+        return NULL;
+    }
+
+    int delta_fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+
+    if (delta_fd < 0) {
+        return NULL;
+    }
+
+    fat_overlay_header_t header = {0};
+    memcpy(header.magic, FAT_OVERLAY_MAGIC, sizeof(header.magic));
+    header.version = FAT_OVERLAY_VERSION;
+    header.block_size = block_size;
+    header.shift = shift;
+    header.volume_serial = volume_serial;
+    header.base_size = base_stat.st_size;
+
+    fat_overlay_t* overlay = calloc(1, sizeof(fat_overlay_t));
+    overlay->base_fd = base_fd;
+    overlay->delta_fd = delta_fd;
+    overlay->block_count = (header.base_size + shift + block_size - 1) / block_size;
+    overlay->bitmap_size = (overlay->block_count + 7) / 8;
+    overlay->present = calloc(1, overlay->bitmap_size ? overlay->bitmap_size : 1);
+
+    struct stat delta_stat;
+    bool ok = fstat(delta_fd, &delta_stat) == 0
+              && (delta_stat.st_size == 0 ? create_delta(overlay, &header) : load_delta(overlay, &header));
+
+    if (!ok) {
+        close(delta_fd);
+        free(overlay->present);
+        free(overlay);
+        return NULL;
+    }
+
+    overlay->base_path = strdup(base_path);
+    pthread_mutex_init(&overlay->lock, NULL);
+
+    return overlay;
+}
+
+void fat_overlay_close(fat_overlay_t* overlay) {
+    fat_overlay_sync(overlay);
+
+    close(overlay->delta_fd);
+    pthread_mutex_destroy(&overlay->lock);
+
+    free(overlay->base_path);
+    free(overlay->present);
+    free(overlay);
+}
+
+// Reads runs of blocks from the same side with one call each.
+size_t fat_overlay_read(fat_overlay_t* overlay, size_t offset, void* buffer, size_t size) {
+    uint32_t block_size = overlay->header.block_size;
+    size_t done = 0;
+
+    while (done < size) {
+        uint64_t position = offset + done + overlay->header.shift;
+        uint64_t block = position / block_size;
+        bool present = block < overlay->block_count && block_present(overlay, block);
+        size_t length = block_size - position % block_size;
+
+        while (done + length < size && block + 1 < overlay->block_count && block_present(overlay, block + 1) == present) {
+            length += block_size;
+            block++;
+        }
+
+        if (length > size - done) {
+            length = size - done;
+        }
+
+        ssize_t result = present ? pread(overlay->delta_fd, (char*)buffer + done, length, overlay->header.data_offset + position)
+                                 : pread(overlay->base_fd, (char*)buffer + done, length, offset + done);
+
+        if (result <= 0) {
+            break;
+        }
+
+        done += result;
+
+        if ((size_t)result < length) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+size_t fat_overlay_write(fat_overlay_t* overlay, size_t offset, const void* buffer, size_t size) {
+    uint32_t block_size = overlay->header.block_size;
+    size_t done = 0;
+
+    pthread_mutex_lock(&overlay->lock);
+
+    while (done < size) {
+        uint64_t position = offset + done + overlay->header.shift;
+        uint64_t block = position / block_size;
+        uint32_t in_block = position % block_size;
+        uint32_t length = size - done < block_size - in_block ? size - done : block_size - in_block;
+
+        if (block >= overlay->block_count || !write_block(overlay, block, in_block, (const char*)buffer + done, length)) {
+            break;
+        }
+
+        done += length;
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+
+    return done;
+}
+
+void fat_overlay_zero(fat_overlay_t* overlay, size_t offset, size_t size) {
+    uint32_t block_size = overlay->header.block_size;
+    size_t done = 0;
+
+    pthread_mutex_lock(&overlay->lock);
+
+    while (done < size) {
+        uint64_t position = offset + done + overlay->header.shift;
+        uint64_t block = position / block_size;
+        uint32_t in_block = position % block_size;
+        uint32_t length = size - done < block_size - in_block ? size - done : block_size - in_block;
+
+        if (block >= overlay->block_count || !write_block(overlay, block, in_block, NULL, length)) {
+            break;
+        }
+
+        done += length;
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+}
+
+// Persists the header and the bitmap, so the delta can be reopened later.
+bool fat_overlay_sync(fat_overlay_t* overlay) {
+    pthread_mutex_lock(&overlay->lock);
+
+    bool ok = true;
+
+    if (overlay->bitmap_dirty) {
+        overlay->bitmap_dirty = false;
+
+        ok = fdatasync(overlay->delta_fd) == 0
+             && write_all(overlay->delta_fd, &overlay->header, sizeof(overlay->header), 0)
+             && write_all(overlay->delta_fd, overlay->present, overlay->bitmap_size, OVERLAY_BITMAP_OFFSET)
+             && fdatasync(overlay->delta_fd) == 0;
+
+        if (!ok) {
+            overlay->bitmap_dirty = true;
+        }
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+
+    return ok;
+}
+
+// Blocks held in the delta.
+size_t fat_overlay_blocks(fat_overlay_t* overlay) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < overlay->bitmap_size; i++) {
+        count += __builtin_popcount(overlay->present[i]);
+    }
+
+    return count;
+}
+
+// Writes every block of the delta into the base image, then empties the delta.
+// On failure the delta is kept and the commit can be retried.
+bool fat_overlay_commit(fat_overlay_t* overlay) {
+    uint32_t block_size = overlay->header.block_size;
+    int base_fd = open(overlay->base_path, O_WRONLY);
+    bool ok = base_fd >= 0;
+    uint8_t* data = malloc(block_size);
+
+    pthread_mutex_lock(&overlay->lock);
+
+    for (uint64_t block = 0; ok && block < overlay->block_count; block++) {
+        if (!block_present(overlay, block)) {
+            continue;
+        }
+
+        int64_t start = (int64_t)(block * block_size) - overlay->header.shift;
+        int64_t from = start < 0 ? 0 : start;
+        int64_t to = start + block_size;
+
+        if (to > (int64_t)overlay->header.base_size) {
+            to = overlay->header.base_size;
+        }
+
+        ok = pread(overlay->delta_fd, data, block_size, overlay->header.data_offset + block * block_size) == block_size
+             && write_all(base_fd, data + (from - start), to - from, from);
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+
+    if (base_fd >= 0) {
+        ok = ok && fsync(base_fd) == 0;
+        close(base_fd);
+    }
+
+    free(data);
+
+    if (ok) {
+        fat_overlay_clear(overlay);
+    }
+
+    return ok;
+}
+
+// Forgets every change; reads see the base image again.
+void fat_overlay_clear(fat_overlay_t* overlay) {
+    uint64_t data_size = overlay->block_count * overlay->header.block_size;
+
+    pthread_mutex_lock(&overlay->lock);
+
+    memset(overlay->present, 0, overlay->bitmap_size);
+    overlay->bitmap_dirty = true;
+
+    // Give the space back; the data is unreachable either way once the bitmap is clear.
+    if (ftruncate(overlay->delta_fd, overlay->header.data_offset) == 0) {
+        int result = ftruncate(overlay->delta_fd, overlay->header.data_offset + data_size);
+        (void)result;
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+
+    fat_overlay_sync(overlay);
+}
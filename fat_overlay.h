@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Copy-on-write delta over a read-only base image. The image is split into blocks
+// (one cluster each, aligned to the data region); a block is copied to the delta the
+// first time it is written and read from there afterwards.
+//
+// Delta file layout: header, presence bitmap, then the blocks at their image offset
+// plus `shift`. Blocks never written stay holes, so a fresh delta costs no space.
+
+#define FAT_OVERLAY_MAGIC "FATDELTA"
+#define FAT_OVERLAY_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t shift;          // Bytes before image offset 0 in block 0
+    uint32_t volume_serial;  // Of the base, to refuse a delta made for another image
+    uint64_t base_size;
+    uint64_t data_offset;    // Where block 0 starts in the delta file
+} __attribute__((packed)) fat_overlay_header_t;
+
+typedef struct fat_overlay {
+    char* base_path;
+    int base_fd;
+    int delta_fd;
+
+    fat_overlay_header_t header;
+    uint64_t block_count;
+
+    uint8_t* present;  // One bit per block
+    size_t bitmap_size;
+    bool bitmap_dirty;
+
+    pthread_mutex_t lock;  // Serializes copy-ups and bitmap updates
+} fat_overlay_t;
+
+fat_overlay_t* fat_overlay_open(const char* base_path, int base_fd, const char* delta_path,
+                                uint32_t block_size, uint32_t shift, uint32_t volume_serial);
+void fat_overlay_close(fat_overlay_t* overlay);
+
+size_t fat_overlay_read(fat_overlay_t* overlay, size_t offset, void* buffer, size_t size);
+size_t fat_overlay_write(fat_overlay_t* overlay, size_t offset, const void* buffer, size_t size);
+void fat_overlay_zero(fat_overlay_t* overlay, size_t offset, size_t size);
+
+// Persists header and bitmap. Done by commit and close, or explicitly through
+// fat32_overlay_sync, not by every flush; blocks copied up since the last sync are
+// lost with the bitmap on a crash.
+bool fat_overlay_sync(fat_overlay_t* overlay);
+size_t fat_overlay_blocks(fat_overlay_t* overlay);
+bool fat_overlay_commit(fat_overlay_t* overlay);
+void fat_overlay_clear(fat_overlay_t* overlay);
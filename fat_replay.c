@@ -0,0 +1,410 @@
+// Replays a trace recorded with fat_trace_start against a copy of the image it started
+// on and reports throughput and latency next to the recorded ones. Built with `make replay`, run as:
+// fat32-replay [-j THREADS] [-s SPEED] TRACE IMAGE
+//
+// The threads of the trace are spread over THREADS workers, each keeping the order of
+// its threads. SPEED scales the recorded timing (2 runs twice as fast), 0 issues
+// everything as fast as possible. Writes use a fixed pattern, traces carry no data.
+#include "fat32.h"
+#include "fat_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Traced clusters to replay clusters, open addressing.
+typedef struct {
+    uint64_t* keys;
+    uint64_t* values;
+    size_t capacity;
+    size_t count;
+    pthread_mutex_t lock;
+} cluster_map_t;
+
+typedef struct {
+    fat_histogram_t recorded[FAT_TRACE_OP_COUNT];
+    fat_histogram_t replayed[FAT_TRACE_OP_COUNT];
+    uint64_t skipped[FAT_TRACE_OP_COUNT];  // Unmapped clusters, writes to missing files
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} replay_stats_t;
+
+typedef struct {
+    fat_t fat;
+    pthread_rwlock_t lock;  // Engine lock, as in the FUSE daemon
+
+    const fat_trace_file_t* trace;
+    cluster_map_t map;
+    int workers;
+    double speed;
+    uint64_t started;
+} replay_t;
+
+typedef struct {
+    replay_t* replay;
+    int index;
+    replay_stats_t stats;
+
+    char* buffer;
+    size_t buffer_size;
+} replay_worker_t;
+
+static void map_put_locked(cluster_map_t* map, uint64_t key, uint64_t value);
+
+static void map_grow(cluster_map_t* map) {
+    uint64_t* keys = map->keys;
+    uint64_t* values = map->values;
+    size_t capacity = map->capacity;
+
+    map->capacity = capacity ? capacity * 2 : 1024;
+    map->keys = calloc(map->capacity, sizeof(uint64_t));
+    map->values = calloc(map->capacity, sizeof(uint64_t));
+    map->count = 0;
+
+    for (size_t i = 0; i < capacity; i++) {
+        if (keys[i]) {
+            map_put_locked(map, keys[i], values[i]);
+        }
+    }
+
+    free(keys);
+    free(values);
+}
+
+static void map_put_locked(cluster_map_t* map, uint64_t key, uint64_t value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        map_grow(map);
+    }
+
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) & (map->capacity - 1);
+
+    while (map->keys[slot] && map->keys[slot] != key) {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    map->count += map->keys[slot] == 0;
+    map->keys[slot] = key;
+    map->values[slot] = value;
+}
+
+static void map_put(cluster_map_t* map, uint64_t key, uint64_t value) {
+    if (key == 0 || value == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    map_put_locked(map, key, value);
+    pthread_mutex_unlock(&map->lock);
+}
+
+// 0 if the cluster was never seen.
+static uint64_t map_get(cluster_map_t* map, uint64_t key) {
+    uint64_t value = 0;
+
+    pthread_mutex_lock(&map->lock);
+
+    if (map->capacity) {
+        size_t slot = (key * 0x9E3779B97F4A7C15ULL) & (map->capacity - 1);
+
+        while (map->keys[slot] && map->keys[slot] != key) {
+            slot = (slot + 1) & (map->capacity - 1);
+        }
+
+        value = map->keys[slot] ? map->values[slot] : 0;
+    }
+
+    pthread_mutex_unlock(&map->lock);
+
+    return value;
+}
+
+static char* worker_buffer(replay_worker_t* worker, size_t size) {
+    if (size > worker->buffer_size) {
+        worker->buffer = realloc(worker->buffer, size);
+
+        for (size_t i = worker->buffer_size; i < size; i++) {
+            worker->buffer[i] = (char)(i * 31 + 7);
+        }
+
+        worker->buffer_size = size;
+    }
+
+    return worker->buffer;
+}
+
+static void free_listing(direntry_t* entries) {
+    while (entries) {
+        direntry_t* next = entries->next;
+
+        free(entries->name);
+        free(entries);
+
+        entries = next;
+    }
+}
+
+// Runs one record and stores how long it took, returns false if it had to be skipped.
+static bool replay_entry(replay_worker_t* worker, const fat_trace_entry_t* entry, uint64_t* elapsed) {
+    replay_t* replay = worker->replay;
+    fat_t* fat = &replay->fat;
+    const fat_trace_record_t* record = &entry->record;
+    bool mutates = record->op >= FAT_TRACE_CREATE && record->op != FAT_TRACE_READDIR && record->op != FAT_TRACE_READ;
+    uint64_t cluster = 0;
+
+    if (mutates) {
+        pthread_rwlock_wrlock(&replay->lock);
+    } else {
+        pthread_rwlock_rdlock(&replay->lock);
+    }
+
+    if (record->op == FAT_TRACE_CREATE || record->op == FAT_TRACE_READDIR || record->op == FAT_TRACE_READ) {
+        cluster = map_get(&replay->map, record->cluster);
+
+        // Reads through open files carry the path; their first cluster may not have been
+        // seen yet, e.g. a file that was empty when it was opened.
+        if (cluster == 0 && record->op == FAT_TRACE_READ && entry->name[0]) {
+            cluster = fat32_search(fat, entry->name);
+            map_put(&replay->map, record->cluster, cluster);
+        }
+
+        if (cluster == 0) {
+            pthread_rwlock_unlock(&replay->lock);
+            return false;
+        }
+    }
+
+    // fat32_write expects the file to exist. The check is not part of the timing.
+    if (record->op == FAT_TRACE_WRITE && fat32_search(fat, entry->name) == 0) {
+        pthread_rwlock_unlock(&replay->lock);
+        return false;
+    }
+
+    uint64_t started = fat_metrics_now();
+
+    switch (record->op) {
+    case FAT_TRACE_LOOKUP:
+        map_put(&replay->map, record->result, fat32_search(fat, entry->name));
+        break;
+    case FAT_TRACE_STAT:
+        fat32_get_file_size(fat, entry->name);
+        break;
+    case FAT_TRACE_CREATE:
+        map_put(&replay->map, record->result, fat32_create_file(fat, cluster, entry->name, record->flags));
+        break;
+    case FAT_TRACE_READDIR:
+        free_listing(read_directory(fat, cluster));
+        break;
+    case FAT_TRACE_READ:
+        // Reads are replayed for what they returned, so clipping at the end of the file matches.
+        worker->stats.bytes_read += read_cluster_chain_advanced(fat, cluster, record->offset, record->result, false,
+                                                                worker_buffer(worker, record->result));
+        break;
+    case FAT_TRACE_WRITE:
+        // Like reads, writes cut short when traced (a full volume) are replayed for what they wrote.
+        fat32_write(fat, entry->name, record->offset, record->result, worker_buffer(worker, record->result));
+        worker->stats.bytes_written += record->result;
+        break;
+    case FAT_TRACE_TRUNCATE:
+        fat32_truncate(fat, entry->name, record->size);
+        break;
+    case FAT_TRACE_UNLINK:
+        fat32_unlink(fat, entry->name);
+        break;
+    case FAT_TRACE_COPY:
+        fat32_copy(fat, entry->name, entry->name2);
+        break;
+    case FAT_TRACE_FLUSH:
+        fat32_flush(fat);
+        break;
+    }
+
+    *elapsed = fat_metrics_now() - started;
+
+    pthread_rwlock_unlock(&replay->lock);
+
+    return true;
+}
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = fat_metrics_now();
+
+    if (deadline > now) {
+        struct timespec ts = {(deadline - now) / 1000000000, (deadline - now) % 1000000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void* replay_worker(void* arg) {
+    replay_worker_t* worker = arg;
+    replay_t* replay = worker->replay;
+
+    for (size_t i = 0; i < replay->trace->count; i++) {
+        const fat_trace_entry_t* entry = &replay->trace->entries[i];
+        const fat_trace_record_t* record = &entry->record;
+
+        if (record->op >= FAT_TRACE_OP_COUNT || record->thread % replay->workers != worker->index) {
+            continue;
+        }
+
+        if (replay->speed > 0) {
+            sleep_until(replay->started + (uint64_t)(record->start / replay->speed));
+        }
+
+        uint64_t elapsed;
+
+        if (replay_entry(worker, entry, &elapsed)) {
+            fat_histogram_record(&worker->stats.replayed[record->op], elapsed);
+            fat_histogram_record(&worker->stats.recorded[record->op], record->duration);
+        } else {
+            worker->stats.skipped[record->op]++;
+        }
+    }
+
+    return NULL;
+}
+
+static void merge_histogram(fat_histogram_t* into, const fat_histogram_t* from) {
+    into->count += from->count;
+    into->total_ns += from->total_ns;
+    into->max_ns = from->max_ns > into->max_ns ? from->max_ns : into->max_ns;
+
+    for (size_t i = 0; i < FAT_HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+static void print_report(const replay_stats_t* stats, uint64_t elapsed) {
+    uint64_t operations = 0;
+    double seconds = elapsed / 1e9;
+
+    printf("%-9s %9s %8s | %10s %10s | %10s %10s %10s %10s\n", "op", "count", "skipped", "rec p50", "rec p99",
+           "p50", "p99", "p99.9", "max");
+
+    for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+        const fat_histogram_t* recorded = &stats->recorded[op];
+        const fat_histogram_t* replayed = &stats->replayed[op];
+
+        operations += replayed->count;
+
+        if (replayed->count == 0 && stats->skipped[op] == 0) {
+            continue;
+        }
+
+        printf("%-9s %9llu %8llu | %8.1fus %8.1fus | %8.1fus %8.1fus %8.1fus %8.1fus\n", fat_trace_op_name(op),
+               (unsigned long long)replayed->count, (unsigned long long)stats->skipped[op],
+               fat_histogram_percentile(recorded, 50) / 1e3, fat_histogram_percentile(recorded, 99) / 1e3,
+               fat_histogram_percentile(replayed, 50) / 1e3, fat_histogram_percentile(replayed, 99) / 1e3,
+               fat_histogram_percentile(replayed, 99.9) / 1e3, replayed->max_ns / 1e3);
+    }
+
+    printf("\n%llu operations in %.3f s: %.0f ops/s, read %.1f MB/s, written %.1f MB/s\n",
+           (unsigned long long)operations, seconds, operations / seconds, stats->bytes_read / seconds / 1e6,
+           stats->bytes_written / seconds / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    int workers = 1;
+    double speed = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "j:s:")) != -1) {
+        switch (option) {
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind + 2 != argc || workers <= 0 || speed < 0) {
+        fprintf(stderr, "usage: %s [-j THREADS] [-s SPEED] TRACE IMAGE\n", argv[0]);
+        return 1;
+    }
+
+    fat_trace_file_t trace;
+
+    if (!fat_trace_load(argv[optind], &trace)) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+
+    if (access(argv[optind + 1], R_OK | W_OK) != 0) {
+        perror(argv[optind + 1]);
+        fat_trace_free(&trace);
+        return 1;
+    }
+
+    replay_t* replay = calloc(1, sizeof(replay_t));
+
+    fat32_init(argv[optind + 1], &replay->fat);
+    pthread_rwlock_init(&replay->lock, NULL);
+    pthread_mutex_init(&replay->map.lock, NULL);
+
+    if (replay->fat.cluster_size != trace.header.cluster_size) {
+        fprintf(stderr, "warning: trace was recorded with %u byte clusters, image has %u\n",
+                trace.header.cluster_size, replay->fat.cluster_size);
+    }
+
+    map_put(&replay->map, trace.header.root_cluster, replay->fat.fat->root_directory_offset_in_clusters);
+
+    replay->trace = &trace;
+    replay->workers = workers;
+    replay->speed = speed;
+
+    replay_worker_t* pool = calloc(workers, sizeof(replay_worker_t));
+    pthread_t* threads = calloc(workers, sizeof(pthread_t));
+
+    replay->started = fat_metrics_now();
+
+    for (int i = 0; i < workers; i++) {
+        pool[i].replay = replay;
+        pool[i].index = i;
+        pthread_create(&threads[i], NULL, replay_worker, &pool[i]);
+    }
+
+    replay_stats_t total = {0};
+
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+
+        for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+            merge_histogram(&total.recorded[op], &pool[i].stats.recorded[op]);
+            merge_histogram(&total.replayed[op], &pool[i].stats.replayed[op]);
+            total.skipped[op] += pool[i].stats.skipped[op];
+        }
+
+        total.bytes_read += pool[i].stats.bytes_read;
+        total.bytes_written += pool[i].stats.bytes_written;
+        free(pool[i].buffer);
+    }
+
+    uint64_t elapsed = fat_metrics_now() - replay->started;
+
+    if (speed > 0) {
+        printf("%zu records, %d workers, speed %g\n\n", trace.count, workers, speed);
+    } else {
+        printf("%zu records, %d workers, speed max\n\n", trace.count, workers);
+    }
+
+    print_report(&total, elapsed);
+
+    fat32_deinit(&replay->fat);
+    pthread_rwlock_destroy(&replay->lock);
+    pthread_mutex_destroy(&replay->map.lock);
+
+    free(replay->map.keys);
+    free(replay->map.values);
+    free(replay);
+    free(pool);
+    free(threads);
+    fat_trace_free(&trace);
+
+    return 0;
+}
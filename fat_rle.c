@@ -0,0 +1,127 @@
+#include "fat_rle.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Run-length index over the FAT, used by read-only mounts instead of the page cache.
+// Clusters must be appended in ascending order.
+
+void fat_rle_init(fat_rle_t* rle) {
+    memset(rle, 0, sizeof(fat_rle_t));
+}
+
+static void* grow(void* array, size_t count, size_t elem_size) {
+    // Double the capacity every time count reaches a power of two.
+    if (count == 0 || (count & (count - 1)) == 0) {
+        return realloc(array, (count ? count * 2 : 16) * elem_size);
+    }
+
+    return array;
+}
+
+void fat_rle_append(fat_rle_t* rle, uint32_t cluster, uint32_t value) {
+    if (value == 0) {
+        fat_extent_t* last = rle->free_extent_count ? &rle->free_extents[rle->free_extent_count - 1] : NULL;
+
+        if (last && last->start + last->length == cluster) {
+            last->length++;
+            return;
+        }
+
+        rle->free_extents = grow(rle->free_extents, rle->free_extent_count, sizeof(fat_extent_t));
+        rle->free_extents[rle->free_extent_count++] = (fat_extent_t){cluster, 1};
+        return;
+    }
+
+    fat_run_t* last = rle->run_count ? &rle->runs[rle->run_count - 1] : NULL;
+
+    // Previous cluster points at this one, so the run goes on.
+    if (last && last->start + last->length == cluster && last->next == cluster) {
+        last->length++;
+        last->next = value;
+        return;
+    }
+
+    rle->runs = grow(rle->runs, rle->run_count, sizeof(fat_run_t));
+    rle->runs[rle->run_count++] = (fat_run_t){cluster, 1, value};
+}
+
+void fat_rle_finish(fat_rle_t* rle) {
+    if (rle->run_count) {
+        rle->runs = realloc(rle->runs, rle->run_count * sizeof(fat_run_t));
+    }
+
+    if (rle->free_extent_count) {
+        rle->free_extents = realloc(rle->free_extents, rle->free_extent_count * sizeof(fat_extent_t));
+    }
+}
+
+static inline bool fat_rle_contains(const fat_run_t* run, uint32_t cluster) {
+    return cluster >= run->start && cluster - run->start < run->length;
+}
+
+static inline uint32_t fat_rle_value(const fat_run_t* run, uint32_t cluster) {
+    return cluster == run->start + run->length - 1 ? run->next : cluster + 1;
+}
+
+uint32_t fat_rle_lookup(fat_rle_t* rle, uint32_t cluster) {
+    if (rle->run_count == 0) {
+        return 0;
+    }
+
+    // Fast path: same run as last time, or the one the last run jumped into.
+    fat_run_t* run = &rle->runs[rle->last_run];
+    if (fat_rle_contains(run, cluster)) {
+        return fat_rle_value(run, cluster);
+    }
+
+    size_t lo = 0;
+    size_t hi = rle->run_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (rle->runs[mid].start <= cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return 0;
+    }
+
+    run = &rle->runs[lo - 1];
+    if (!fat_rle_contains(run, cluster)) {
+        return 0;  // Not part of any run, so it is free
+    }
+
+    rle->last_run = lo - 1;
+
+    return fat_rle_value(run, cluster);
+}
+
+uint32_t fat_rle_free_clusters(const fat_rle_t* rle) {
+    uint32_t free_clusters = 0;
+
+    for (size_t i = 0; i < rle->free_extent_count; i++) {
+        free_clusters += rle->free_extents[i].length;
+    }
+
+    return free_clusters;
+}
+
+size_t fat_rle_memory_usage(const fat_rle_t* rle) {
+    return sizeof(fat_rle_t)
+        + rle->run_count * sizeof(fat_run_t)
+        + rle->free_extent_count * sizeof(fat_extent_t);
+}
+
+void fat_rle_destroy(fat_rle_t* rle) {
+    free(rle->runs);
+    free(rle->free_extents);
+
+    memset(rle, 0, sizeof(fat_rle_t));
+}
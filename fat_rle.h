@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Clusters start..start+length-1 are linked one after another,
+// the last one points to `next`.
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    uint32_t next;
+} fat_run_t;
+
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} fat_extent_t;
+
+typedef struct {
+    fat_run_t* runs;
+    size_t run_count;
+
+    fat_extent_t* free_extents;  // Runs of free clusters, in ascending order
+    size_t free_extent_count;
+
+    size_t last_run;  // Chain walks are mostly sequential, try this run first
+} fat_rle_t;
+
+void fat_rle_init(fat_rle_t* rle);
+void fat_rle_append(fat_rle_t* rle, uint32_t cluster, uint32_t value);
+void fat_rle_finish(fat_rle_t* rle);
+uint32_t fat_rle_lookup(fat_rle_t* rle, uint32_t cluster);
+uint32_t fat_rle_free_clusters(const fat_rle_t* rle);
+size_t fat_rle_memory_usage(const fat_rle_t* rle);
+void fat_rle_destroy(fat_rle_t* rle);
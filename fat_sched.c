@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+
+#include "fat_sched.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Dispatcher threads unless fat_sched_options_t.dispatchers says otherwise.
+#define FAT_SCHED_DISPATCHERS 4
+
+typedef struct request {
+    bool write;
+    bool zero;  // fat32_zero_range, dispatched alone
+    size_t offset;
+    size_t size;
+    const struct iovec* iov;
+    int count;
+
+    fat_sched_class_t cls;
+    bool urgent;  // See fat_sched_set_urgent, queued as foreground
+    uint64_t queued;
+
+    size_t done;
+    bool complete;
+    pthread_cond_t cond;
+
+    struct request* next;  // In the queue of its class, sorted by offset
+} request_t;
+
+typedef struct {
+    double bytes;
+    double ops;
+} bucket_t;
+
+typedef struct fat_sched {
+    fat_t* fat;
+    fat_sched_options_t options;
+
+    pthread_t* threads;  // options.dispatchers of them, each with one request in flight
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // Something was queued, or stop was set
+    bool stop;
+
+    request_t* queues[FAT_SCHED_CLASSES];
+    bucket_t buckets[FAT_SCHED_CLASSES];
+    uint64_t refilled;
+    size_t head;  // Where the last dispatch ended
+
+    fat_sched_stats_t stats;
+} fat_sched_t;
+
+static __thread fat_sched_class_t current_class = FAT_SCHED_FOREGROUND;
+static __thread bool current_urgent;
+
+fat_sched_class_t fat_sched_set_class(fat_sched_class_t cls) {
+    fat_sched_class_t previous = current_class;
+
+    current_class = cls < FAT_SCHED_CLASSES ? cls : FAT_SCHED_BACKGROUND;
+
+    return previous;
+}
+
+fat_sched_class_t fat_sched_get_class(void) {
+    return current_class;
+}
+
+bool fat_sched_set_urgent(bool urgent) {
+    bool previous = current_urgent;
+
+    current_urgent = urgent;
+
+    return previous;
+}
+
+static double bucket_depth(const fat_sched_limit_t* limit, double rate) {
+    return rate * (limit->burst_ms ? limit->burst_ms : 100) / 1000.0;
+}
+
+static void refill(fat_sched_t* sched, uint64_t now) {
+    double seconds = (now - sched->refilled) / 1e9;
+
+    for (int i = 0; i < FAT_SCHED_CLASSES; i++) {
+        const fat_sched_limit_t* limit = &sched->options.limits[i];
+        bucket_t* bucket = &sched->buckets[i];
+
+        if (limit->bytes_per_second) {
+            double depth = bucket_depth(limit, limit->bytes_per_second);
+
+            bucket->bytes += seconds * limit->bytes_per_second;
+            bucket->bytes = bucket->bytes > depth ? depth : bucket->bytes;
+        }
+
+        if (limit->ops_per_second) {
+            double depth = bucket_depth(limit, limit->ops_per_second);
+
+            bucket->ops += seconds * limit->ops_per_second;
+            bucket->ops = bucket->ops > depth ? depth : bucket->ops;
+        }
+    }
+
+    sched->refilled = now;
+}
+
+static bool has_budget(const fat_sched_t* sched, int cls) {
+    const fat_sched_limit_t* limit = &sched->options.limits[cls];
+
+    return (limit->bytes_per_second == 0 || sched->buckets[cls].bytes > 0)
+           && (limit->ops_per_second == 0 || sched->buckets[cls].ops > 0);
+}
+
+// Nanoseconds until the class has budget again.
+static uint64_t time_to_budget(const fat_sched_t* sched, int cls) {
+    const fat_sched_limit_t* limit = &sched->options.limits[cls];
+    double seconds = 0;
+
+    if (limit->bytes_per_second && sched->buckets[cls].bytes <= 0) {
+        seconds = (1 - sched->buckets[cls].bytes) / limit->bytes_per_second;
+    }
+
+    if (limit->ops_per_second && sched->buckets[cls].ops <= 0) {
+        double wait = (1 - sched->buckets[cls].ops) / limit->ops_per_second;
+        seconds = wait > seconds ? wait : seconds;
+    }
+
+    return seconds * 1e9 + 1;
+}
+
+// Picks the request to dispatch next and returns the link pointing to it. Urgent requests
+// go first, then requests past max_wait_ms, then the highest class with budget, where the
+// first request at or after the head wins (the lowest one once the sweep reaches the end).
+static request_t** pick(fat_sched_t* sched, uint64_t now, uint64_t* sleep_ns) {
+    uint64_t max_wait = (uint64_t)(sched->options.max_wait_ms ? sched->options.max_wait_ms : 500) * 1000000;
+    request_t** oldest = NULL;
+
+    for (request_t** link = &sched->queues[FAT_SCHED_FOREGROUND]; *link; link = &(*link)->next) {
+        if ((*link)->urgent) {
+            return link;
+        }
+    }
+
+    for (int cls = 0; cls < FAT_SCHED_CLASSES; cls++) {
+        for (request_t** link = &sched->queues[cls]; *link; link = &(*link)->next) {
+            if (now - (*link)->queued > max_wait && (oldest == NULL || (*link)->queued < (*oldest)->queued)) {
+                oldest = link;
+            }
+        }
+    }
+
+    if (oldest) {
+        sched->stats.classes[(*oldest)->cls].aged++;
+        return oldest;
+    }
+
+    *sleep_ns = max_wait;
+
+    for (int cls = 0; cls < FAT_SCHED_CLASSES; cls++) {
+        if (sched->queues[cls] == NULL) {
+            continue;
+        }
+
+        if (!has_budget(sched, cls)) {
+            uint64_t wait = time_to_budget(sched, cls);
+
+            *sleep_ns = wait < *sleep_ns ? wait : *sleep_ns;
+            sched->stats.classes[cls].throttled++;
+            continue;
+        }
+
+        request_t** link = &sched->queues[cls];
+
+        while (*link && (*link)->offset < sched->head) {
+            link = &(*link)->next;
+        }
+
+        return *link ? link : &sched->queues[cls];
+    }
+
+    return NULL;
+}
+
+static bool queues_empty(const fat_sched_t* sched) {
+    for (int cls = 0; cls < FAT_SCHED_CLASSES; cls++) {
+        if (sched->queues[cls]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void* dispatcher(void* arg) {
+    fat_sched_t* sched = arg;
+    int max_merge = sched->options.max_merge;
+    struct iovec* vectors = calloc(max_merge, sizeof(struct iovec));
+    request_t** batch = calloc(max_merge, sizeof(request_t*));
+
+    pthread_mutex_lock(&sched->lock);
+
+    while (true) {
+        while (!sched->stop && queues_empty(sched)) {
+            pthread_cond_wait(&sched->work, &sched->lock);
+        }
+
+        if (queues_empty(sched)) {
+            break;
+        }
+
+        uint64_t now = fat_metrics_now();
+        uint64_t sleep_ns = 0;
+
+        refill(sched, now);
+
+        request_t** link = pick(sched, now, &sleep_ns);
+
+        if (link == NULL) {
+            struct timespec deadline;
+            uint64_t until = now + sleep_ns;
+
+            deadline.tv_sec = until / 1000000000;
+            deadline.tv_nsec = until % 1000000000;
+            pthread_cond_timedwait(&sched->work, &sched->lock, &deadline);
+            continue;
+        }
+
+        // Take the request and the ones that continue it in the same direction. Zeroing, and
+        // a request with more vectors than fit, goes out alone.
+        request_t* first = *link;
+        const struct iovec* io_vectors = vectors;
+        size_t end = first->offset;
+        int batched = 0;
+        int vector_count = 0;
+
+        if (first->zero || first->count > max_merge) {
+            io_vectors = first->iov;
+            vector_count = first->count;
+            batch[batched++] = first;
+            end += first->size;
+            *link = first->next;
+        }
+
+        while (io_vectors == vectors && *link && (*link)->offset == end && (*link)->write == first->write
+               && !(*link)->zero && vector_count + (*link)->count <= max_merge) {
+            request_t* request = *link;
+
+            memcpy(vectors + vector_count, request->iov, request->count * sizeof(struct iovec));
+            vector_count += request->count;
+
+            batch[batched++] = request;
+            end += request->size;
+            *link = request->next;
+        }
+
+        fat_sched_class_stats_t* stats = &sched->stats.classes[first->cls];
+        bucket_t* bucket = &sched->buckets[first->cls];
+
+        // Zeroing moves no data, it is charged as an operation only.
+        if (!first->urgent) {
+            bucket->bytes -= first->zero ? 0 : end - first->offset;
+            bucket->ops -= 1;
+        }
+
+        stats->dispatches++;
+        stats->bytes += first->zero ? 0 : end - first->offset;
+        sched->stats.seeks += first->offset != sched->head;
+        sched->head = end;
+
+        for (int i = 0; i < batched; i++) {
+            fat_histogram_record(&sched->stats.classes[batch[i]->cls].wait, now - batch[i]->queued);
+        }
+
+        pthread_mutex_unlock(&sched->lock);
+
+        size_t moved = first->size;
+
+        if (first->zero) {
+            fat32_device_zero(sched->fat, first->offset, first->size);
+        } else {
+            moved = fat32_device_io(sched->fat, first->write, first->offset, io_vectors, vector_count);
+        }
+
+        pthread_mutex_lock(&sched->lock);
+
+        for (int i = 0; i < batched; i++) {
+            request_t* request = batch[i];
+
+            request->done = moved < request->size ? moved : request->size;
+            request->complete = true;
+            moved -= request->done;
+
+            pthread_cond_signal(&request->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    free(vectors);
+    free(batch);
+
+    return NULL;
+}
+
+// Wakes the dispatchers to drain the queues and waits for them to exit.
+static void stop_dispatchers(fat_sched_t* sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = true;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->thread_count; i++) {
+        pthread_join(sched->threads[i], NULL);
+    }
+}
+
+static void free_sched(fat_sched_t* sched) {
+    pthread_cond_destroy(&sched->work);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->threads);
+    free(sched);
+}
+
+bool fat_sched_attach(fat_t* fat, const fat_sched_options_t* options) {
+    fat_sched_t* sched = calloc(1, sizeof(fat_sched_t));
+    pthread_condattr_t attr;
+
+    sched->fat = fat;
+
+    if (options) {
+        sched->options = *options;
+    }
+
+    // Merged calls go to preadv/pwritev, which take at most IOV_MAX vectors.
+    if (sched->options.max_merge <= 0) {
+        sched->options.max_merge = 256;
+    }
+
+    if (sched->options.max_merge > IOV_MAX) {
+        sched->options.max_merge = IOV_MAX;
+    }
+
+    if (sched->options.dispatchers <= 0) {
+        sched->options.dispatchers = FAT_SCHED_DISPATCHERS;
+    }
+
+    sched->refilled = fat_metrics_now();
+
+    for (int cls = 0; cls < FAT_SCHED_CLASSES; cls++) {
+        const fat_sched_limit_t* limit = &sched->options.limits[cls];
+
+        sched->buckets[cls].bytes = bucket_depth(limit, limit->bytes_per_second);
+        sched->buckets[cls].ops = bucket_depth(limit, limit->ops_per_second);
+    }
+
+    // Deadlines are computed from fat_metrics_now, which is CLOCK_MONOTONIC.
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->work, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&sched->lock, NULL);
+
+    sched->threads = calloc(sched->options.dispatchers, sizeof(pthread_t));
+
+    while (sched->thread_count < sched->options.dispatchers
+           && pthread_create(&sched->threads[sched->thread_count], NULL, dispatcher, sched) == 0) {
+        sched->thread_count++;
+    }
+
+    if (sched->thread_count < sched->options.dispatchers) {
+        stop_dispatchers(sched);
+        free_sched(sched);
+        return false;
+    }
+
+    fat->sched = sched;
+
+    return true;
+}
+
+void fat_sched_detach(fat_t* fat) {
+    fat_sched_t* sched = fat->sched;
+
+    if (sched == NULL) {
+        return;
+    }
+
+    stop_dispatchers(sched);
+
+    fat->sched = NULL;
+
+    free_sched(sched);
+}
+
+// Queues a prepared request and waits until a dispatcher has completed it.
+static size_t submit(fat_sched_t* sched, request_t* request) {
+    request->urgent = current_urgent;
+    request->cls = current_urgent ? FAT_SCHED_FOREGROUND : current_class;
+    request->queued = fat_metrics_now();
+    pthread_cond_init(&request->cond, NULL);
+
+    pthread_mutex_lock(&sched->lock);
+
+    request_t** link = &sched->queues[request->cls];
+
+    while (*link && (*link)->offset <= request->offset) {
+        link = &(*link)->next;
+    }
+
+    request->next = *link;
+    *link = request;
+
+    sched->stats.classes[request->cls].requests++;
+    sched->stats.urgent += request->urgent;
+    pthread_cond_signal(&sched->work);
+
+    while (!request->complete) {
+        pthread_cond_wait(&request->cond, &sched->lock);
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    pthread_cond_destroy(&request->cond);
+
+    return request->done;
+}
+
+size_t fat_sched_submit(fat_sched_t* sched, bool write, size_t offset, const struct iovec* iov, int count) {
+    request_t request = {0};
+
+    for (int i = 0; i < count; i++) {
+        request.size += iov[i].iov_len;
+    }
+
+    if (request.size == 0) {
+        return 0;
+    }
+
+    request.write = write;
+    request.offset = offset;
+    request.iov = iov;
+    request.count = count;
+
+    return submit(sched, &request);
+}
+
+void fat_sched_submit_zero(fat_sched_t* sched, size_t offset, size_t size) {
+    request_t request = {0};
+
+    if (size == 0) {
+        return;
+    }
+
+    request.write = true;
+    request.zero = true;
+    request.offset = offset;
+    request.size = size;
+
+    submit(sched, &request);
+}
+
+void fat_sched_get_stats(fat_t* fat, fat_sched_stats_t* stats) {
+    fat_sched_t* sched = fat->sched;
+
+    memset(stats, 0, sizeof(fat_sched_stats_t));
+
+    if (sched) {
+        pthread_mutex_lock(&sched->lock);
+        *stats = sched->stats;
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+void fat_sched_dump(const fat_sched_stats_t* stats, FILE* out) {
+    static const char* names[FAT_SCHED_CLASSES] = {"foreground", "background"};
+
+    for (int cls = 0; cls < FAT_SCHED_CLASSES; cls++) {
+        const fat_sched_class_stats_t* s = &stats->classes[cls];
+
+        fprintf(out, "%-10s requests %llu dispatches %llu bytes %llu throttled %llu aged %llu"
+                     " wait p50 %llu p99 %llu max %llu ns\n",
+                names[cls], (unsigned long long)s->requests, (unsigned long long)s->dispatches,
+                (unsigned long long)s->bytes, (unsigned long long)s->throttled, (unsigned long long)s->aged,
+                (unsigned long long)fat_histogram_percentile(&s->wait, 50),
+                (unsigned long long)fat_histogram_percentile(&s->wait, 99), (unsigned long long)s->wait.max_ns);
+    }
+
+    fprintf(out, "seeks %llu urgent %llu\n", (unsigned long long)stats->seeks, (unsigned long long)stats->urgent);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "fat32.h"
+
+// I/O scheduler between the engine and the image. Every read, write and zeroing of an image
+// with a scheduler attached is queued under the priority class of the calling thread and
+// handed to the device by a small pool of dispatcher threads, one request in flight each,
+// which:
+//  - serves the highest class that has requests and budget left,
+//  - orders the requests of a class by offset, sweeping upwards (C-SCAN),
+//  - merges requests that continue each other into one vectored call.
+// Callers block until their request is done, so ordering within a thread is unchanged.
+
+typedef enum {
+    FAT_SCHED_FOREGROUND = 0,  // Lookups and file I/O, the default of every thread
+    FAT_SCHED_BACKGROUND,      // Checking, defragmentation, compaction, prefetch
+    FAT_SCHED_CLASSES
+} fat_sched_class_t;
+
+// Budgets are token buckets refilled continuously; 0 means unlimited. A request is let
+// through while its class has tokens left and may drive the bucket negative, so large
+// requests are never stuck.
+typedef struct {
+    uint64_t bytes_per_second;
+    uint32_t ops_per_second;
+    uint32_t burst_ms;  // Bucket depth in time at the given rates, 0 means 100 ms
+} fat_sched_limit_t;
+
+typedef struct {
+    fat_sched_limit_t limits[FAT_SCHED_CLASSES];
+    uint32_t max_wait_ms;  // Requests waiting longer go first regardless of class, 0 means 500 ms
+    int max_merge;         // Vectors per merged call, 0 means 256, at most IOV_MAX
+    int dispatchers;       // Requests in flight at once, 0 means 4
+} fat_sched_options_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t dispatches;  // Device calls, fewer than requests when merged
+    uint64_t bytes;
+    uint64_t throttled;   // Times the class had work but no budget
+    uint64_t aged;        // Dispatches forced by max_wait_ms
+    fat_histogram_t wait; // Queueing delay
+} fat_sched_class_stats_t;
+
+typedef struct {
+    fat_sched_class_stats_t classes[FAT_SCHED_CLASSES];
+    uint64_t seeks;   // Dispatches that did not continue where the previous one ended
+    uint64_t urgent;  // Requests issued under fat_sched_set_urgent
+} fat_sched_stats_t;
+
+// Starts the dispatchers and routes all I/O of `fat` through them. NULL options use the
+// defaults: no budgets, so classes only differ in priority.
+bool fat_sched_attach(fat_t* fat, const fat_sched_options_t* options);
+
+// Drains the queues and stops the dispatchers. Called by fat32_deinit.
+void fat_sched_detach(fat_t* fat);
+
+// Sets the class of the calling thread and returns the previous one.
+fat_sched_class_t fat_sched_set_class(fat_sched_class_t cls);
+fat_sched_class_t fat_sched_get_class(void);
+
+// Marks the calling thread's I/O as urgent and returns the previous setting. Urgent
+// requests go out before both classes and are not charged to any budget. FAT pages are
+// read and written under fat_lock, so a throttled background thread would otherwise
+// hold up the FAT lookups of every foreground thread.
+bool fat_sched_set_urgent(bool urgent);
+
+// Queues one request and waits for it. Returns the bytes transferred.
+size_t fat_sched_submit(struct fat_sched* sched, bool write, size_t offset, const struct iovec* iov, int count);
+// Same for fat32_device_zero over a range; never merged with other requests.
+void fat_sched_submit_zero(struct fat_sched* sched, size_t offset, size_t size);
+
+void fat_sched_get_stats(fat_t* fat, fat_sched_stats_t* stats);
+void fat_sched_dump(const fat_sched_stats_t* stats, FILE* out);
@@ -0,0 +1,245 @@
+#include "fat_trace.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Records are collected here and written out in blocks of this size.
+#define TRACE_BUFFER_SIZE (256 * 1024)
+
+typedef struct fat_trace {
+    int fd;
+    uint64_t started;  // fat_metrics_now at fat_trace_start
+
+    pthread_mutex_t lock;
+    char* buffer;
+    size_t used;
+    uint16_t threads;  // Ids handed out so far
+} fat_trace_t;
+
+static __thread unsigned trace_depth;
+static __thread uint16_t trace_thread;
+
+static const char* op_names[FAT_TRACE_OP_COUNT] = {
+    "lookup", "stat", "create", "readdir", "read", "write", "truncate", "unlink", "copy", "flush",
+};
+
+const char* fat_trace_op_name(fat_trace_op_t op) {
+    return op < FAT_TRACE_OP_COUNT ? op_names[op] : "unknown";
+}
+
+static void flush_buffer(fat_trace_t* trace) {
+    size_t done = 0;
+
+    while (done < trace->used) {
+        ssize_t result = write(trace->fd, trace->buffer + done, trace->used - done);
+
+        if (result <= 0) {
+            break;
+        }
+
+        done += result;
+    }
+
+    trace->used = 0;
+}
+
+bool fat_trace_start(fat_t* fat, const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    fat_trace_t* trace = calloc(1, sizeof(fat_trace_t));
+    fat_trace_header_t header = {0};
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    memcpy(header.magic, FAT_TRACE_MAGIC, sizeof(header.magic));
+    header.version = FAT_TRACE_VERSION;
+    header.cluster_size = fat->cluster_size;
+    header.root_cluster = fat->fat->root_directory_offset_in_clusters;
+    header.started = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    trace->fd = fd;
+    trace->started = fat_metrics_now();
+    trace->buffer = malloc(TRACE_BUFFER_SIZE);
+    pthread_mutex_init(&trace->lock, NULL);
+
+    memcpy(trace->buffer, &header, sizeof(header));
+    trace->used = sizeof(header);
+
+    fat->trace = trace;
+
+    return true;
+}
+
+void fat_trace_stop(fat_t* fat) {
+    fat_trace_t* trace = fat->trace;
+
+    if (trace == NULL) {
+        return;
+    }
+
+    fat->trace = NULL;
+
+    flush_buffer(trace);
+    close(trace->fd);
+
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->buffer);
+    free(trace);
+}
+
+uint64_t fat_trace_enter(fat_t* fat) {
+    (void)fat;
+
+    trace_depth++;
+
+    return fat_metrics_now();
+}
+
+// Appends one record and its names. Called with start and duration filled in.
+static void append_record(fat_trace_t* trace, fat_trace_record_t* record, const char* name, const char* name2) {
+    size_t name_length = name ? strlen(name) : 0;
+    size_t name2_length = name2 ? strlen(name2) : 0;
+
+    name_length = name_length > UINT16_MAX ? UINT16_MAX : name_length;
+    name2_length = name2_length > UINT16_MAX ? UINT16_MAX : name2_length;
+
+    record->name_length = name_length;
+    record->name2_length = name2_length;
+
+    size_t length = sizeof(fat_trace_record_t) + name_length + name2_length;
+
+    pthread_mutex_lock(&trace->lock);
+
+    if (trace_thread == 0) {
+        trace_thread = ++trace->threads;
+    }
+
+    record->thread = trace_thread;
+
+    if (trace->used + length > TRACE_BUFFER_SIZE) {
+        flush_buffer(trace);
+    }
+
+    memcpy(trace->buffer + trace->used, record, sizeof(fat_trace_record_t));
+    memcpy(trace->buffer + trace->used + sizeof(fat_trace_record_t), name, name_length);
+    memcpy(trace->buffer + trace->used + sizeof(fat_trace_record_t) + name_length, name2, name2_length);
+    trace->used += length;
+
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void fat_trace_leave(fat_t* fat, uint64_t started, fat_trace_record_t* record, const char* name, const char* name2) {
+    fat_trace_t* trace = fat->trace;
+
+    if (--trace_depth > 0 || trace == NULL) {
+        return;
+    }
+
+    record->start = started > trace->started ? started - trace->started : 0;
+    record->duration = fat_metrics_now() - started;
+
+    append_record(trace, record, name, name2);
+}
+
+void fat_trace_leave_many(fat_t* fat, uint64_t started, fat_trace_record_t* records, const char* const* names, size_t count) {
+    fat_trace_t* trace = fat->trace;
+
+    if (--trace_depth > 0 || trace == NULL || count == 0) {
+        return;
+    }
+
+    uint64_t duration = fat_metrics_now() - started;
+
+    for (size_t i = 0; i < count; i++) {
+        records[i].start = started > trace->started ? started - trace->started : 0;
+        records[i].duration = duration / count;
+
+        append_record(trace, &records[i], names[i], NULL);
+    }
+}
+
+bool fat_trace_load(const char* path, fat_trace_file_t* trace) {
+    FILE* file = fopen(path, "rb");
+
+    memset(trace, 0, sizeof(fat_trace_file_t));
+
+    if (file == NULL) {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* data = malloc(file_size);
+    bool ok = fread(data, 1, file_size, file) == file_size && file_size >= sizeof(fat_trace_header_t);
+
+    fclose(file);
+
+    if (ok) {
+        memcpy(&trace->header, data, sizeof(fat_trace_header_t));
+        ok = memcmp(trace->header.magic, FAT_TRACE_MAGIC, sizeof(trace->header.magic)) == 0
+             && trace->header.version == FAT_TRACE_VERSION;
+    }
+
+    // Names are copied out with terminators; each record is larger than the two NULs.
+    size_t capacity = 0;
+    size_t names_used = 0;
+    size_t offset = sizeof(fat_trace_header_t);
+
+    if (ok) {
+        trace->names = malloc(file_size);
+    }
+
+    while (ok && offset + sizeof(fat_trace_record_t) <= file_size) {
+        fat_trace_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+
+        size_t length = sizeof(record) + record.name_length + record.name2_length;
+
+        if (offset + length > file_size) {
+            break;  // Cut off by a crash
+        }
+
+        if (trace->count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            trace->entries = realloc(trace->entries, capacity * sizeof(fat_trace_entry_t));
+        }
+
+        fat_trace_entry_t* entry = &trace->entries[trace->count++];
+        char* names = trace->names + names_used;
+
+        memcpy(names, data + offset + sizeof(record), record.name_length);
+        names[record.name_length] = '\0';
+        memcpy(names + record.name_length + 1, data + offset + sizeof(record) + record.name_length, record.name2_length);
+        names[record.name_length + 1 + record.name2_length] = '\0';
+
+        entry->record = record;
+        entry->name = names;
+        entry->name2 = names + record.name_length + 1;
+
+        names_used += record.name_length + record.name2_length + 2;
+        offset += length;
+    }
+
+    free(data);
+
+    if (!ok) {
+        fat_trace_free(trace);
+    }
+
+    return ok;
+}
+
+void fat_trace_free(fat_trace_file_t* trace) {
+    free(trace->entries);
+    free(trace->names);
+    memset(trace, 0, sizeof(fat_trace_file_t));
+}
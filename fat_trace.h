@@ -0,0 +1,93 @@
+#pragma once
+
+#include "fat32.h"
+
+// Workload traces. While a trace is attached every public operation is appended to it
+// with its arguments, result and timing; fat32-replay (fat_replay.c) runs a trace again
+// against another image. Only the outermost call of a thread is recorded, the lookups
+// fat32_write does internally are not. File data is not recorded.
+//
+// File layout: fat_trace_header_t, then records, each followed by its names.
+
+#define FAT_TRACE_MAGIC "FATTRACE"
+#define FAT_TRACE_VERSION 1
+
+typedef enum {
+    FAT_TRACE_LOOKUP = 0,  // fat32_search, fat32_file_open
+    FAT_TRACE_STAT,        // fat32_get_file_size, one per path of fat32_stat_batch
+    FAT_TRACE_CREATE,      // fat32_create_file
+    FAT_TRACE_READDIR,     // read_directory
+    FAT_TRACE_READ,        // read_cluster_chain_advanced, fat32_readv, fat32_file_readv
+    FAT_TRACE_WRITE,       // fat32_write, fat32_writev, fat32_file_writev
+    FAT_TRACE_TRUNCATE,    // fat32_truncate
+    FAT_TRACE_UNLINK,      // fat32_unlink
+    FAT_TRACE_COPY,        // fat32_copy
+    FAT_TRACE_FLUSH,       // fat32_flush
+    FAT_TRACE_OP_COUNT
+} fat_trace_op_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t root_cluster;
+    uint32_t reserved;
+    uint64_t started;  // CLOCK_REALTIME, ns
+} __attribute__((packed)) fat_trace_header_t;
+
+// Clusters are those of the traced image; replay maps them to its own through the
+// results of lookups and creates.
+typedef struct {
+    uint8_t op;
+    uint8_t flags;  // is_file for creates
+    uint16_t thread;
+    uint16_t name_length;   // Path (also of fat32_file_readv reads), or file name for creates
+    uint16_t name2_length;  // Destination of copies
+    uint64_t start;         // ns since the trace started
+    uint64_t duration;      // ns
+    uint64_t cluster;       // Directory of creates and listings, file of reads
+    uint64_t offset;
+    uint64_t size;
+    uint64_t result;
+} __attribute__((packed)) fat_trace_record_t;
+
+typedef struct {
+    fat_trace_record_t record;
+    const char* name;   // NUL-terminated, "" when absent
+    const char* name2;
+} fat_trace_entry_t;
+
+typedef struct {
+    fat_trace_header_t header;
+    fat_trace_entry_t* entries;
+    size_t count;
+    char* names;
+} fat_trace_file_t;
+
+// Starts appending to a new trace at `path`. Must not race with operations on `fat`,
+// neither must fat_trace_stop.
+bool fat_trace_start(fat_t* fat, const char* path);
+void fat_trace_stop(fat_t* fat);
+
+// Recording hooks used by fat32.c. fat_trace_begin returns 0 when nothing is recorded.
+uint64_t fat_trace_enter(fat_t* fat);
+void fat_trace_leave(fat_t* fat, uint64_t started, fat_trace_record_t* record, const char* name, const char* name2);
+// Ends a call that stands for several operations, like fat32_stat_batch over many paths:
+// records[i] is written with names[i] and an equal share of the time taken.
+void fat_trace_leave_many(fat_t* fat, uint64_t started, fat_trace_record_t* records, const char* const* names, size_t count);
+
+static inline uint64_t fat_trace_begin(fat_t* fat) {
+    return fat->trace ? fat_trace_enter(fat) : 0;
+}
+
+#define FAT_TRACE_END(fat, started, kind, name, name2, ...)                                              \
+    do {                                                                                                 \
+        if (started) {                                                                                   \
+            fat_trace_leave((fat), (started), &(fat_trace_record_t){.op = (kind), __VA_ARGS__}, (name), (name2)); \
+        }                                                                                                \
+    } while (0)
+
+bool fat_trace_load(const char* path, fat_trace_file_t* trace);
+void fat_trace_free(fat_trace_file_t* trace);
+
+const char* fat_trace_op_name(fat_trace_op_t op);
@@ -39,6 +39,50 @@ void utf16_to_utf8(const unsigned short* utf16, int utf16_length, unsigned char*
     }
 }
 
+size_t utf16_to_utf8_bounded(const unsigned short* utf16, int utf16_length, unsigned char* utf8, size_t capacity) {
+    size_t j = 0;
+
+    if (capacity == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < utf16_length;) {
+        unsigned int codepoint = utf16[i++];
+
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF && i < utf16_length && utf16[i] >= 0xDC00 && utf16[i] <= 0xDFFF) {
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (utf16[i++] - 0xDC00);
+        } else if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+            codepoint = 0xFFFD;
+        }
+
+        size_t length = codepoint < 0x80 ? 1 : codepoint < 0x800 ? 2 : codepoint < 0x10000 ? 3 : 4;
+
+        if (j + length >= capacity) {
+            break;
+        }
+
+        if (length == 1) {
+            utf8[j++] = (unsigned char)codepoint;
+        } else if (length == 2) {
+            utf8[j++] = 0xC0 | ((codepoint >> 6) & 0x1F);
+            utf8[j++] = 0x80 | (codepoint & 0x3F);
+        } else if (length == 3) {
+            utf8[j++] = 0xE0 | ((codepoint >> 12) & 0x0F);
+            utf8[j++] = 0x80 | ((codepoint >> 6) & 0x3F);
+            utf8[j++] = 0x80 | (codepoint & 0x3F);
+        } else {
+            utf8[j++] = 0xF0 | ((codepoint >> 18) & 0x07);
+            utf8[j++] = 0x80 | ((codepoint >> 12) & 0x3F);
+            utf8[j++] = 0x80 | ((codepoint >> 6) & 0x3F);
+            utf8[j++] = 0x80 | (codepoint & 0x3F);
+        }
+    }
+
+    utf8[j] = '\0';
+
+    return j;
+}
+
 void utf8_to_utf16(const char* utf8_str, unsigned short* utf16_str) {
     if (utf8_str == NULL || utf16_str == NULL) {
         // Handle invalid input parameters
@@ -1,4 +1,9 @@
 #pragma once
 
+#include <stddef.h>
+
 void utf16_to_utf8(const unsigned short* utf16, int utf16_length, unsigned char* utf8);
+// Stops at the last whole character that fits and always NUL-terminates; unpaired
+// surrogates become U+FFFD. Returns the length written, without the terminator.
+size_t utf16_to_utf8_bounded(const unsigned short* utf16, int utf16_length, unsigned char* utf8, size_t capacity);
 void utf8_to_utf16(const char* utf8_str, unsigned short* utf16_str);
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "fat_vfs.h"
+#include "fat_catalog.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+filesystem_t fat32_filesystem = {
+    .valid = true,
+    .name = "fat32",
+    .probe = fat32_vfs_probe,
+    .diropen = fat32_vfs_diropen,
+    .fileopen = fat32_vfs_fileopen,
+    .fileread = fat32_vfs_fileread,
+    .filewrite = fat32_vfs_filewrite,
+    .fileclose = fat32_vfs_fileclose,
+    .filepread = fat32_vfs_filepread,
+    .filepwrite = fat32_vfs_filepwrite,
+    .filepreadv = fat32_vfs_filepreadv,
+    .filepwritev = fat32_vfs_filepwritev,
+};
+
+static fat_t* get_fat(fs_object_t* fs) {
+    return fs->priv_data;
+}
+
+// Short entry of `path`, name[0] == 0 if there is none. The root has no entry of its
+// own and comes back as a directory starting at the root cluster. Entries served from
+// the catalog only carry the fields it keeps, with a placeholder name.
+static DirectoryEntry_t lookup(fat_t* fat, const char* path) {
+    DirectoryEntry_t entry = {0};
+
+    while (*path == '/') {
+        path++;
+    }
+
+    if (*path == '\0') {
+        uint32_t root = fat->fat->root_directory_offset_in_clusters;
+
+        memset(entry.name, ' ', sizeof(entry.name) + sizeof(entry.ext));
+        entry.name[0] = '/';
+        entry.attributes = ATTR_DIRECTORY;
+        entry.high_cluster = (root >> 16) & 0xFFFF;
+        entry.low_cluster = root & 0xFFFF;
+
+        return entry;
+    }
+
+    if (fat_catalog_usable(fat)) {
+        const fat_catalog_node_t* node = fat_catalog_lookup(fat->catalog, path);
+
+        if (node) {
+            memset(entry.name, ' ', sizeof(entry.name) + sizeof(entry.ext));
+            entry.name[0] = '/';
+            entry.attributes = node->attributes;
+            entry.high_cluster = (node->cluster >> 16) & 0xFFFF;
+            entry.low_cluster = node->cluster & 0xFFFF;
+            entry.file_size = node->size;
+            entry.creation_time = node->creation_time;
+            entry.creation_date = node->creation_date;
+            entry.modification_time = node->modification_time;
+            entry.modification_date = node->modification_date;
+        }
+
+        return entry;
+    }
+
+    // Trailing slashes do not start another component.
+    char* copy = strdup(path);
+    size_t length = strlen(copy);
+
+    while (length > 0 && copy[length - 1] == '/') {
+        copy[--length] = '\0';
+    }
+
+    char* name = strrchr(copy, '/');
+    name = name ? name + 1 : copy;
+
+    char* parent = calloc((name - copy) + 1, 1);
+    memcpy(parent, copy, name - copy);
+
+    size_t dir_cluster = fat32_search(fat, parent);
+
+    if (dir_cluster != 0) {
+        entry = fat32_read_file_info(fat, dir_cluster, name);
+    }
+
+    free(parent);
+    free(copy);
+
+    return entry;
+}
+
+bool fat32_vfs_probe(size_t disk_nr, fs_object_t* fs) {
+    (void)disk_nr;
+
+    fat_t* fat = get_fat(fs);
+
+    return fat && fat->fat && fat->fat->bytes_per_sector && fat->cluster_size
+           && memcmp(fat->fat->fs_type, "FAT32   ", sizeof(fat->fat->fs_type)) == 0;
+}
+
+// NULL for a missing path, a file, or an empty directory.
+direntry_t* fat32_vfs_diropen(fs_object_t* fs, const char* path) {
+    fat_t* fat = get_fat(fs);
+
+    if (fat_catalog_usable(fat)) {
+        const fat_catalog_node_t* node = fat_catalog_lookup(fat->catalog, path);
+
+        return node && (node->attributes & ATTR_DIRECTORY) ? fat_catalog_list(fat->catalog, node) : NULL;
+    }
+
+    DirectoryEntry_t entry = lookup(fat, path);
+
+    if (entry.name[0] == 0 || !(entry.attributes & ATTR_DIRECTORY)) {
+        return NULL;
+    }
+
+    direntry_t* entries = read_directory(fat, FAT_DIRENT_CLUSTER(&entry));
+
+    // "." and ".." are left to the caller, as in catalog listings.
+    direntry_t** link = &entries;
+
+    while (*link) {
+        direntry_t* current = *link;
+
+        if (strcmp(current->name, ".") == 0 || strcmp(current->name, "..") == 0) {
+            free(current->name);
+            *link = current->next;
+            free(current);
+        } else {
+            link = &current->next;
+        }
+    }
+
+    return entries;
+}
+
+void fat32_vfs_dirclose(direntry_t* entries) {
+    fat32_free_directory(entries);
+}
+
+NFILE* fat32_vfs_fileopen(fs_object_t* fs, const char* path) {
+    fat32_file_t* file = malloc(sizeof(fat32_file_t));
+
+    if (!fat32_file_open(get_fat(fs), path, file)) {
+        free(file);
+        return NULL;
+    }
+
+    NFILE* fp = calloc(1, sizeof(NFILE));
+    fp->path = file->path;
+    fp->size = file->size;
+    fp->_obj = fs;
+    fp->priv_data = file;
+
+    return fp;
+}
+
+// fread semantics: returns whole items, stops at the end of the file.
+size_t fat32_vfs_fileread(fs_object_t* fs, void* data, size_t size, size_t count, NFILE* fp) {
+    size_t length = size * count;
+
+    if (size == 0 || fp->position >= fp->size) {
+        return 0;
+    }
+
+    if (length > fp->size - fp->position) {
+        length = (fp->size - fp->position) / size * size;
+    }
+
+    size_t done = fat32_vfs_filepread(fs, data, length, fp->position, fp);
+
+    fp->position += done;
+
+    return done / size;
+}
+
+size_t fat32_vfs_filewrite(fs_object_t* fs, const void* data, size_t size, size_t count, NFILE* fp) {
+    size_t done = fat32_vfs_filepwrite(fs, data, size * count, fp->position, fp);
+
+    fp->position += done;
+
+    return size ? done / size : 0;
+}
+
+size_t fat32_vfs_filepread(fs_object_t* fs, void* data, size_t size, size_t offset, NFILE* fp) {
+    struct iovec vector = {data, size};
+
+    return fat32_vfs_filepreadv(fs, &vector, 1, offset, fp);
+}
+
+size_t fat32_vfs_filepwrite(fs_object_t* fs, const void* data, size_t size, size_t offset, NFILE* fp) {
+    struct iovec vector = {(void*)data, size};
+
+    return fat32_vfs_filepwritev(fs, &vector, 1, offset, fp);
+}
+
+size_t fat32_vfs_filepreadv(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp) {
+    return fat32_file_readv(get_fat(fs), fp->priv_data, offset, iov, iovcnt);
+}
+
+size_t fat32_vfs_filepwritev(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp) {
+    fat32_file_t* file = fp->priv_data;
+    size_t done = fat32_file_writev(get_fat(fs), file, offset, iov, iovcnt);
+
+    fp->size = file->size;
+
+    return done;
+}
+
+void fat32_vfs_filesync(fs_object_t* fs, NFILE* fp) {
+    fat32_file_sync(get_fat(fs), fp->priv_data);
+}
+
+void fat32_vfs_fileclose(fs_object_t* fs, NFILE* fp) {
+    fat32_file_close(get_fat(fs), fp->priv_data);
+
+    free(fp->priv_data);
+    free(fp);
+}
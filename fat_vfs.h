@@ -0,0 +1,24 @@
+#pragma once
+
+#include "fat32.h"
+#include "vfs.h"
+
+// fat32 driver for the vfs.h layer. fs_object_t.priv_data points to the mounted fat_t,
+// NFILE.priv_data holds the fat32_file_t of the open file.
+extern filesystem_t fat32_filesystem;
+
+bool fat32_vfs_probe(size_t disk_nr, fs_object_t* fs);
+direntry_t* fat32_vfs_diropen(fs_object_t* fs, const char* path);
+NFILE* fat32_vfs_fileopen(fs_object_t* fs, const char* path);
+size_t fat32_vfs_fileread(fs_object_t* fs, void* data, size_t size, size_t count, NFILE* fp);
+size_t fat32_vfs_filewrite(fs_object_t* fs, const void* data, size_t size, size_t count, NFILE* fp);
+void fat32_vfs_fileclose(fs_object_t* fs, NFILE* fp);
+// Writes an open file's size back to its entry and flushes; fat32_vfs_fileclose does too.
+void fat32_vfs_filesync(fs_object_t* fs, NFILE* fp);
+size_t fat32_vfs_filepread(fs_object_t* fs, void* data, size_t size, size_t offset, NFILE* fp);
+size_t fat32_vfs_filepwrite(fs_object_t* fs, const void* data, size_t size, size_t offset, NFILE* fp);
+size_t fat32_vfs_filepreadv(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp);
+size_t fat32_vfs_filepwritev(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp);
+
+// Frees a list returned by fat32_vfs_diropen.
+void fat32_vfs_dirclose(direntry_t* entries);
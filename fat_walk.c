@@ -0,0 +1,379 @@
+#include "fat_walk.h"
+#include "fat_sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WALK_DEFAULT_MAX_QUEUED 4096
+
+typedef struct walk_dir {
+    struct walk_dir* parent;
+    uint32_t cluster;
+    size_t depth;
+    char* path;
+    fat32_dirent_t* dirent;  // NULL for the starting directory
+
+    size_t pending;  // This directory itself plus unfinished subdirectories
+    size_t files;
+    size_t directories;
+    size_t bytes;
+} walk_dir_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    walk_dir_t** items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} walk_deque_t;
+
+struct walker;
+
+typedef struct {
+    struct walker* walker;
+    size_t index;
+    walk_deque_t deque;
+} walk_worker_t;
+
+typedef struct walker {
+    fat_t* fat;
+    const fat_walk_options_t* options;
+    fat_walk_stats_t* stats;
+    size_t max_queued;
+    fat_sched_class_t io_class;  // Of the thread that started the walk
+
+    walk_worker_t* workers;
+    size_t worker_count;
+
+    size_t queued;       // Tasks sitting in deques
+    size_t outstanding;  // Queued plus running
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    size_t idle;
+} walker_t;
+
+typedef struct {
+    walk_worker_t* worker;
+    walk_dir_t* dir;
+} walk_dir_ctx_t;
+
+#define ATOMIC_ADD(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_SUB(ptr, value) __atomic_sub_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+
+static void walk_directory(walk_worker_t* worker, walk_dir_t* dir);
+
+static void deque_push(walk_deque_t* deque, walk_dir_t* dir) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(walk_dir_t*));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->items = realloc(deque->items, deque->capacity * sizeof(walk_dir_t*));
+        }
+    }
+
+    deque->items[deque->tail++] = dir;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Owner takes the newest task (depth first, keeps the working set small).
+static walk_dir_t* deque_pop(walk_deque_t* deque) {
+    walk_dir_t* dir = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail > deque->head) {
+        dir = deque->items[--deque->tail];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return dir;
+}
+
+// Thieves take the oldest task, which usually has the largest subtree.
+static walk_dir_t* deque_steal(walk_deque_t* deque) {
+    walk_dir_t* dir = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail > deque->head) {
+        dir = deque->items[deque->head++];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return dir;
+}
+
+static walk_dir_t* take_task(walk_worker_t* worker) {
+    walker_t* walker = worker->walker;
+    walk_dir_t* dir = deque_pop(&worker->deque);
+
+    for (size_t i = 1; dir == NULL && i < walker->worker_count; i++) {
+        dir = deque_steal(&walker->workers[(worker->index + i) % walker->worker_count].deque);
+    }
+
+    if (dir) {
+        ATOMIC_SUB(&walker->queued, 1);
+    }
+
+    return dir;
+}
+
+static void fill_node(fat_walk_node_t* node, const walk_dir_t* dir) {
+    memset(node, 0, sizeof(fat_walk_node_t));
+
+    node->path = dir->path[0] ? dir->path : "/";
+    node->dirent = dir->dirent;
+    node->depth = dir->depth;
+}
+
+// Drops one reference; the last one reports the directory and passes totals upwards.
+static void finish_directory(walker_t* walker, walk_dir_t* dir) {
+    while (dir && ATOMIC_SUB(&dir->pending, 1) == 0) {
+        walk_dir_t* parent = dir->parent;
+
+        if (walker->options->visit) {
+            fat_walk_node_t node;
+            fill_node(&node, dir);
+
+            node.files = ATOMIC_LOAD(&dir->files);
+            node.directories = ATOMIC_LOAD(&dir->directories);
+            node.bytes = ATOMIC_LOAD(&dir->bytes);
+
+            walker->options->visit(FAT_WALK_POST, &node, walker->options->ctx);
+        }
+
+        if (parent) {
+            ATOMIC_ADD(&parent->files, ATOMIC_LOAD(&dir->files));
+            ATOMIC_ADD(&parent->directories, ATOMIC_LOAD(&dir->directories) + 1);
+            ATOMIC_ADD(&parent->bytes, ATOMIC_LOAD(&dir->bytes));
+        }
+
+        free(dir->path);
+        free(dir->dirent);
+        free(dir);
+
+        dir = parent;
+    }
+}
+
+static bool walk_dirent(fat_t* fat, const fat32_dirent_t* dirent, void* ctx) {
+    (void)fat;
+    walk_dir_ctx_t* walk = ctx;
+    walk_dir_t* dir = walk->dir;
+    walker_t* walker = walk->worker->walker;
+    const fat_walk_options_t* options = walker->options;
+    const DirectoryEntry_t* entry = &dirent->entry;
+
+    if (entry->name[0] == '.' && (entry->name[1] == ' ' || entry->name[1] == '.')) {
+        return true;
+    }
+
+    size_t path_length = strlen(dir->path) + strlen(dirent->name) + 2;
+    char* path = malloc(path_length);
+    snprintf(path, path_length, "%s/%s", dir->path, dirent->name);
+
+    fat_walk_node_t node = {.path = path, .dirent = dirent, .depth = dir->depth + 1};
+
+    if (options->filter && !options->filter(&node, options->ctx)) {
+        free(path);
+        return true;
+    }
+
+    if (!(entry->attributes & ATTR_DIRECTORY)) {
+        ATOMIC_ADD(&dir->files, 1);
+        ATOMIC_ADD(&dir->bytes, entry->file_size);
+        ATOMIC_ADD(&walker->stats->files, 1);
+        ATOMIC_ADD(&walker->stats->bytes, entry->file_size);
+
+        if (options->visit) {
+            options->visit(FAT_WALK_FILE, &node, options->ctx);
+        }
+
+        free(path);
+        return true;
+    }
+
+    uint32_t cluster = FAT_DIRENT_CLUSTER(entry);
+
+    if (cluster < 2 || (options->max_depth && dir->depth + 1 > options->max_depth) || dir->depth >= 255) {
+        free(path);
+        return true;
+    }
+
+    walk_dir_t* child = calloc(1, sizeof(walk_dir_t));
+    child->parent = dir;
+    child->cluster = cluster;
+    child->depth = dir->depth + 1;
+    child->path = path;
+    child->pending = 1;
+    child->dirent = malloc(sizeof(fat32_dirent_t));
+    memcpy(child->dirent, dirent, sizeof(fat32_dirent_t));
+
+    ATOMIC_ADD(&dir->pending, 1);
+
+    // Over the queue budget: walk the subdirectory right here instead of queuing it.
+    if (ATOMIC_LOAD(&walker->queued) >= walker->max_queued) {
+        walk_directory(walk->worker, child);
+        return true;
+    }
+
+    ATOMIC_ADD(&walker->outstanding, 1);
+    ATOMIC_ADD(&walker->queued, 1);
+    deque_push(&walk->worker->deque, child);
+
+    if (ATOMIC_LOAD(&walker->idle)) {
+        pthread_mutex_lock(&walker->idle_lock);
+        pthread_cond_signal(&walker->idle_cond);
+        pthread_mutex_unlock(&walker->idle_lock);
+    }
+
+    return true;
+}
+
+static void walk_directory(walk_worker_t* worker, walk_dir_t* dir) {
+    walker_t* walker = worker->walker;
+    fat_walk_stats_t* stats = walker->stats;
+
+    ATOMIC_ADD(&stats->directories, 1);
+
+    size_t depth = ATOMIC_LOAD(&stats->max_depth);
+    while (dir->depth > depth && !__atomic_compare_exchange_n(&stats->max_depth, &depth, dir->depth, false,
+                                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+
+    if (walker->options->visit) {
+        fat_walk_node_t node;
+        fill_node(&node, dir);
+
+        walker->options->visit(FAT_WALK_PRE, &node, walker->options->ctx);
+    }
+
+    walk_dir_ctx_t ctx = {worker, dir};
+    fat32_iterate_directory(walker->fat, dir->cluster, 0, walk_dirent, &ctx);
+
+    finish_directory(walker, dir);
+}
+
+static void* walk_worker(void* arg) {
+    walk_worker_t* worker = arg;
+    walker_t* walker = worker->walker;
+
+    fat_sched_set_class(walker->io_class);
+
+    while (true) {
+        walk_dir_t* dir = take_task(worker);
+
+        if (dir) {
+            walk_directory(worker, dir);
+
+            if (ATOMIC_SUB(&walker->outstanding, 1) == 0) {
+                pthread_mutex_lock(&walker->idle_lock);
+                pthread_cond_broadcast(&walker->idle_cond);
+                pthread_mutex_unlock(&walker->idle_lock);
+            }
+
+            continue;
+        }
+
+        if (ATOMIC_LOAD(&walker->outstanding) == 0) {
+            break;
+        }
+
+        // Nothing to steal right now; sleep until a task is pushed or the walk ends.
+        pthread_mutex_lock(&walker->idle_lock);
+        walker->idle++;
+
+        if (ATOMIC_LOAD(&walker->queued) == 0 && ATOMIC_LOAD(&walker->outstanding) != 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&walker->idle_cond, &walker->idle_lock, &deadline);
+        }
+
+        walker->idle--;
+        pthread_mutex_unlock(&walker->idle_lock);
+    }
+
+    return NULL;
+}
+
+void fat32_walk(fat_t* fat, uint32_t start_cluster, const fat_walk_options_t* options, fat_walk_stats_t* stats) {
+    fat_walk_options_t default_options = {0};
+    fat_walk_stats_t local_stats;
+    walker_t walker = {0};
+
+    if (options == NULL) {
+        options = &default_options;
+    }
+
+    if (stats == NULL) {
+        stats = &local_stats;
+    }
+
+    memset(stats, 0, sizeof(fat_walk_stats_t));
+
+    walker.fat = fat;
+    walker.options = options;
+    walker.stats = stats;
+    walker.io_class = fat_sched_get_class();
+    walker.max_queued = options->max_queued ? options->max_queued : WALK_DEFAULT_MAX_QUEUED;
+    walker.worker_count = options->threads > 0 ? options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_init(&walker.idle_lock, NULL);
+    pthread_cond_init(&walker.idle_cond, NULL);
+
+    walker.workers = calloc(walker.worker_count, sizeof(walk_worker_t));
+    for (size_t i = 0; i < walker.worker_count; i++) {
+        walker.workers[i].walker = &walker;
+        walker.workers[i].index = i;
+        pthread_mutex_init(&walker.workers[i].deque.lock, NULL);
+    }
+
+    walk_dir_t* root = calloc(1, sizeof(walk_dir_t));
+    root->cluster = start_cluster;
+    root->path = calloc(1, 1);
+    root->pending = 1;
+
+    walker.outstanding = 1;
+    walker.queued = 1;
+    deque_push(&walker.workers[0].deque, root);
+
+    pthread_t* threads = calloc(walker.worker_count, sizeof(pthread_t));
+
+    for (size_t i = 0; i < walker.worker_count; i++) {
+        pthread_create(&threads[i], NULL, walk_worker, &walker.workers[i]);
+    }
+
+    for (size_t i = 0; i < walker.worker_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < walker.worker_count; i++) {
+        pthread_mutex_destroy(&walker.workers[i].deque.lock);
+        free(walker.workers[i].deque.items);
+    }
+
+    free(threads);
+    free(walker.workers);
+
+    pthread_cond_destroy(&walker.idle_cond);
+    pthread_mutex_destroy(&walker.idle_lock);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "fat32.h"
+
+typedef enum {
+    FAT_WALK_PRE,   // Directory entered, before any of its entries
+    FAT_WALK_FILE,
+    FAT_WALK_POST   // Directory and everything below it is done
+} fat_walk_event_t;
+
+typedef struct {
+    const char* path;
+    const fat32_dirent_t* dirent;  // NULL for the starting directory
+    size_t depth;                  // Starting directory is 0
+
+    // Subtree totals, only filled in for FAT_WALK_POST.
+    size_t files;
+    size_t directories;
+    size_t bytes;
+} fat_walk_node_t;
+
+// Return false to skip the entry (and everything below it for directories).
+typedef bool (*fat_walk_filter_fn_t)(const fat_walk_node_t* node, void* ctx);
+// Called from worker threads, possibly concurrently.
+typedef void (*fat_walk_visit_fn_t)(fat_walk_event_t event, const fat_walk_node_t* node, void* ctx);
+
+typedef struct {
+    int threads;                  // 0 means one per online CPU
+    size_t max_depth;             // 0 means no limit
+    size_t max_queued;            // Directories waiting in queues, 0 means 4096
+    fat_walk_filter_fn_t filter;  // May be NULL
+    fat_walk_visit_fn_t visit;    // May be NULL
+    void* ctx;
+} fat_walk_options_t;
+
+typedef struct {
+    size_t files;
+    size_t directories;
+    size_t bytes;
+    size_t max_depth;
+} fat_walk_stats_t;
+
+void fat32_walk(fat_t* fat, uint32_t start_cluster, const fat_walk_options_t* options, fat_walk_stats_t* stats);
@@ -1,47 +1,110 @@
 #include "lfn.h"
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void LFN2SFN(const char* in_filename, char* out_filename) {
-    int filename_len = strlen(in_filename);
-    char* temp = calloc(filename_len, 1);
+static bool sfn_valid_char(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("$%'-_@~`!(){}^#&", c) != NULL;
+}
+
+bool lfn_basis_name(const char* lfn, char sfn[11]) {
+    bool lossy = false;
+    size_t name_len = 0;
+    size_t ext_len = 0;
 
-    memset(out_filename, ' ', 11);
+    memset(sfn, ' ', 11);
+
+    // Leading dots and all spaces are dropped, the last dot starts the extension.
+    while(*lfn == '.') {
+        lfn++;
+        lossy = true;
+    }
 
-    size_t space_count = 0;
+    const char* dot = strrchr(lfn, '.');
+
+    for(const char* p = lfn; *p; p++) {
+        unsigned char c = (unsigned char)toupper((unsigned char)*p);
+
+        if(p == dot) {
+            continue;
+        }
 
-    for(int i = 0; i < filename_len; i++) {
-        if(in_filename[i] == ' ') {
-            space_count++;
+        if(c == ' ' || c == '.') {
+            lossy = true;
             continue;
         }
 
-        temp[i - space_count] = (char)toupper(in_filename[i]);
+        // Non-ASCII characters do not survive in an OEM name, one '_' per character.
+        if((c & 0xC0) == 0x80) {
+            lossy = true;
+            continue;
+        }
+
+        if(!sfn_valid_char(c)) {
+            c = '_';
+            lossy = true;
+        }
+
+        if(dot && p > dot) {
+            if(ext_len < 3) {
+                sfn[8 + ext_len++] = c;
+            } else {
+                lossy = true;
+            }
+        } else if(name_len < 8) {
+            sfn[name_len++] = c;
+        } else {
+            lossy = true;
+        }
     }
 
-    const char* temp_end = temp + filename_len - space_count;
+    if(name_len == 0) {
+        sfn[0] = '_';
+        lossy = true;
+    }
 
-    char* extension = strchr(temp, '.');
-    if(extension != NULL) {
-        int ext_len = temp_end - extension - 1;
+    return lossy;
+}
 
-        memcpy(out_filename + 11 - ext_len, extension + 1, ext_len);
+static void sfn_put_tail(char sfn[11], size_t keep, const char* tail) {
+    size_t tail_len = strlen(tail);
+    size_t name_len = 0;
 
-        int name_len = extension - temp;
+    while(name_len < 8 && sfn[name_len] != ' ') {
+        name_len++;
+    }
 
-        if(name_len > 8) {
-            memcpy(out_filename, temp, 6);
-            out_filename[6] = '~';
-            out_filename[7] = '1';
-        } else {
-            memcpy(out_filename, temp, name_len);
-        }
-    } else {
-        memcpy(out_filename, temp, filename_len);
+    if(keep > name_len) {
+        keep = name_len;
     }
 
-    free(temp);
+    if(keep > 8 - tail_len) {
+        keep = 8 - tail_len;
+    }
+
+    memset(sfn + keep, ' ', 8 - keep);
+    memcpy(sfn + keep, tail, tail_len);
+}
+
+void lfn_numeric_tail(char sfn[11], uint32_t n) {
+    char tail[10];
+    snprintf(tail, sizeof(tail), "~%u", n);
+
+    sfn_put_tail(sfn, 8, tail);
+}
+
+void lfn_hash_tail(char sfn[11], uint16_t hash, uint32_t n) {
+    char tail[12];
+    snprintf(tail, sizeof(tail), "%04X~%u", hash, n);
+
+    sfn_put_tail(sfn, 2, tail);
+}
+
+void LFN2SFN(const char* in_filename, char* out_filename) {
+    if(lfn_basis_name(in_filename, out_filename)) {
+        lfn_numeric_tail(out_filename, 1);
+    }
 }
 
 uint8_t lfn_checksum(const char sfn[11]) {
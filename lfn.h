@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
 	uint8_t attr_number;
@@ -14,4 +15,10 @@ typedef struct {
 } __attribute__((packed)) LFN_t;
 
 void LFN2SFN(const char *lfn, char *sfn);
+// Space padded 8.3 basis for a long name. Returns true when information was lost
+// and the name needs a tail to stay unique.
+bool lfn_basis_name(const char* lfn, char sfn[11]);
+// NAME~N, or the first two characters, four hex digits of `hash` and ~N.
+void lfn_numeric_tail(char sfn[11], uint32_t n);
+void lfn_hash_tail(char sfn[11], uint16_t hash, uint32_t n);
 uint8_t lfn_checksum(const char sfn[11]); 
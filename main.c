@@ -0,0 +1,36 @@
+#include "fat32.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main() {
+    fat_t myfat;
+
+    fat32_init("disk.img", &myfat);
+
+    printf("Cluster size: %d\n", myfat.cluster_size);
+    printf("Fat offset: %d\n", myfat.fat_offset);
+    printf("Fat size: %d\n", myfat.fat_size);
+    printf("Reserved FAT offset: %d\n", myfat.reserved_fat_offset);
+    printf("Root directory offset: %llu\n", (unsigned long long)myfat.root_directory_offset);
+    printf("Root directory cluster: %d\n", myfat.fat->root_directory_offset_in_clusters);
+    printf("Cluster base: %lld\n", (long long)myfat.cluster_base);
+
+    direntry_t* dir = read_directory(&myfat, myfat.fat->root_directory_offset_in_clusters);
+    direntry_t* orig = dir;
+
+    fast_traverse(dir);
+
+    //fat32_create_file(&myfat, 2, "Gavno", false);
+    //size_t cluster = fat32_create_file(&myfat, 2, "Pokemon.txt", true);
+
+    //printf("File at cluster: %zu\n", cluster);
+
+    char* memory = "Pikachu forever!!!\n";
+
+    //size_t cluster = fat32_create_file(&myfat, 2, "Pokemon.txt", true);
+
+    fat32_write(&myfat, "/Pokemon.txt", 4, strlen(memory), memory);
+
+    fat32_deinit(&myfat);
+}
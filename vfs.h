@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #define FILESYSTEM_MAX_COUNT 32
 #define MOUNTPOINTS_MAX_COUNT 32
@@ -67,6 +68,13 @@ typedef NFILE* (*fileopen_fn_t)(fs_object_t* fs, const char* path);
 typedef size_t (*fileread_fn_t)(fs_object_t* fs, void* data, size_t size, size_t count, NFILE* fp);
 typedef size_t (*filewrite_fn_t)(fs_object_t* fs, const void* data, size_t size, size_t count, NFILE* fp);
 typedef void (*fileclose_fn_t)(fs_object_t* fs, NFILE* file);
+
+// Positional variants take an explicit offset and leave fp->position alone, so one
+// NFILE can be shared between threads.
+typedef size_t (*filepread_fn_t)(fs_object_t* fs, void* data, size_t size, size_t offset, NFILE* fp);
+typedef size_t (*filepwrite_fn_t)(fs_object_t* fs, const void* data, size_t size, size_t offset, NFILE* fp);
+typedef size_t (*filepreadv_fn_t)(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp);
+typedef size_t (*filepwritev_fn_t)(fs_object_t* fs, const struct iovec* iov, int iovcnt, size_t offset, NFILE* fp);
 //typedef void (*dirclose_fn_t)(fs_object_t* fs, direntry_t* entry);
 
 typedef struct filesystem {
@@ -78,11 +86,17 @@ typedef struct filesystem {
     fileread_fn_t fileread;
     filewrite_fn_t filewrite;
     fileclose_fn_t fileclose;
+    filepread_fn_t filepread;      // Optional
+    filepwrite_fn_t filepwrite;    // Optional
+    filepreadv_fn_t filepreadv;    // Optional
+    filepwritev_fn_t filepwritev;  // Optional
 } filesystem_t;
 
 int find_free_fs_nr();
 int register_filesystem(const char* name, probe_fn_t probe, diropen_fn_t diropen, fileopen_fn_t fileopen,
                 fileread_fn_t fileread, filewrite_fn_t filewrite, fileclose_fn_t fileclose);
+// Registers a filled-in driver, including the optional callbacks register_filesystem has no parameters for.
+int register_filesystem_driver(const filesystem_t* filesystem);
 int find_free_mountpoint_nr();
 int register_mountpoint(size_t disk_nr, filesystem_t* fs, void* priv_data);
 void vfs_scan();
@@ -93,3 +107,7 @@ NFILE* nfopen(const char* path);
 void nfclose(NFILE* file);
 size_t nfread(void* buffer, size_t size, size_t count, NFILE* file);
 size_t nfwrite(const void* buffer, size_t size, size_t count, NFILE* file);
+size_t nfpread(void* buffer, size_t size, size_t offset, NFILE* file);
+size_t nfpwrite(const void* buffer, size_t size, size_t offset, NFILE* file);
+size_t nfpreadv(const struct iovec* iov, int iovcnt, size_t offset, NFILE* file);
+size_t nfpwritev(const struct iovec* iov, int iovcnt, size_t offset, NFILE* file);